@@ -0,0 +1,519 @@
+#pragma once
+
+// Content addressed store for saved attachments. Each attachment is hashed (xxHash64) as it is
+// written to a temporary file; content already in the store is dropped, new content is renamed
+// to its own file name, so an attachment forwarded many times is saved once. Files keep their
+// original names, with (n) added where different content has already taken the name; names in
+// use are kept in a table, filled from one listing of the directory, rather than probed for.
+// Content is read from the pst and written in fixed size chunks through reused buffers, so memory
+// does not depend on attachment size. Optionally a pool of writer threads does the disk writes,
+// so they overlap parsing and each other; a file is flushed to disk before it is renamed into place.
+//   attachments.idx       hash, size and file name of every stored blob (loaded on open)
+//   attachments.manifest  message id, attachment file name and blob, for every attachment saved
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include "BoundedQueue.h"
+#include "Platform.h"
+#include "Metrics.h"
+
+class CXXHash64 {
+	// Streaming xxHash64, seed 0
+private:
+	static const unsigned long long P1=11400714785074694791ULL;
+	static const unsigned long long P2=14029467366897019727ULL;
+	static const unsigned long long P3=1609587929392839161ULL;
+	static const unsigned long long P4=9650029242287828579ULL;
+	static const unsigned long long P5=2870177450012600261ULL;
+	unsigned long long m_v[4];
+	unsigned long long m_nTotal;
+	unsigned char m_buf[32];
+	size_t m_nBuf;
+
+	static unsigned long long Rotl(unsigned long long x, int r) { return (x<<r)|(x>>(64-r)); }
+	static unsigned long long Read64(const unsigned char* p)
+	{
+		unsigned long long n=0;
+		for(int i=7;i>=0;--i)n=(n<<8)|p[i];
+		return n;
+	}
+	static unsigned long long Read32(const unsigned char* p)
+	{
+		return (unsigned long long)p[0]|((unsigned long long)p[1]<<8)|((unsigned long long)p[2]<<16)|((unsigned long long)p[3]<<24);
+	}
+	static unsigned long long Round(unsigned long long acc, unsigned long long n)
+	{
+		acc+=n*P2;
+		acc=Rotl(acc,31);
+		return acc*P1;
+	}
+	static unsigned long long Merge(unsigned long long acc, unsigned long long v)
+	{
+		acc^=Round(0,v);
+		return acc*P1+P4;
+	}
+	void Stripe(const unsigned char* p)
+	{
+		for(int i=0;i<4;++i)m_v[i]=Round(m_v[i],Read64(p+8*i));
+	}
+public:
+	CXXHash64() { Reset(); }
+	void Reset()
+	{
+		m_v[0]=P1+P2;
+		m_v[1]=P2;
+		m_v[2]=0;
+		m_v[3]=0-P1;
+		m_nTotal=0;
+		m_nBuf=0;
+	}
+	void Update(const void* pData, size_t n)
+	{
+		const unsigned char* p=(const unsigned char*)pData;
+		m_nTotal+=n;
+		if(m_nBuf)
+		{
+			size_t nTake=std::min(n,32-m_nBuf);
+			memcpy(m_buf+m_nBuf,p,nTake);
+			m_nBuf+=nTake;
+			p+=nTake;
+			n-=nTake;
+			if(m_nBuf<32)return;
+			Stripe(m_buf);
+			m_nBuf=0;
+		}
+		for(;n>=32;p+=32,n-=32)Stripe(p);
+		memcpy(m_buf,p,n);
+		m_nBuf=n;
+	}
+	unsigned long long Digest() const
+	{
+		unsigned long long h;
+		if(m_nTotal>=32)
+		{
+			h=Rotl(m_v[0],1)+Rotl(m_v[1],7)+Rotl(m_v[2],12)+Rotl(m_v[3],18);
+			for(int i=0;i<4;++i)h=Merge(h,m_v[i]);
+		}
+		else
+		{
+			h=m_v[2]+P5;
+		}
+		h+=m_nTotal;
+		const unsigned char* p=m_buf;
+		size_t n=m_nBuf;
+		for(;n>=8;p+=8,n-=8)h=Rotl(h^Round(0,Read64(p)),27)*P1+P4;
+		if(n>=4)
+		{
+			h=Rotl(h^(Read32(p)*P1),23)*P2+P3;
+			p+=4;
+			n-=4;
+		}
+		for(;n>0;++p,--n)h=Rotl(h^(*p*P5),11)*P1;
+		h^=h>>33;
+		h*=P2;
+		h^=h>>29;
+		h*=P3;
+		h^=h>>32;
+		return h;
+	}
+};
+
+class CAttachmentStore {
+public:
+	struct CCounts {
+		// Outcomes for one caller, final once Flush returns
+		std::atomic<unsigned long> nSaved;
+		std::atomic<unsigned long> nDuplicate; // Content already stored
+		std::atomic<unsigned long> nFailed;
+		std::atomic<unsigned long> nPending; // Queued for the writers, not yet done
+		CCounts():nSaved(0),nDuplicate(0),nFailed(0),nPending(0) {}
+	};
+private:
+	enum EOp { eData, eDiscard, eCommit };
+	struct CWrite {
+		// One step in writing an attachment: a chunk of its content, or what to do with it once complete
+		EOp op;
+		unsigned long nFile;
+		std::vector<char> data;
+		std::string strKey, strBlob, strID, strFileName;
+		CCounts* pCounts;
+		CWrite():op(eData),nFile(0),pCounts(0) {}
+	};
+	struct CDuplicate {
+		// A copy of content still being written, recorded once that write is committed
+		std::string strID, strFileName;
+		CCounts* pCounts;
+	};
+	struct COpenFile {
+		FILE* fp;
+		bool bFailed;
+		unsigned long long nMicros; // Spent writing it so far, for the metrics
+		COpenFile():fp(0),bFailed(false),nMicros(0) {}
+	};
+	static const size_t m_nChunk=256*1024; // Content is read and written this much at a time
+	std::string m_strDir;
+	std::mutex m_mutex;
+	std::unordered_map<std::string, std::string> m_blobs; // Hash and size, as text, to file name
+	std::unordered_map<std::string, std::vector<CDuplicate> > m_writing; // Blobs not yet committed, with the copies waiting on them
+	std::unordered_set<std::string> m_names; // File names in use, lower case
+	std::unordered_map<std::string, unsigned int> m_nextSuffix; // Next (n) to try for a name
+	std::ofstream m_index;
+	std::ofstream m_manifest;
+	std::atomic<unsigned long> m_nTemp;
+	std::vector<std::vector<char> > m_spare; // Chunk buffers for reuse
+	size_t m_nMaxSpare;
+	std::mutex m_mutexSpare;
+	// With writer threads, parsers queue chunks and go on. Each file goes to one writer, so its
+	// chunks stay in order; memory is bounded by the queues.
+	std::vector<std::unique_ptr<CBoundedQueue<CWrite> > > m_queues;
+	std::vector<std::thread> m_writers;
+	std::mutex m_mutexDone;
+	std::condition_variable m_cvDone; // Signalled as queued attachments are finished
+	CMetrics* m_pMetrics; // Optional, shared by the run
+
+	CAttachmentStore(const CAttachmentStore&);
+	CAttachmentStore& operator=(const CAttachmentStore&);
+
+	static std::string Key(unsigned long long nHash, unsigned long long nBytes)
+	{
+		std::ostringstream ostrKey;
+		ostrKey << std::hex << std::setw(16) << std::setfill('0') << nHash << " " << std::dec << nBytes;
+		return ostrKey.str();
+	}
+	static std::string Lower(std::string str)
+	{
+		std::transform(str.begin(), str.end(), str.begin(), tolower);
+		return str;
+	}
+	static std::string SafeName(const std::string& strFileName, const std::string& strID)
+	{
+		// The name comes from the pst, so only its last component is used, without characters that
+		// are not allowed in names; what cannot be made a name falls back to the attachment's ID
+		size_t pos=strFileName.find_last_of("\\/:");
+		std::string strName=(pos==std::string::npos?strFileName:strFileName.substr(pos+1));
+		for(size_t i=0;i<strName.length();++i)
+		{
+			unsigned char c=(unsigned char)strName[i];
+			if(c<32||c==127||std::string("*?\"<>|").find((char)c)!=std::string::npos)strName[i]='_';
+		}
+		// Windows drops trailing dots and spaces, which would turn ". ." into ".."
+		while(!strName.empty()&&(strName[strName.length()-1]=='.'||strName[strName.length()-1]==' '))strName.erase(strName.length()-1);
+		if(strName.empty())return strID+".att";
+		// Device names are reserved whatever the extension
+		std::string strBase=Lower(strName.substr(0, strName.find('.')));
+		static const char* const reserved[]={"con","prn","aux","nul","com1","com2","com3","com4","com5","com6","com7","com8","com9","lpt1","lpt2","lpt3","lpt4","lpt5","lpt6","lpt7","lpt8","lpt9"};
+		for(size_t i=0;i<sizeof(reserved)/sizeof(reserved[0]);++i)
+			if(strBase==reserved[i])return "_"+strName;
+		return strName;
+	}
+	std::string TempName(unsigned long nFile) const
+	{
+		std::ostringstream ostrTemp;
+		ostrTemp << m_strDir << "~attachment" << nFile << ".tmp";
+		return ostrTemp.str();
+	}
+	std::string FreeName(const std::string& strFileName)
+	{
+		// The name itself, or name(n).ext for the lowest n not already taken
+		if(m_names.insert(Lower(strFileName)).second)return strFileName;
+		size_t pos=strFileName.rfind(".");
+		std::string strBase=(pos==std::string::npos?strFileName:strFileName.substr(0, pos));
+		std::string strExtn=(pos==std::string::npos?"":strFileName.substr(pos));
+		unsigned int& nNext=m_nextSuffix[Lower(strFileName)];
+		for(;;)
+		{
+			std::ostringstream ostrName;
+			ostrName << strBase << "(" << ++nNext << ")" << strExtn;
+			if(m_names.insert(Lower(ostrName.str())).second)return ostrName.str();
+		}
+	}
+	std::vector<char> TakeChunk()
+	{
+		std::vector<char> chunk;
+		{
+			std::lock_guard<std::mutex> lock(m_mutexSpare);
+			if(!m_spare.empty())
+			{
+				chunk.swap(m_spare.back());
+				m_spare.pop_back();
+			}
+		}
+		chunk.resize(m_nChunk); // Keeps the capacity of a reused buffer
+		return chunk;
+	}
+	void RecycleChunk(std::vector<char>& chunk)
+	{
+		std::lock_guard<std::mutex> lock(m_mutexSpare);
+		if(m_spare.size()<m_nMaxSpare)
+		{
+			m_spare.push_back(std::vector<char>());
+			m_spare.back().swap(chunk);
+		}
+	}
+	void Submit(CWrite& w, COpenFile& file)
+	{
+		// Straight to Apply, or to the file's writer thread
+		if(m_queues.empty())
+		{
+			Apply(w, file);
+			return;
+		}
+		size_t nBytes=w.data.size()+1;
+		m_queues[w.nFile%m_queues.size()]->Push(std::move(w), nBytes);
+	}
+	static bool SyncAndClose(FILE* fp)
+	{
+		// Content reaches the disk before the index refers to it
+		bool bOK=SyncFile(fp);
+		return fclose(fp)==0&&bOK;
+	}
+	void AddWriteTime(COpenFile& file, const std::chrono::steady_clock::time_point& start)
+	{
+		if(m_pMetrics)file.nMicros+=(unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count();
+	}
+	void Apply(CWrite& w, COpenFile& file)
+	{
+		// Carries out one step, counting the outcome once the attachment is finished with
+		std::chrono::steady_clock::time_point start;
+		if(m_pMetrics)start=std::chrono::steady_clock::now();
+		switch(w.op)
+		{
+		case eData:
+			if(!file.fp&&!file.bFailed)
+			{
+				file.fp=fopen(TempName(w.nFile).c_str(),"wb");
+				file.bFailed=(file.fp==0);
+			}
+			if(file.fp&&fwrite(&w.data[0],1,w.data.size(),file.fp)!=w.data.size())file.bFailed=true;
+			RecycleChunk(w.data);
+			AddWriteTime(file, start);
+			return;
+		case eDiscard:
+			if(file.fp)fclose(file.fp);
+			file.fp=0;
+			remove(TempName(w.nFile).c_str());
+			break;
+		case eCommit:
+			{
+				if(file.fp&&!SyncAndClose(file.fp))file.bFailed=true;
+				file.fp=0;
+				AddWriteTime(file, start);
+				if(m_pMetrics&&!file.bFailed)m_pMetrics->Observe(CMetrics::eStageAttachmentWrite, file.nMicros);
+				std::string strTemp=TempName(w.nFile);
+				bool bOK=!file.bFailed&&rename(strTemp.c_str(),(m_strDir+w.strBlob).c_str())==0;
+				if(!bOK)remove(strTemp.c_str());
+				std::vector<CDuplicate> duplicates;
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					duplicates.swap(m_writing[w.strKey]);
+					m_writing.erase(w.strKey);
+					if(bOK)
+					{
+						m_index << w.strKey << " " << w.strBlob << "\n";
+						m_index.flush();
+						Record(w.strID, w.strFileName, w.strBlob);
+						w.pCounts->nSaved++;
+					}
+					else
+					{
+						// Later copies of the content are saved afresh; those that waited on this one are lost with it
+						m_blobs.erase(w.strKey);
+						w.pCounts->nFailed++;
+					}
+					for(size_t i=0;i<duplicates.size();++i)
+					{
+						if(bOK)
+						{
+							Record(duplicates[i].strID, duplicates[i].strFileName, w.strBlob);
+							duplicates[i].pCounts->nDuplicate++;
+						}
+						else
+							duplicates[i].pCounts->nFailed++;
+					}
+				}
+				if(!m_queues.empty())
+				{
+					std::lock_guard<std::mutex> lock(m_mutexDone);
+					for(size_t i=0;i<duplicates.size();++i)duplicates[i].pCounts->nPending--;
+				}
+			}
+			break;
+		}
+		if(!m_queues.empty())
+		{
+			std::lock_guard<std::mutex> lock(m_mutexDone);
+			w.pCounts->nPending--;
+			m_cvDone.notify_all();
+		}
+	}
+	void Record(const std::string& strID, const std::string& strFileName, const std::string& strBlob)
+	{
+		// Called with m_mutex held
+		m_manifest << strID << "\t" << strFileName << "\t" << strBlob << "\n";
+		m_manifest.flush();
+	}
+	void WriterLoop(CBoundedQueue<CWrite>* pQueue)
+	{
+		std::unordered_map<unsigned long, COpenFile> files;
+		CWrite w;
+		while(pQueue->Pop(w))
+		{
+			Apply(w, files[w.nFile]);
+			if(w.op!=eData)files.erase(w.nFile);
+		}
+	}
+public:
+	CAttachmentStore(const std::string& strDir):m_strDir(strDir),m_nTemp(0),m_nMaxSpare(16),m_pMetrics(0)
+	{
+		if(m_strDir!=""&&m_strDir[m_strDir.length()-1]!='\\'&&m_strDir[m_strDir.length()-1]!='/')m_strDir+=PATH_SEPARATOR;
+	}
+	~CAttachmentStore()
+	{
+		Close();
+	}
+	bool Open(unsigned int nWriters=0, size_t nMaxQueuedBytes=64*1024*1024)
+	{
+		// Without writers, attachments are written by the thread saving them
+		// Every name in the directory is taken, whether or not the store wrote it
+		std::vector<CFoundFile> files=FindMatching(m_strDir+"*");
+		for(size_t i=0;i<files.size();++i)m_names.insert(Lower(files[i].strName));
+		std::ifstream index((m_strDir+"attachments.idx").c_str());
+		std::string strHash, strLine;
+		unsigned long long nBytes;
+		while(index >> strHash >> nBytes)
+		{
+			index.get();
+			std::getline(index, strLine);
+			std::ostringstream ostrKey;
+			ostrKey << strHash << " " << nBytes;
+			m_blobs[ostrKey.str()]=strLine;
+			m_names.insert(Lower(strLine));
+		}
+		index.close();
+		m_index.open((m_strDir+"attachments.idx").c_str(), std::ios::out|std::ios::app);
+		m_manifest.open((m_strDir+"attachments.manifest").c_str(), std::ios::out|std::ios::app);
+		if(nWriters>0)
+		{
+			size_t nPerQueue=std::max(m_nChunk+1, nMaxQueuedBytes/nWriters);
+			m_nMaxSpare=nMaxQueuedBytes/m_nChunk+16;
+			for(unsigned int i=0;i<nWriters;++i)
+				m_queues.push_back(std::unique_ptr<CBoundedQueue<CWrite> >(new CBoundedQueue<CWrite>(nPerQueue/m_nChunk+16, nPerQueue)));
+			for(unsigned int i=0;i<nWriters;++i)
+				m_writers.push_back(std::thread(&CAttachmentStore::WriterLoop, this, m_queues[i].get()));
+		}
+		return m_index.is_open()&&m_manifest.is_open();
+	}
+	void SetMetrics(CMetrics* pMetrics)
+	{
+		// Before any attachment is saved
+		m_pMetrics=pMetrics;
+	}
+	void Flush(CCounts& counts)
+	{
+		// Waits until every attachment counts was passed to has been written (or has failed)
+		std::unique_lock<std::mutex> lock(m_mutexDone);
+		while(counts.nPending>0)m_cvDone.wait(lock);
+	}
+	void Close()
+	{
+		// Lets the writers finish whatever is queued, then stops them
+		for(size_t i=0;i<m_queues.size();++i)m_queues[i]->Close();
+		for(size_t i=0;i<m_writers.size();++i)m_writers[i].join();
+		m_writers.clear();
+	}
+	template <typename Source> bool Save(Source& source, const std::string& strID, const std::string& strFileName, CCounts& counts)
+	{
+		// Source is a device with read(char*, std::streamsize) returning -1 at the end, such as an
+		// attachment's byte stream. Its content is hashed as it goes to a temporary file a chunk
+		// at a time, so memory does not grow with its size. The outcome is added to counts, which
+		// with writer threads may be after returning; false where it has already failed.
+		CWrite w;
+		w.nFile=m_nTemp++;
+		w.pCounts=&counts;
+		if(!m_queues.empty())counts.nPending++;
+		COpenFile file; // Used only without writer threads
+		CXXHash64 hash;
+		unsigned long long nBytes=0;
+		bool bReadFailed=false;
+		for(;;)
+		{
+			w.op=eData;
+			w.data=TakeChunk();
+			std::streamsize n=-1;
+			try {
+				n=source.read(&w.data[0],(std::streamsize)w.data.size());
+			}
+			catch(...)
+			{
+				bReadFailed=true;
+			}
+			if(n<=0)
+			{
+				RecycleChunk(w.data);
+				break;
+			}
+			w.data.resize((size_t)n);
+			hash.Update(&w.data[0],(size_t)n);
+			nBytes+=n;
+			Submit(w, file);
+		}
+		w.data.clear();
+		if(bReadFailed||nBytes==0||file.bFailed)
+		{
+			w.op=eDiscard;
+			Submit(w, file);
+			counts.nFailed++;
+			return false;
+		}
+		w.strKey=Key(hash.Digest(),nBytes);
+		std::string strName=SafeName(strFileName, strID);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::unordered_map<std::string, std::string>::const_iterator it=m_blobs.find(w.strKey);
+			std::unordered_map<std::string, std::vector<CDuplicate> >::iterator itWriting=m_writing.find(w.strKey);
+			if(itWriting!=m_writing.end())
+			{
+				// Not recorded until the first copy is committed, in case that fails
+				CDuplicate duplicate;
+				duplicate.strID=strID;
+				duplicate.strFileName=strName;
+				duplicate.pCounts=&counts;
+				itWriting->second.push_back(duplicate);
+				if(!m_queues.empty())counts.nPending++;
+				w.op=eDiscard;
+			}
+			else if(it!=m_blobs.end())
+			{
+				Record(strID, strName, it->second);
+				counts.nDuplicate++;
+				w.op=eDiscard;
+			}
+			else
+			{
+				// The name is taken now, so that other copies of the content find it while it is written
+				w.strBlob=FreeName(strName);
+				m_blobs[w.strKey]=w.strBlob;
+				m_writing[w.strKey];
+				w.strID=strID;
+				w.strFileName=strName;
+				w.op=eCommit;
+			}
+		}
+		Submit(w, file);
+		return true;
+	}
+};
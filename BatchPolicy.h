@@ -0,0 +1,62 @@
+#pragma once
+
+// Decides when an open batch of documents should be sent. A batch is flushed once it reaches
+// a document count, a size in bytes, or (optionally) an age. In adaptive mode the byte limit
+// is tuned from measured Solr response times: grown while responses come back well inside
+// the target latency, and halved when they exceed it.
+
+#include <atomic>
+#include <algorithm>
+
+class CBatchPolicy {
+private:
+	size_t m_nMaxDocs;
+	std::atomic<size_t> m_nMaxBytes;
+	unsigned long m_nMaxMs; // 0 for no time limit
+	bool m_bAdaptive;
+	unsigned long m_nTargetMs; // Adaptive mode: acceptable response time per batch
+	enum { nMinBytes=64*1024, nCeilingBytes=32*1024*1024 };
+public:
+	CBatchPolicy(size_t nMaxDocs=500, size_t nMaxBytes=4*1024*1024, unsigned long nMaxMs=0):
+		m_nMaxDocs(nMaxDocs), m_nMaxBytes(nMaxBytes), m_nMaxMs(nMaxMs), m_bAdaptive(false), m_nTargetMs(0)
+		{
+		}
+	void SetLimits(size_t nMaxDocs, size_t nMaxBytes, unsigned long nMaxMs)
+	{
+		m_nMaxDocs=nMaxDocs;
+		m_nMaxBytes=nMaxBytes;
+		m_nMaxMs=nMaxMs;
+	}
+	void SetAdaptive(unsigned long nTargetMs)
+	{
+		m_bAdaptive=true;
+		m_nTargetMs=nTargetMs;
+		m_nMaxDocs=10000; // Bytes then govern
+		m_nMaxBytes=std::max((size_t)nMinBytes, std::min((size_t)nCeilingBytes, (size_t)m_nMaxBytes));
+	}
+	bool IsAdaptive() const { return m_bAdaptive; }
+	size_t MaxDocs() const { return m_nMaxDocs; }
+	size_t MaxBytes() const { return m_nMaxBytes; }
+	unsigned long MaxMs() const { return m_nMaxMs; }
+	bool IsFull(size_t nDocs, size_t nBytes, unsigned long nAgeMs) const
+	{
+		return nDocs>=m_nMaxDocs||nBytes>=m_nMaxBytes||(m_nMaxMs&&nAgeMs>=m_nMaxMs);
+	}
+	bool IsStale(size_t nDocs, unsigned long nAgeMs) const
+	{
+		// An open batch past its age limit, checked while no document is being added to it
+		return nDocs>0&&m_nMaxMs&&nAgeMs>=m_nMaxMs;
+	}
+	void Observe(size_t nBytes, unsigned long nLatencyMs)
+	{
+		// Called by the senders after each acknowledged batch. Only batches near the current limit
+		// say anything about it; small end of run flushes are ignored.
+		if(!m_bAdaptive||nBytes<m_nMaxBytes/2)return;
+		size_t nCurrent=m_nMaxBytes, nNext=nCurrent;
+		if(nLatencyMs>m_nTargetMs)
+			nNext=std::max((size_t)nMinBytes, nCurrent/2);
+		else if(nLatencyMs<m_nTargetMs/2)
+			nNext=std::min((size_t)nCeilingBytes, nCurrent+nCurrent/4);
+		if(nNext!=nCurrent)m_nMaxBytes.compare_exchange_strong(nCurrent, nNext);
+	}
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+// Destinations for finished update batches. Batches go to Solr, to local shard files, or both.
+// A shard file holds complete batches one after another, each followed by a terminator: a line
+// feed for JSON (whose batches never contain one), and a record separator and line feed for
+// XML (the sanitiser drops that character from text, so it never appears inside a batch).
+// JSON shards are therefore NDJSON, one update command per line. Shards are rotated once they
+// reach a size, and may be gzip compressed; a compressed shard is a series of gzip members.
+// CShardReader splits shards back into batches for replay.
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <zlib.h>
+#include "GzipStream.h"
+#include "Platform.h"
+
+class CBatchSink {
+public:
+	virtual ~CBatchSink() {}
+	// Body is the complete batch as built, gzip compressed when bGzip is set; nRawBytes is its uncompressed size
+	virtual bool Write(const std::string& strBody, size_t nRawBytes, bool bGzip)=0;
+};
+
+static const char* ShardTerminator(const std::string& strFormat)
+{
+	return strFormat=="json"?"\n":"\x1e\n";
+}
+
+static std::string ShardExtension(const std::string& strFormat, bool bCompress)
+{
+	std::string strExt=(strFormat=="json"?".ndjson":".xml");
+	if(bCompress)strExt+=".gz";
+	return strExt;
+}
+
+class CShardSink : public CBatchSink {
+private:
+	std::string m_strDir;
+	std::string m_strExt;
+	std::string m_strTerminator;
+	std::string m_strGzipTerminator; // The terminator as a gzip member of its own, to follow compressed batches
+	unsigned long long m_nMaxBytes; // Shard size at which the next batch starts a new shard
+	bool m_bCompress;
+	CGzipStream m_deflate; // Compresses batches that arrive uncompressed
+	std::ofstream m_file;
+	unsigned long long m_nFileBytes;
+	unsigned int m_nNext; // Number of the next shard file
+	std::mutex m_mutex;
+	// Statistics
+	unsigned long m_nShards;
+	unsigned long m_nBatches;
+	unsigned long long m_nBytes;
+	unsigned long m_nFailed;
+
+	CShardSink(const CShardSink&);
+	CShardSink& operator=(const CShardSink&);
+
+	bool Open()
+	{
+		// Next free shard number; existing shards are never overwritten
+		for(;;)
+		{
+			std::ostringstream ostrName;
+			ostrName << m_strDir << "shard-" << std::setw(5) << std::setfill('0') << m_nNext++ << m_strExt;
+			std::ifstream testFile(ostrName.str().c_str(), std::ios::in|std::ios::binary);
+			if(testFile.is_open())continue;
+			m_file.open(ostrName.str().c_str(), std::ios::out|std::ios::binary);
+			m_nFileBytes=0;
+			if(m_file.is_open())m_nShards++;
+			return m_file.is_open();
+		}
+	}
+	void Append(const std::string& str)
+	{
+		m_file.write(str.data(), str.length());
+		m_nFileBytes+=str.length();
+		m_nBytes+=str.length();
+	}
+public:
+	CShardSink(const std::string& strDir, const std::string& strFormat, unsigned long long nMaxBytes, bool bCompress):
+		m_strDir(strDir), m_strExt(ShardExtension(strFormat, bCompress)), m_strTerminator(ShardTerminator(strFormat)),
+		m_nMaxBytes(nMaxBytes), m_bCompress(bCompress), m_nFileBytes(0), m_nNext(0),
+		m_nShards(0), m_nBatches(0), m_nBytes(0), m_nFailed(0)
+		{
+			if(m_strDir!=""&&m_strDir[m_strDir.length()-1]!='\\'&&m_strDir[m_strDir.length()-1]!='/')m_strDir+=PATH_SEPARATOR;
+			if(m_bCompress)
+			{
+				m_deflate.Init(6);
+				m_deflate.Write(m_strTerminator.data(), m_strTerminator.length(), m_strGzipTerminator);
+				m_deflate.Finish(m_strGzipTerminator);
+			}
+		}
+	~CShardSink()
+	{
+		Close();
+	}
+	bool Write(const std::string& strBody, size_t /*nRawBytes*/, bool bGzip)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(!m_file.is_open()&&!Open())
+		{
+			m_nFailed++;
+			return false;
+		}
+		if(!m_bCompress&&bGzip)
+		{
+			// Uncompressed shards were asked for, but the batch was built compressed
+			m_nFailed++;
+			return false;
+		}
+		if(bGzip)
+		{
+			// Already a gzip member; the terminator follows as another
+			Append(strBody);
+			Append(m_strGzipTerminator);
+		}
+		else if(m_bCompress)
+		{
+			std::string strOut;
+			m_deflate.Reset();
+			m_deflate.Write(strBody.data(), strBody.length(), strOut);
+			m_deflate.Write(m_strTerminator.data(), m_strTerminator.length(), strOut);
+			m_deflate.Finish(strOut);
+			Append(strOut);
+		}
+		else
+		{
+			Append(strBody);
+			Append(m_strTerminator);
+		}
+		if(!m_file)
+		{
+			m_file.close();
+			m_nFailed++;
+			return false;
+		}
+		m_nBatches++;
+		if(m_nFileBytes>=m_nMaxBytes)m_file.close();
+		return true;
+	}
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(m_file.is_open())m_file.close();
+	}
+	void Print(std::ostream& out)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		out << "Shards written: " << m_nShards << ", batches: " << m_nBatches << ", bytes: " << m_nBytes;
+		if(m_nFailed)out << ", failed batches: " << m_nFailed;
+		out << std::endl;
+	}
+};
+
+class CShardReader {
+	// Reads the batches back out of one shard file, decompressing .gz shards as it goes
+private:
+	std::ifstream m_file;
+	bool m_bGzip;
+	std::string m_strTerminator;
+	z_stream m_zs;
+	bool m_bInflate;
+	bool m_bEOF;
+	std::string m_pending; // Read but not yet returned
+	size_t m_nScan; // Position in m_pending already searched for a terminator
+	std::vector<char> m_chunk;
+
+	CShardReader(const CShardReader&);
+	CShardReader& operator=(const CShardReader&);
+
+	bool Fill()
+	{
+		// Appends the next piece of the file, decompressed; false at end of file
+		if(m_bEOF)return false;
+		m_file.read(&m_chunk[0], m_chunk.size());
+		size_t n=(size_t)m_file.gcount();
+		if(n==0)
+		{
+			m_bEOF=true;
+			return false;
+		}
+		if(!m_bGzip)
+		{
+			m_pending.append(&m_chunk[0], n);
+			return true;
+		}
+		m_zs.next_in=(Bytef*)&m_chunk[0];
+		m_zs.avail_in=(uInt)n;
+		char szOut[65536];
+		while(m_zs.avail_in>0)
+		{
+			m_zs.next_out=(Bytef*)szOut;
+			m_zs.avail_out=sizeof(szOut);
+			int nResult=inflate(&m_zs, Z_NO_FLUSH);
+			m_pending.append(szOut, sizeof(szOut)-m_zs.avail_out);
+			if(nResult==Z_STREAM_END)inflateReset(&m_zs); // Next member
+			else if(nResult!=Z_OK&&nResult!=Z_BUF_ERROR)
+			{
+				m_bEOF=true;
+				return false;
+			}
+		}
+		return true;
+	}
+public:
+	CShardReader(const std::string& strPath):
+		m_file(strPath.c_str(), std::ios::in|std::ios::binary), m_bInflate(false), m_bEOF(false), m_nScan(0), m_chunk(1024*1024)
+		{
+			m_bGzip=(strPath.length()>3&&strPath.substr(strPath.length()-3)==".gz");
+			std::string strBase=(m_bGzip?strPath.substr(0, strPath.length()-3):strPath);
+			m_strTerminator=ShardTerminator(strBase.length()>7&&strBase.substr(strBase.length()-7)==".ndjson"?"json":"xml");
+			memset(&m_zs, 0, sizeof(m_zs));
+			if(m_bGzip)m_bInflate=(inflateInit2(&m_zs, 15+16)==Z_OK);
+		}
+	~CShardReader()
+	{
+		if(m_bInflate)inflateEnd(&m_zs);
+	}
+	bool IsOpen() const { return m_file.is_open()&&(!m_bGzip||m_bInflate); }
+	const char* Format() const { return m_strTerminator=="\n"?"json":"xml"; }
+	bool Next(std::string& strBatch)
+	{
+		// The next complete batch, without its terminator
+		for(;;)
+		{
+			size_t pos=m_pending.find(m_strTerminator, m_nScan);
+			if(pos!=std::string::npos)
+			{
+				strBatch.assign(m_pending, 0, pos);
+				m_pending.erase(0, pos+m_strTerminator.length());
+				m_nScan=0;
+				return true;
+			}
+			m_nScan=(m_pending.length()>m_strTerminator.length()?m_pending.length()-m_strTerminator.length()+1:0);
+			if(!Fill())break;
+		}
+		// A final batch without a terminator (from an interrupted run) is dropped rather than sent incomplete
+		return false;
+	}
+};
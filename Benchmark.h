@@ -0,0 +1,664 @@
+#pragma once
+
+// Microbenchmarks, run with /BENCH in place of processing any pst. Inputs are synthetic and
+// generated from a fixed seed, so that numbers from different builds can be compared.
+// Each stage (encoding, sanitising, submitting to a mock Solr on a loopback port) is timed on
+// its own; /BENCH:file also writes the figures as JSON, for tracking regressions.
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+#include "JsonDocumentBuilder.h"
+#include "SolrConnection.h"
+
+static unsigned long long PeakRss()
+{
+	// Peak working set of the process so far, in bytes
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))return 0;
+	return pmc.PeakWorkingSetSize;
+#else
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru)!=0)return 0;
+	return (unsigned long long)ru.ru_maxrss*1024;
+#endif
+}
+
+class CBenchReport {
+	// Figures for each stage, written as one JSON object:
+	// {"build":...,"peak_rss_bytes":n,"stages":[{"stage":...,"messages":n,"bytes":n,"seconds":x,
+	//  "messages_per_s":x,"mb_per_s":x,"p50_ms":x,"p90_ms":x,"p99_ms":x,"max_ms":x},...]}
+	// Latencies are of whatever unit of work the stage times (a batch, a round), where it does.
+private:
+	struct CStage {
+		std::string strName;
+		unsigned long long nMessages;
+		unsigned long long nBytes;
+		double dSeconds;
+		std::vector<double> latencies; // ms
+	};
+	std::vector<CStage> m_stages;
+public:
+	void Add(const std::string& strName, unsigned long long nMessages, unsigned long long nBytes, double dSeconds, const std::vector<double>& latencies=std::vector<double>())
+	{
+		CStage stage;
+		stage.strName=strName;
+		stage.nMessages=nMessages;
+		stage.nBytes=nBytes;
+		stage.dSeconds=dSeconds;
+		stage.latencies=latencies;
+		std::sort(stage.latencies.begin(), stage.latencies.end());
+		m_stages.push_back(stage);
+	}
+	static double Percentile(const std::vector<double>& sorted, double dPercent)
+	{
+		// Nearest rank
+		if(sorted.empty())return 0;
+		size_t nRank=(size_t)(dPercent/100*sorted.size()+0.999999);
+		return sorted[nRank<1?0:std::min(nRank, sorted.size())-1];
+	}
+	void WriteJson(std::ostream& out) const
+	{
+		out << "{\"build\":\"" << __DATE__ << " " << __TIME__ << "\",\"peak_rss_bytes\":" << PeakRss() << ",\"stages\":[";
+		out << std::fixed << std::setprecision(3);
+		for(size_t i=0;i<m_stages.size();++i)
+		{
+			const CStage& s=m_stages[i];
+			double dSeconds=(s.dSeconds>0?s.dSeconds:1e-9);
+			out << (i?",":"") << "{\"stage\":\"" << s.strName << "\",\"messages\":" << s.nMessages << ",\"bytes\":" << s.nBytes
+				<< ",\"seconds\":" << s.dSeconds << ",\"messages_per_s\":" << s.nMessages/dSeconds << ",\"mb_per_s\":" << s.nBytes/dSeconds/(1024*1024);
+			if(!s.latencies.empty())
+				out << ",\"p50_ms\":" << Percentile(s.latencies, 50) << ",\"p90_ms\":" << Percentile(s.latencies, 90)
+					<< ",\"p99_ms\":" << Percentile(s.latencies, 99) << ",\"max_ms\":" << s.latencies.back();
+			out << "}";
+		}
+		out << "]}" << std::endl;
+		out.unsetf(std::ios::floatfield);
+	}
+	bool WriteJson(const std::string& strPath) const
+	{
+		std::ofstream out(strPath.c_str(), std::ios::out|std::ios::trunc);
+		WriteJson(out);
+		return out.good();
+	}
+};
+
+class CMockSolr {
+	// Stands in for Solr on a loopback port: each request is read in full, discarded and answered
+	// as Solr would, so that submitting can be timed without a server. A thread per connection;
+	// clients must close their connections before it is destroyed.
+private:
+	boost::asio::io_service m_io;
+	boost::asio::ip::tcp::acceptor m_acceptor;
+	std::thread m_listener;
+	std::vector<std::thread> m_connections;
+	std::mutex m_mutex;
+	std::atomic<bool> m_bStop;
+	std::string m_strResponse;
+
+	CMockSolr(const CMockSolr&);
+	CMockSolr& operator=(const CMockSolr&);
+
+	void Serve(std::shared_ptr<boost::asio::ip::tcp::socket> pSocket)
+	{
+		boost::asio::streambuf buf;
+		boost::system::error_code error;
+		for(;;)
+		{
+			size_t nHeaders=boost::asio::read_until(*pSocket, buf, "\r\n\r\n", error);
+			if(error)break;
+			std::string strHeaders(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data())+nHeaders);
+			buf.consume(nHeaders);
+			std::transform(strHeaders.begin(), strHeaders.end(), strHeaders.begin(), tolower);
+			size_t nLength=0, pos=strHeaders.find("\r\ncontent-length:");
+			if(pos!=std::string::npos)nLength=strtoul(strHeaders.c_str()+pos+17, 0, 10);
+			if(buf.size()<nLength)boost::asio::read(*pSocket, buf, boost::asio::transfer_exactly(nLength-buf.size()), error);
+			if(error)break;
+			buf.consume(nLength);
+			boost::asio::write(*pSocket, boost::asio::buffer(m_strResponse), error);
+			if(error)break;
+		}
+	}
+	void Listen()
+	{
+		for(;;)
+		{
+			std::shared_ptr<boost::asio::ip::tcp::socket> pSocket(new boost::asio::ip::tcp::socket(m_io));
+			boost::system::error_code error;
+			m_acceptor.accept(*pSocket, error);
+			if(error||m_bStop)break;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_connections.push_back(std::thread(&CMockSolr::Serve, this, pSocket));
+		}
+	}
+public:
+	CMockSolr():m_acceptor(m_io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),m_bStop(false)
+	{
+		std::string strBody="{\"responseHeader\":{\"status\":0,\"QTime\":0}}";
+		std::ostringstream ostrResponse;
+		ostrResponse << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " << strBody.length() << "\r\n\r\n" << strBody;
+		m_strResponse=ostrResponse.str();
+		m_listener=std::thread(&CMockSolr::Listen, this);
+	}
+	~CMockSolr()
+	{
+		// A connection of its own wakes the listener
+		m_bStop=true;
+		{
+			boost::asio::ip::tcp::socket wake(m_io);
+			boost::system::error_code error;
+			wake.connect(m_acceptor.local_endpoint(), error);
+		}
+		m_listener.join();
+		for(size_t i=0;i<m_connections.size();++i)m_connections[i].join();
+	}
+	std::string Host() const { return "127.0.0.1"; }
+	std::string Port() const { return std::to_string((unsigned long long)m_acceptor.local_endpoint().port()); }
+};
+
+class CSyntheticText {
+	// Deterministic generator of message-like text: mostly printable ASCII, with line breaks,
+	// tabs, stray control characters, 8 bit bytes and the odd ]]> thrown in
+private:
+	unsigned long m_nSeed;
+public:
+	CSyntheticText(unsigned long nSeed=12345):m_nSeed(nSeed) {}
+	unsigned long Next()
+	{
+		m_nSeed=m_nSeed*1103515245+12345;
+		return (m_nSeed>>16)&0x7fff;
+	}
+	std::string Text(size_t n)
+	{
+		static const char szWords[]="the quick brown fox jumps over lazy dog meeting invoice regards please find attached report ";
+		std::string out;
+		out.reserve(n);
+		while(out.length()<n)
+		{
+			unsigned long r=Next()%1000;
+			if(r<900)
+			{
+				size_t nStart=Next()%(sizeof(szWords)-9);
+				out.append(szWords+nStart, 1+Next()%8);
+			}
+			else if(r<960) out+="\r\n";
+			else if(r<975) out+='\t';
+			else if(r<985) out+=(char)(Next()%32); // Control characters
+			else if(r<997) out+=(char)(128+Next()%128); // 8 bit
+			else out+="]]>";
+		}
+		out.resize(n);
+		return out;
+	}
+};
+
+struct CSyntheticMessage {
+	std::vector<unsigned char> vID;
+	tm tmCreated;
+	std::string strSender;
+	std::string strSubject;
+	std::vector<std::string> recipients;
+	std::vector<std::string> filenames;
+	std::string strClass;
+	std::string strBody;
+};
+
+static std::vector<CSyntheticMessage> MakeSyntheticMessages(size_t nMessages, unsigned long nSeed=12345)
+{
+	// Body sizes follow a rough mail distribution: many short notes, a few long threads
+	CSyntheticText gen(nSeed);
+	std::vector<CSyntheticMessage> messages(nMessages);
+	for(size_t i=0;i<nMessages;++i)
+	{
+		CSyntheticMessage& m=messages[i];
+		for(int k=0;k<46;++k)m.vID.push_back((unsigned char)gen.Next());
+		memset(&m.tmCreated, 0, sizeof(m.tmCreated));
+		m.tmCreated.tm_year=100+gen.Next()%20;
+		m.tmCreated.tm_mon=gen.Next()%12;
+		m.tmCreated.tm_mday=1+gen.Next()%28;
+		m.tmCreated.tm_hour=gen.Next()%24;
+		m.tmCreated.tm_min=gen.Next()%60;
+		m.tmCreated.tm_sec=gen.Next()%60;
+		m.strSender=gen.Text(8+gen.Next()%24);
+		m.strSubject=gen.Text(10+gen.Next()%60);
+		for(unsigned long k=1+gen.Next()%4;k>0;--k)m.recipients.push_back(gen.Text(8+gen.Next()%24));
+		for(unsigned long k=gen.Next()%3;k>0;--k)m.filenames.push_back(gen.Text(5+gen.Next()%20)+".pdf");
+		m.strClass="IPM.Note";
+		unsigned long r=gen.Next()%100;
+		size_t nBody=(r<60?256+gen.Next()%2048:(r<95?2048+gen.Next()%16384:16384+gen.Next()*4));
+		m.strBody=gen.Text(nBody);
+	}
+	return messages;
+}
+
+static void EncodeLegacy(std::ostringstream& ostrOut, const CSyntheticMessage& m, const std::string& strPST)
+{
+	// The ostringstream/CleanString path the builder replaced, kept for comparison
+	std::ostringstream ostrID;
+	for(size_t i=0;i<m.vID.size();i++)
+		ostrID << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << long(m.vID[i]);
+	ostrOut << "<doc><field name=\"id\">" << ostrID.str() << "</field><field name=\"pstfile\">" << strPST;
+	const tm& tmDate=m.tmCreated;
+	ostrOut << "</field><field name=\"created\">"
+		<< std::dec << std::setw(4) << std::setfill('0') << 1900+tmDate.tm_year << "-" << std::setw(2) << std::setfill('0') << 1+tmDate.tm_mon << "-"
+		<< std::setw(2) << std::setfill('0') << tmDate.tm_mday << "T" << std::setw(2) << std::setfill('0') << tmDate.tm_hour << ":"
+		<< std::setw(2) << std::setfill('0') << tmDate.tm_min << ":" << std::setw(2) << std::setfill('0') << tmDate.tm_sec << "Z";
+	ostrOut << "</field><field name=\"sender\">" << CleanString(m.strSender);
+	ostrOut << "</field><field name=\"subject\">" << CleanString(m.strSubject);
+	std::string strRecipients;
+	for(size_t i=0;i<m.recipients.size();++i)
+	{
+		strRecipients+=m.recipients[i];
+		strRecipients+=" ;";
+	}
+	ostrOut << "</field><field name=\"to\">" << CleanString(strRecipients);
+	ostrOut << "</field><field name=\"attachments\">" << m.filenames.size();
+	std::string strAttach;
+	if(m.filenames.empty())strAttach="None";
+	for(size_t i=0;i<m.filenames.size();++i)
+	{
+		strAttach+=m.filenames[i];
+		strAttach+=" ;";
+	}
+	ostrOut << "</field><field name=\"filenames\">" << CleanString(strAttach);
+	ostrOut << "</field><field name=\"class\">" << m.strClass;
+	ostrOut << "</field><field name=\"body\">" << CleanString(m.strBody);
+	ostrOut << "</field></doc>";
+}
+
+static std::string XmlFieldValue(const std::string& strBatch, const std::string& strName)
+{
+	// The value of the first plain (entity escaped) field of that name in an XML batch
+	std::string strOpen="<field name=\""+strName+"\">";
+	size_t pos=strBatch.find(strOpen);
+	if(pos==std::string::npos)return "";
+	pos+=strOpen.length();
+	std::string strValue;
+	static const char* const szEntities[][2]={{"&amp;","&"},{"&lt;","<"},{"&gt;",">"},{"&quot;","\""}};
+	while(pos<strBatch.length()&&strBatch.compare(pos,8,"</field>")!=0)
+	{
+		size_t e=0;
+		for(;e<sizeof(szEntities)/sizeof(szEntities[0]);++e)
+			if(strBatch.compare(pos,strlen(szEntities[e][0]),szEntities[e][0])==0)break;
+		if(e<sizeof(szEntities)/sizeof(szEntities[0]))
+		{
+			strValue+=szEntities[e][1];
+			pos+=strlen(szEntities[e][0]);
+		}
+		else strValue+=strBatch[pos++];
+	}
+	return strValue;
+}
+
+static std::string JsonFieldValue(const std::string& strBatch, const std::string& strName)
+{
+	// The value of the first string field of that name in a JSON batch; only the escapes
+	// EscapeJsonText writes are understood
+	std::string strOpen="\""+strName+"\":\"";
+	size_t pos=strBatch.find(strOpen);
+	if(pos==std::string::npos)return "";
+	pos+=strOpen.length();
+	std::string strValue;
+	while(pos<strBatch.length()&&strBatch[pos]!='"')
+	{
+		char c=strBatch[pos++];
+		if(c!='\\'||pos>=strBatch.length())
+		{
+			strValue+=c;
+			continue;
+		}
+		c=strBatch[pos++];
+		if(c=='n')strValue+='\n';
+		else if(c=='r')strValue+='\r';
+		else if(c=='t')strValue+='\t';
+		else if(c=='u'&&pos+4<=strBatch.length())
+		{
+			strValue+=(char)strtoul(strBatch.substr(pos,4).c_str(),0,16);
+			pos+=4;
+		}
+		else strValue+=c;
+	}
+	return strValue;
+}
+
+static void EncodeBuilder(CDocumentBuilder& doc, const CSyntheticMessage& m, const std::string& strPST)
+{
+	// Same fields, in the same order, as CPSTProcessor writes them with the default field plan, in either format
+	doc.BeginDoc();
+	doc.BeginField("id");
+	doc.Hex(m.vID);
+	doc.EndField();
+	doc.BeginField("pstfile");
+	doc.Plain(strPST);
+	doc.EndField();
+	doc.BeginField("created");
+	doc.Date(m.tmCreated);
+	doc.EndField();
+	doc.BeginField("sender");
+	doc.Clean(m.strSender);
+	doc.EndField();
+	doc.BeginField("subject");
+	doc.Clean(m.strSubject);
+	doc.EndField();
+	doc.BeginField("to");
+	doc.BeginText();
+	for(size_t i=0;i<m.recipients.size();++i)
+	{
+		doc.Text(m.recipients[i]);
+		doc.Raw(" ;",2);
+	}
+	doc.EndText();
+	doc.EndField();
+	doc.BeginField("attachments");
+	doc.Number(m.filenames.size());
+	doc.EndField();
+	doc.BeginField("filenames");
+	doc.BeginText();
+	if(m.filenames.empty())doc.Raw("None",4);
+	for(size_t i=0;i<m.filenames.size();++i)
+	{
+		doc.Text(m.filenames[i]);
+		doc.Raw(" ;",2);
+	}
+	doc.EndText();
+	doc.EndField();
+	doc.BeginField("class");
+	doc.Plain(m.strClass);
+	doc.EndField();
+	doc.BeginField("body");
+	doc.Clean(m.strBody);
+	doc.EndField();
+	doc.EndDoc();
+}
+
+static double BenchSeconds(const std::chrono::steady_clock::time_point& tStart)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now()-tStart).count();
+}
+
+static double EncodeWith(CDocumentBuilder& doc, const std::vector<CSyntheticMessage>& messages, size_t nBatch, size_t nRounds, const std::string& strPST, size_t& nOutput, std::vector<double>& latencies)
+{
+	// Encodes every message nRounds times in batches of nBatch, returning the time taken, and that of each batch in ms
+	doc.SetCommitWithin("60000");
+	std::string strSpare;
+	nOutput=0;
+	std::chrono::steady_clock::time_point tStart=std::chrono::steady_clock::now();
+	for(size_t r=0;r<nRounds;++r)
+	{
+		for(size_t i=0;i<messages.size();i+=nBatch)
+		{
+			std::chrono::steady_clock::time_point tBatch=std::chrono::steady_clock::now();
+			doc.BeginBatch();
+			for(size_t j=i;j<i+nBatch&&j<messages.size();++j)EncodeBuilder(doc, messages[j], strPST);
+			doc.EndBatch();
+			nOutput+=doc.Size();
+			doc.Swap(strSpare); // Hand over and take back, as QueueBatch and the senders do
+			latencies.push_back(1000*BenchSeconds(tBatch));
+		}
+	}
+	return BenchSeconds(tStart);
+}
+
+static bool RunEncodeBenchmark(std::ostream& out, CBenchReport& report)
+{
+	// Encodes the same synthetic messages in batches of 500, as the sender would receive them,
+	// through the legacy ostringstream path and through the builder
+	const size_t nMessages=5000, nBatch=500, nRounds=5;
+	const std::string strPST="C:\\Archive\\synthetic.pst";
+	const std::string strPreamble="<add commitWithin=\"60000\">";
+	std::vector<CSyntheticMessage> messages=MakeSyntheticMessages(nMessages);
+	size_t nInput=0;
+	for(size_t i=0;i<messages.size();++i)nInput+=messages[i].strBody.length();
+
+	// Both paths must produce identical batches
+	std::ostringstream ostrCheck;
+	ostrCheck << strPreamble;
+	CXmlDocumentBuilder check;
+	check.SetCommitWithin("60000");
+	check.BeginBatch();
+	for(size_t i=0;i<nBatch;++i)
+	{
+		EncodeLegacy(ostrCheck, messages[i], strPST);
+		EncodeBuilder(check, messages[i], strPST);
+	}
+	ostrCheck << "</add>";
+	check.EndBatch();
+	bool bMatch=(ostrCheck.str()==check.Buffer());
+
+	// Both formats must index the same plain values, markup and 8 bit bytes included
+	CSyntheticMessage odd=messages[0];
+	odd.strClass="IPM.Note.<&>\"caf\xc3\xa9\"";
+	const std::string strOddPST="C:\\Archiv\xc3\xa9\\a&b <c>.pst";
+	CXmlDocumentBuilder xmlOdd;
+	CJsonDocumentBuilder jsonOdd;
+	CDocumentBuilder* odds[]={&xmlOdd, &jsonOdd};
+	for(size_t i=0;i<2;++i)
+	{
+		odds[i]->BeginBatch();
+		EncodeBuilder(*odds[i], odd, strOddPST);
+		odds[i]->EndBatch();
+	}
+	bool bFormats=(XmlFieldValue(xmlOdd.Buffer(),"pstfile")=="C:\\Archiv\\a&b <c>.pst"&&JsonFieldValue(jsonOdd.Buffer(),"pstfile")=="C:\\Archiv\\a&b <c>.pst"&&
+		XmlFieldValue(xmlOdd.Buffer(),"class")=="IPM.Note.<&>\"caf\""&&JsonFieldValue(jsonOdd.Buffer(),"class")=="IPM.Note.<&>\"caf\"");
+
+	size_t nOutput=0;
+	std::chrono::steady_clock::time_point tStart=std::chrono::steady_clock::now();
+	for(size_t r=0;r<nRounds;++r)
+	{
+		for(size_t i=0;i<nMessages;i+=nBatch)
+		{
+			std::ostringstream ostrOut;
+			ostrOut << strPreamble;
+			for(size_t j=i;j<i+nBatch&&j<nMessages;++j)EncodeLegacy(ostrOut, messages[j], strPST);
+			ostrOut << "</add>";
+			std::string strBody=ostrOut.str(); // As SubmitMessage used to copy it
+			nOutput+=strBody.length();
+		}
+	}
+	double dLegacy=BenchSeconds(tStart);
+
+	CXmlDocumentBuilder xml;
+	size_t nXml=0;
+	std::vector<double> xmlLatencies, jsonLatencies;
+	double dBuilder=EncodeWith(xml, messages, nBatch, nRounds, strPST, nXml, xmlLatencies);
+	CJsonDocumentBuilder json;
+	size_t nJson=0;
+	double dJson=EncodeWith(json, messages, nBatch, nRounds, strPST, nJson, jsonLatencies);
+	report.Add("encode_legacy", nMessages*nRounds, nInput*nRounds, dLegacy);
+	report.Add("encode_xml", nMessages*nRounds, nInput*nRounds, dBuilder, xmlLatencies);
+	report.Add("encode_json", nMessages*nRounds, nInput*nRounds, dJson, jsonLatencies);
+
+	double dMB=(double)nInput*nRounds/(1024*1024);
+	out << "Document encoding: " << nMessages << " synthetic messages x " << nRounds << " rounds, "
+		<< std::fixed << std::setprecision(1) << dMB << "MB of bodies, " << (double)nOutput/(1024*1024) << "MB of XML" << std::endl;
+	out << "  ostringstream/CleanString: " << std::setprecision(3) << dLegacy << "s, "
+		<< std::setprecision(1) << dMB/dLegacy << "MB/s, " << std::setprecision(0) << nMessages*nRounds/dLegacy << " docs/s" << std::endl;
+	out << "  CXmlDocumentBuilder:       " << std::setprecision(3) << dBuilder << "s, "
+		<< std::setprecision(1) << dMB/dBuilder << "MB/s, " << std::setprecision(0) << nMessages*nRounds/dBuilder << " docs/s" << std::endl;
+	out << "  CJsonDocumentBuilder:      " << std::setprecision(3) << dJson << "s, "
+		<< std::setprecision(1) << dMB/dJson << "MB/s, " << std::setprecision(0) << nMessages*nRounds/dJson << " docs/s, "
+		<< std::setprecision(1) << (double)nJson/(1024*1024) << "MB of JSON against " << (double)nXml/(1024*1024) << "MB of XML" << std::endl;
+	out << "  Output identical: " << (bMatch?"yes":"NO") << std::endl;
+	out << "  Plain values identical in XML and JSON: " << (bFormats?"yes":"NO") << std::endl;
+	out.unsetf(std::ios::floatfield);
+	return bMatch&&bFormats;
+}
+
+static bool RunSanitiserBenchmark(std::ostream& out, CBenchReport& report)
+{
+	// Differential check of every sanitiser this processor can run against CleanString, on random
+	// buffers drawn from an alphabet heavy in ']', '>' and the byte classes the filter treats
+	// differently, followed by throughput on synthetic body text
+	std::vector<SanitiseFn> fns;
+	fns.push_back(SanitiseScalar);
+#ifdef PSTREADER_SANITISER_X86
+	if(SanitiserHasSSE2())fns.push_back(SanitiseSSE2);
+	if(SanitiserHasAVX2())fns.push_back(SanitiseAVX2);
+#endif
+	static const char szAlphabet[]="]]]]>>>>ab \t\n\r\x0b\x0c\x01\x1f\x7f\x80\xff\xe9";
+	CSyntheticText gen(4321);
+	size_t nCases=200000, nFailures=0;
+	std::string strIn, strOut;
+	for(size_t c=0;c<nCases&&nFailures<5;++c)
+	{
+		// Mostly short buffers, so block boundaries and the tail cases get hit often
+		size_t nLen=(c%10==0?gen.Next()%1024:gen.Next()%80);
+		strIn.resize(nLen);
+		bool bPlain=(c%3==0); // Long plain runs with the odd hazard, as in real bodies
+		for(size_t i=0;i<nLen;++i)
+			strIn[i]=(bPlain&&gen.Next()%16?'a'+(char)(gen.Next()%26):szAlphabet[gen.Next()%(sizeof(szAlphabet)-1)]);
+		std::string strRef=CleanString(strIn);
+		strRef=strRef.substr(9, strRef.length()-12); // Without the CDATA wrapper
+		for(size_t f=0;f<fns.size();++f)
+		{
+			strOut.assign(2*nLen, '\0');
+			strOut.resize(fns[f](strIn.data(), nLen, &strOut[0]));
+			if(strOut!=strRef)
+			{
+				if(nFailures++<5)out << "  " << SanitiserName(fns[f]) << " differs from CleanString on case " << c << " (" << nLen << " bytes)" << std::endl;
+			}
+		}
+	}
+
+	const size_t nBytes=64*1024*1024, nRounds=5;
+	std::string strText=gen.Text(nBytes);
+	std::vector<char> vOut(2*nBytes);
+	out << "Text sanitiser: " << nCases << " random cases, " << (nFailures?"MISMATCHES":"all identical to CleanString")
+		<< "; " << nBytes/(1024*1024) << "MB of body text x " << nRounds << " rounds, dispatch selects " << SanitiserName(SelectSanitiser()) << std::endl;
+	for(size_t f=0;f<fns.size();++f)
+	{
+		size_t nWritten=0;
+		std::vector<double> latencies;
+		std::chrono::steady_clock::time_point tStart=std::chrono::steady_clock::now();
+		for(size_t r=0;r<nRounds;++r)
+		{
+			std::chrono::steady_clock::time_point tRound=std::chrono::steady_clock::now();
+			nWritten+=fns[f](strText.data(), strText.length(), &vOut[0]);
+			latencies.push_back(1000*BenchSeconds(tRound));
+		}
+		double dSeconds=BenchSeconds(tStart);
+		report.Add(std::string("sanitise_")+SanitiserName(fns[f]), 0, (unsigned long long)nBytes*nRounds, dSeconds, latencies);
+		out << "  " << std::left << std::setw(7) << SanitiserName(fns[f]) << std::right << std::fixed << std::setprecision(2)
+			<< (double)nBytes*nRounds/dSeconds/(1024.0*1024*1024) << "GB/s (" << nWritten/nRounds << " bytes out)" << std::endl;
+	}
+	out.unsetf(std::ios::floatfield);
+	return nFailures==0;
+}
+
+static bool SubmitTo(CSolrConnectionPool& pool, const std::string& strHeader, const std::string& strBody)
+{
+	// One update over a pooled keep-alive connection, as SubmitMessage sends it
+	CHttpConnection* pConn=pool.Acquire();
+	boost::system::error_code error;
+	unsigned int nStatus=0;
+	std::string strHeaders, strResponse;
+	bool bOK=false;
+	if(pConn->IsOpen()||pool.Connect(*pConn, error))
+	{
+		pConn->Write(strHeader, strBody, error);
+		bOK=(!error&&pConn->ReadResponse(nStatus, strHeaders, strResponse, error)&&nStatus==200);
+	}
+	pool.Release(pConn);
+	return bOK;
+}
+
+static bool RunSubmitBenchmark(std::ostream& out, CBenchReport& report)
+{
+	// Posts synthetic XML batches of 500 to a mock Solr from two threads, as the default senders
+	// would, timing each request from writing it to reading the response
+	const size_t nMessages=5000, nBatch=500, nRounds=5;
+	const unsigned int nSenders=2;
+	std::vector<CSyntheticMessage> messages=MakeSyntheticMessages(nMessages, 777);
+	std::vector<std::string> bodies;
+	CXmlDocumentBuilder doc;
+	doc.SetCommitWithin("60000");
+	for(size_t i=0;i<nMessages;i+=nBatch)
+	{
+		doc.BeginBatch();
+		for(size_t j=i;j<i+nBatch&&j<nMessages;++j)EncodeBuilder(doc, messages[j], "C:\\Archive\\synthetic.pst");
+		doc.EndBatch();
+		bodies.push_back(std::string());
+		doc.Swap(bodies.back());
+	}
+	CMockSolr solr;
+	std::vector<double> latencies;
+	std::mutex mutexLatencies;
+	std::atomic<size_t> nNext(0), nFailed(0);
+	std::atomic<unsigned long long> nBytes(0);
+	double dSeconds=0;
+	{
+		CSolrConnectionPool pool(solr.Host(), solr.Port(), nSenders);
+		boost::system::error_code error;
+		if(!pool.Resolve(error))
+		{
+			out << "Mock Solr: unable to resolve " << solr.Host() << ": " << error.message() << std::endl;
+			return false;
+		}
+		std::chrono::steady_clock::time_point tStart=std::chrono::steady_clock::now();
+		std::vector<std::thread> senders;
+		for(unsigned int s=0;s<nSenders;++s)
+		{
+			senders.push_back(std::thread([&]()
+			{
+				for(size_t k=nNext++;k<bodies.size()*nRounds;k=nNext++)
+				{
+					const std::string& strBody=bodies[k%bodies.size()];
+					std::ostringstream ostrHeader;
+					ostrHeader << "POST /solr/update HTTP/1.1\r\nHost: " << solr.Host() << ":" << solr.Port() << "\r\n"
+						<< "Content-Type: " << doc.ContentType() << "\r\nContent-Length: " << strBody.length() << "\r\nConnection: keep-alive\r\n\r\n";
+					std::chrono::steady_clock::time_point tRequest=std::chrono::steady_clock::now();
+					if(!SubmitTo(pool, ostrHeader.str(), strBody))nFailed++;
+					double dMs=1000*BenchSeconds(tRequest);
+					nBytes+=strBody.length();
+					std::lock_guard<std::mutex> lock(mutexLatencies);
+					latencies.push_back(dMs);
+				}
+			}));
+		}
+		for(size_t s=0;s<senders.size();++s)senders[s].join();
+		dSeconds=BenchSeconds(tStart);
+	}
+	report.Add("submit_mock", nMessages*nRounds, nBytes, dSeconds, latencies);
+	std::sort(latencies.begin(), latencies.end());
+	out << "Submit to mock Solr: " << bodies.size()*nRounds << " batches of " << nBatch << " on " << nSenders << " connections, "
+		<< std::fixed << std::setprecision(1) << (double)nBytes/(1024*1024) << "MB" << std::endl;
+	out << "  " << std::setprecision(3) << dSeconds << "s, " << std::setprecision(1) << nBytes/dSeconds/(1024*1024) << "MB/s, "
+		<< std::setprecision(0) << nMessages*nRounds/dSeconds << " docs/s; latency p50 " << std::setprecision(2) << CBenchReport::Percentile(latencies, 50)
+		<< "ms, p90 " << CBenchReport::Percentile(latencies, 90) << "ms, p99 " << CBenchReport::Percentile(latencies, 99) << "ms"
+		<< (nFailed?", SOME FAILED":"") << std::endl;
+	out.unsetf(std::ios::floatfield);
+	return nFailed==0;
+}
+
+static int RunBenchmarks(std::ostream& out, const std::string& strJson)
+{
+	CBenchReport report;
+	bool bOK=RunEncodeBenchmark(out, report);
+	bOK=RunSanitiserBenchmark(out, report)&&bOK;
+	bOK=RunSubmitBenchmark(out, report)&&bOK;
+	out << "Peak working set: " << PeakRss()/(1024*1024) << "MB" << std::endl;
+	if(strJson!=""&&!report.WriteJson(strJson))
+	{
+		out << "Unable to write " << strJson << std::endl;
+		bOK=false;
+	}
+	return bOK?EXIT_SUCCESS:EXIT_FAILURE;
+}
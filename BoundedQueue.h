@@ -0,0 +1,90 @@
+#pragma once
+
+// Blocking producer/consumer queue, bounded both by item count and by total bytes held,
+// so a fast producer is held back (backpressure) rather than growing memory without limit.
+
+#include <deque>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+template<typename T>
+class CBoundedQueue {
+private:
+	std::deque<std::pair<T, size_t> > m_items;
+	std::mutex m_mutex;
+	std::condition_variable m_cvNotFull;
+	std::condition_variable m_cvNotEmpty;
+	size_t m_nMaxItems;
+	size_t m_nMaxBytes;
+	size_t m_nBytes;
+	bool m_bClosed;
+
+	CBoundedQueue(const CBoundedQueue&);
+	CBoundedQueue& operator=(const CBoundedQueue&);
+public:
+	CBoundedQueue(size_t nMaxItems, size_t nMaxBytes):
+		m_nMaxItems(nMaxItems), m_nMaxBytes(nMaxBytes), m_nBytes(0), m_bClosed(false)
+		{
+		}
+	bool Push(T&& item, size_t nBytes)
+	{
+		// Blocks while full. An item larger than the byte limit is still let through once the queue
+		// has drained, otherwise it could never be queued at all. Returns false if the queue was closed.
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(!m_bClosed&&!m_items.empty()&&(m_items.size()>=m_nMaxItems||m_nBytes+nBytes>m_nMaxBytes))
+			m_cvNotFull.wait(lock);
+		if(m_bClosed)return false;
+		m_items.push_back(std::make_pair(std::move(item), nBytes));
+		m_nBytes+=nBytes;
+		m_cvNotEmpty.notify_one();
+		return true;
+	}
+	bool Pop(T& item)
+	{
+		// Blocks while empty; returns false once the queue is closed and fully drained
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(!m_bClosed&&m_items.empty())
+			m_cvNotEmpty.wait(lock);
+		if(m_items.empty())return false;
+		item=std::move(m_items.front().first);
+		m_nBytes-=m_items.front().second;
+		m_items.pop_front();
+		m_cvNotFull.notify_all();
+		return true;
+	}
+	bool Pop(T& item, const std::chrono::steady_clock::time_point& until, bool& bItem)
+	{
+		// As Pop, but gives up at until; bItem says whether an item was taken
+		std::unique_lock<std::mutex> lock(m_mutex);
+		bItem=false;
+		while(!m_bClosed&&m_items.empty())
+			if(m_cvNotEmpty.wait_until(lock, until)==std::cv_status::timeout)break;
+		if(m_items.empty())return !m_bClosed;
+		item=std::move(m_items.front().first);
+		m_nBytes-=m_items.front().second;
+		m_items.pop_front();
+		m_cvNotFull.notify_all();
+		bItem=true;
+		return true;
+	}
+	void Close()
+	{
+		// No further pushes are accepted; consumers finish whatever is left
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_bClosed=true;
+		m_cvNotEmpty.notify_all();
+		m_cvNotFull.notify_all();
+	}
+	size_t Size()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_items.size();
+	}
+	size_t Bytes()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_nBytes;
+	}
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+// Persistent record of what has already been indexed, so an interrupted run can be resumed.
+// It is an append-only text journal, written only once the sinks have acknowledged a batch:
+//   P <id> <size>:<mtime>:<path>         a pst file, identified by path, size and modified time
+//   M <id> <folder nid> <nid> <nid> ...  messages of a folder acknowledged
+//   D <id> <folder nid>                  every message of a folder acknowledged
+//   F <id>                               the whole pst done
+// On opening, the journal is loaded into hash tables and rewritten without the message
+// records that a later D or F line made redundant, which keeps it compact across reruns.
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdio.h>
+
+class CCheckpoint {
+public:
+	typedef std::unordered_set<unsigned int> CMessageSet;
+private:
+	std::string m_strPath;
+	std::ofstream m_journal;
+	std::mutex m_mutex;
+	std::unordered_map<std::string, unsigned int> m_psts; // Key to id
+	std::unordered_set<unsigned int> m_filesDone;
+	std::unordered_set<unsigned long long> m_foldersDone; // Keyed by FolderKey
+	std::unordered_map<unsigned long long, CMessageSet> m_messagesDone; // Messages of folders not yet done
+	// The tables above reflect the journal as it was opened, and are only read once processing
+	// starts; acknowledgements during the run go to the journal alone.
+
+	CCheckpoint(const CCheckpoint&);
+	CCheckpoint& operator=(const CCheckpoint&);
+
+	static unsigned long long FolderKey(unsigned int nPst, unsigned int nFolder)
+	{
+		return ((unsigned long long)nPst<<32)|nFolder;
+	}
+	void Load()
+	{
+		std::ifstream journal(m_strPath.c_str());
+		std::string strLine;
+		while(std::getline(journal, strLine))
+		{
+			if(strLine.length()<3||strLine[1]!=' ')continue;
+			std::istringstream line(strLine.substr(2));
+			unsigned int nPst=0, nFolder=0, nMessage=0;
+			switch(strLine[0])
+			{
+			case 'P':
+				{
+					std::string strKey;
+					line >> nPst;
+					line.get();
+					std::getline(line, strKey);
+					m_psts[strKey]=nPst;
+				}
+				break;
+			case 'M':
+				{
+					line >> nPst >> std::hex >> nFolder;
+					CMessageSet& messages=m_messagesDone[FolderKey(nPst, nFolder)];
+					while(line >> nMessage)messages.insert(nMessage);
+				}
+				break;
+			case 'D':
+				line >> nPst >> std::hex >> nFolder;
+				m_foldersDone.insert(FolderKey(nPst, nFolder));
+				break;
+			case 'F':
+				line >> nPst;
+				m_filesDone.insert(nPst);
+				break;
+			}
+		}
+		// Whatever a D or F line covers needs no per message record
+		for(std::unordered_map<unsigned long long, CMessageSet>::iterator it=m_messagesDone.begin();it!=m_messagesDone.end();)
+		{
+			if(m_foldersDone.count(it->first)||m_filesDone.count((unsigned int)(it->first>>32)))
+				it=m_messagesDone.erase(it);
+			else
+				++it;
+		}
+	}
+	void Rewrite()
+	{
+		// Writes the compacted journal alongside, then swaps it in
+		std::string strTemp=m_strPath+".tmp";
+		{
+			std::ofstream out(strTemp.c_str(), std::ios::out|std::ios::trunc);
+			for(std::unordered_map<std::string, unsigned int>::const_iterator it=m_psts.begin();it!=m_psts.end();++it)
+				out << "P " << it->second << " " << it->first << "\n";
+			for(std::unordered_set<unsigned int>::const_iterator it=m_filesDone.begin();it!=m_filesDone.end();++it)
+				out << "F " << *it << "\n";
+			for(std::unordered_set<unsigned long long>::const_iterator it=m_foldersDone.begin();it!=m_foldersDone.end();++it)
+			{
+				if(m_filesDone.count((unsigned int)(*it>>32)))continue;
+				out << "D " << (unsigned int)(*it>>32) << " " << std::hex << (unsigned int)(*it&0xffffffff) << std::dec << "\n";
+			}
+			for(std::unordered_map<unsigned long long, CMessageSet>::const_iterator it=m_messagesDone.begin();it!=m_messagesDone.end();++it)
+			{
+				out << "M " << (unsigned int)(it->first>>32) << " " << std::hex << (unsigned int)(it->first&0xffffffff);
+				for(CMessageSet::const_iterator m=it->second.begin();m!=it->second.end();++m)out << " " << *m;
+				out << std::dec << "\n";
+			}
+			if(!out)return;
+		}
+		remove(m_strPath.c_str());
+		rename(strTemp.c_str(), m_strPath.c_str());
+	}
+	void Journal(const std::string& strLine)
+	{
+		// Flushed straight away, so a crash loses at most the line being written
+		m_journal << strLine;
+		m_journal.flush();
+	}
+public:
+	CCheckpoint(const std::string& strPath):m_strPath(strPath) {}
+	bool Open()
+	{
+		Load();
+		Rewrite();
+		m_journal.open(m_strPath.c_str(), std::ios::out|std::ios::app);
+		return m_journal.is_open();
+	}
+	static std::string FileKey(const std::string& strPath, unsigned long long nSize, long long nModified)
+	{
+		std::ostringstream ostrKey;
+		ostrKey << nSize << ":" << nModified << ":" << strPath;
+		return ostrKey.str();
+	}
+	unsigned int PstId(const std::string& strKey)
+	{
+		// A changed file gets a new key, and so starts afresh
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::unordered_map<std::string, unsigned int>::const_iterator it=m_psts.find(strKey);
+		if(it!=m_psts.end())return it->second;
+		unsigned int nPst=(unsigned int)m_psts.size()+1;
+		m_psts[strKey]=nPst;
+		std::ostringstream ostrLine;
+		ostrLine << "P " << nPst << " " << strKey << "\n";
+		Journal(ostrLine.str());
+		return nPst;
+	}
+	bool IsFileDone(unsigned int nPst) const { return m_filesDone.count(nPst)!=0; }
+	bool IsFolderDone(unsigned int nPst, unsigned int nFolder) const { return m_foldersDone.count(FolderKey(nPst, nFolder))!=0; }
+	const CMessageSet* FolderMessages(unsigned int nPst, unsigned int nFolder) const
+	{
+		// Messages already acknowledged in a partly done folder, or null
+		std::unordered_map<unsigned long long, CMessageSet>::const_iterator it=m_messagesDone.find(FolderKey(nPst, nFolder));
+		return it==m_messagesDone.end()?0:&it->second;
+	}
+	void MarkMessages(unsigned int nPst, unsigned int nFolder, const unsigned int* pMessages, size_t nMessages)
+	{
+		if(nMessages==0)return;
+		std::ostringstream ostrLine;
+		ostrLine << "M " << nPst << " " << std::hex << nFolder;
+		for(size_t i=0;i<nMessages;++i)ostrLine << " " << pMessages[i];
+		ostrLine << "\n";
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Journal(ostrLine.str());
+	}
+	void MarkFolder(unsigned int nPst, unsigned int nFolder)
+	{
+		std::ostringstream ostrLine;
+		ostrLine << "D " << nPst << " " << std::hex << nFolder << "\n";
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Journal(ostrLine.str());
+	}
+	void MarkFile(unsigned int nPst)
+	{
+		std::ostringstream ostrLine;
+		ostrLine << "F " << nPst << "\n";
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Journal(ostrLine.str());
+	}
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+// State kept between runs for delta re-indexing of live pst files. For each pst (by full path)
+// it holds the latest PR_LAST_MODIFICATION_TIME seen and the nids of every message seen.
+// Within one pst an entry ID is a fixed prefix (flags and the store's record key) followed
+// by the nid, so the nid identifies the message, and with the prefix the Solr id can be
+// rebuilt for deleting messages that have gone.
+//
+// The file is binary: a header line, then for each pst its path, prefix, watermark and nid
+// count, followed by the sorted nids as variable length deltas (usually one or two bytes each).
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <stdio.h>
+
+struct CPstDelta {
+	std::vector<unsigned char> vPrefix; // Entry ID bytes before the nid
+	unsigned long long nWatermark; // Latest modification time seen, as a FILETIME
+	std::vector<unsigned int> nids; // Sorted
+	CPstDelta():nWatermark(0) {}
+	bool Seen(unsigned int nid) const { return std::binary_search(nids.begin(), nids.end(), nid); }
+	std::string SolrId(unsigned int nid) const
+	{
+		// Hex, as ProcessMessage writes the id field; the nid is stored little endian
+		static const char szHex[]="0123456789ABCDEF";
+		std::string strID;
+		for(size_t i=0;i<vPrefix.size()+4;i++)
+		{
+			unsigned char b=(i<vPrefix.size()?vPrefix[i]:(unsigned char)(nid>>(8*(i-vPrefix.size()))));
+			strID+=szHex[b>>4];
+			strID+=szHex[b&15];
+		}
+		return strID;
+	}
+};
+
+class CDeltaState {
+private:
+	std::string m_strPath;
+	std::map<std::string, CPstDelta> m_psts;
+	std::mutex m_mutex;
+
+	CDeltaState(const CDeltaState&);
+	CDeltaState& operator=(const CDeltaState&);
+
+	static void WriteVarint(std::ostream& out, unsigned long long n)
+	{
+		while(n>=0x80)
+		{
+			out.put((char)(0x80|(n&0x7f)));
+			n>>=7;
+		}
+		out.put((char)n);
+	}
+	static bool ReadVarint(std::istream& in, unsigned long long& n)
+	{
+		n=0;
+		for(int nShift=0;nShift<64;nShift+=7)
+		{
+			int c=in.get();
+			if(c==EOF)return false;
+			n|=(unsigned long long)(c&0x7f)<<nShift;
+			if(!(c&0x80))return true;
+		}
+		return false;
+	}
+	static const char* Header() { return "PstReader delta 1\n"; }
+public:
+	CDeltaState(const std::string& strPath):m_strPath(strPath) {}
+	bool Load()
+	{
+		// A missing file is an empty state; a damaged one is rejected rather than half read
+		std::ifstream in(m_strPath.c_str(), std::ios::in|std::ios::binary);
+		if(!in.is_open())return true;
+		std::string strHeader;
+		std::getline(in, strHeader);
+		if(strHeader+"\n"!=Header())return false;
+		unsigned long long n;
+		while(ReadVarint(in, n))
+		{
+			std::string strPath((size_t)n, '\0');
+			in.read(&strPath[0], n);
+			CPstDelta delta;
+			if(!ReadVarint(in, n))return false;
+			delta.vPrefix.resize((size_t)n);
+			if(n)in.read((char*)&delta.vPrefix[0], n);
+			unsigned long long nCount, nDelta, nid=0;
+			if(!ReadVarint(in, delta.nWatermark)||!ReadVarint(in, nCount))return false;
+			delta.nids.reserve((size_t)nCount);
+			for(unsigned long long i=0;i<nCount;++i)
+			{
+				if(!ReadVarint(in, nDelta))return false;
+				nid+=nDelta;
+				delta.nids.push_back((unsigned int)nid);
+			}
+			if(!in)return false;
+			m_psts[strPath].nids.swap(delta.nids);
+			m_psts[strPath].vPrefix.swap(delta.vPrefix);
+			m_psts[strPath].nWatermark=delta.nWatermark;
+		}
+		return true;
+	}
+	bool Save()
+	{
+		// Written alongside and swapped in, so a crash leaves the previous state intact
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::string strTemp=m_strPath+".tmp";
+		{
+			std::ofstream out(strTemp.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+			out << Header();
+			for(std::map<std::string, CPstDelta>::const_iterator it=m_psts.begin();it!=m_psts.end();++it)
+			{
+				WriteVarint(out, it->first.length());
+				out.write(it->first.data(), it->first.length());
+				WriteVarint(out, it->second.vPrefix.size());
+				if(!it->second.vPrefix.empty())out.write((const char*)&it->second.vPrefix[0], it->second.vPrefix.size());
+				WriteVarint(out, it->second.nWatermark);
+				WriteVarint(out, it->second.nids.size());
+				unsigned int nPrev=0;
+				for(size_t i=0;i<it->second.nids.size();++i)
+				{
+					WriteVarint(out, it->second.nids[i]-nPrev);
+					nPrev=it->second.nids[i];
+				}
+			}
+			if(!out)return false;
+		}
+		remove(m_strPath.c_str());
+		return rename(strTemp.c_str(), m_strPath.c_str())==0;
+	}
+	CPstDelta Find(const std::string& strPath)
+	{
+		// Empty for a pst not seen before
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::map<std::string, CPstDelta>::const_iterator it=m_psts.find(strPath);
+		return it==m_psts.end()?CPstDelta():it->second;
+	}
+	void Update(const std::string& strPath, CPstDelta& delta)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		CPstDelta& stored=m_psts[strPath];
+		stored.vPrefix.swap(delta.vPrefix);
+		stored.nids.swap(delta.nids);
+		stored.nWatermark=delta.nWatermark;
+	}
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+// Builds Solr update batches directly into one growable buffer. CDocumentBuilder holds
+// the buffer and everything that does not depend on the format; CXmlDocumentBuilder
+// (below) and CJsonDocumentBuilder (JsonDocumentBuilder.h) write the documents.
+// Field content is filtered and escaped straight into the buffer, with no per field
+// temporaries, and the finished buffer is handed to the sender by swapping rather
+// than copying. Buffers keep their capacity, so in steady state nothing is allocated.
+// With compression on, each completed document is deflated as soon as it is closed, and the
+// buffer handed over is the gzip stream rather than the text.
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <string.h>
+#include "TextSanitiser.h"
+#include "GzipStream.h"
+
+// Reference implementation of the CDATA sanitiser; the builder must match it byte for byte
+static std::string CleanString(const std::string & in)
+{
+	// Removes control characters, and encloses raw string in CDATA tags
+	std::string out("<![CDATA[");
+	for(size_t i=0;i<in.length();++i)
+	{
+		char wcIn=in[i];
+		if(wcIn==']'&&i<in.length()-2)
+		{
+			if(in[i+1]==']'&&in[i+2]=='>')
+			{
+				// avoid ]]>
+				out+="]]&gt;";
+				i+=2;
+			}
+			else
+			{
+				out+="]";
+			}
+		}
+		else if((wcIn>8&&wcIn<14&&wcIn!=11&&wcIn!=12)||((unsigned char)wcIn>31&&(unsigned char)wcIn<128))
+		{
+			// Preserve
+			out+=wcIn;
+		} // else ignore character
+	}
+	out=out+"]]>";
+	return out;
+}
+
+class CDocumentBuilder {
+private:
+	std::string m_gzip; // Compressed batch so far
+	CGzipStream m_deflate;
+	size_t m_nDeflated; // Bytes already compressed into m_gzip
+	enum { nDeflateChunk=64*1024 }; // Deflate in pieces of at least this much, not every small document
+
+	CDocumentBuilder(const CDocumentBuilder&);
+	CDocumentBuilder& operator=(const CDocumentBuilder&);
+
+	void Deflate()
+	{
+		m_deflate.Write(m_buf.data(), m_buf.size(), m_gzip);
+		m_nDeflated+=m_buf.size();
+		m_buf.clear();
+	}
+protected:
+	std::string m_buf; // Text, or with compression on, the documents not yet deflated
+	std::string m_strCommitWithin; // Milliseconds, or empty for none
+	size_t m_nDocs; // Completed documents in the open batch
+
+	void Append(const char* sz, size_t n)
+	{
+		m_buf.append(sz, n);
+	}
+	void Append(const char* sz)
+	{
+		m_buf.append(sz);
+	}
+	void AppendDigits(unsigned long long n, int nWidth)
+	{
+		// Decimal, zero padded to nWidth
+		char szBuff[24];
+		int i=sizeof(szBuff);
+		do
+		{
+			szBuff[--i]=(char)('0'+n%10);
+			n/=10;
+		} while(n||(int)sizeof(szBuff)-i<nWidth);
+		m_buf.append(szBuff+i, sizeof(szBuff)-i);
+	}
+	void AppendHex(const std::vector<unsigned char>& v)
+	{
+		// Upper case, two digits per byte
+		static const char szHex[]="0123456789ABCDEF";
+		for(size_t i=0;i<v.size();++i)
+		{
+			m_buf+=szHex[v[i]>>4];
+			m_buf+=szHex[v[i]&15];
+		}
+	}
+	void AppendDate(const tm& tmDate)
+	{
+		// YYYY-MM-DDTHH:mm:ssZ
+		AppendDigits(1900+tmDate.tm_year, 4);
+		m_buf+='-';
+		AppendDigits(1+tmDate.tm_mon, 2); // 0-11, need to add one
+		m_buf+='-';
+		AppendDigits(tmDate.tm_mday, 2);
+		m_buf+='T';
+		AppendDigits(tmDate.tm_hour, 2);
+		m_buf+=':';
+		AppendDigits(tmDate.tm_min, 2);
+		m_buf+=':';
+		AppendDigits(tmDate.tm_sec, 2);
+		m_buf+='Z';
+	}
+	// Format specific framing of batches and documents
+	virtual void OpenBatch()=0;
+	virtual void CloseBatch()=0;
+	virtual void OpenDoc()=0;
+	virtual void CloseDoc()=0;
+public:
+	CDocumentBuilder(size_t nReserve):m_nDeflated(0),m_nDocs(0)
+	{
+		m_buf.reserve(nReserve);
+	}
+	virtual ~CDocumentBuilder() {}
+	bool SetCompression(int nLevel) { return m_deflate.Init(nLevel); } // gzip level 1-9
+	bool IsCompressed() const { return m_deflate.IsOpen(); }
+	void SetCommitWithin(const std::string& strMs) { m_strCommitWithin=strMs; }
+	virtual const char* ContentType() const=0;
+	virtual std::string CommitCommand() const=0; // Body of an explicit commit request
+	virtual std::string DeleteCommand(const std::vector<std::string>& ids) const=0; // Deletes each id and its embedded messages (id.att(n))
+
+	// Batch and document structure
+	void BeginBatch()
+	{
+		m_buf.clear();
+		m_gzip.clear();
+		m_nDeflated=0;
+		m_nDocs=0;
+		m_deflate.Reset();
+		OpenBatch();
+	}
+	void EndBatch()
+	{
+		CloseBatch();
+		if(!IsCompressed())return;
+		Deflate();
+		m_deflate.Finish(m_gzip);
+	}
+	void BeginDoc() { OpenDoc(); }
+	void EndDoc()
+	{
+		// Nothing before a completed document can be rolled back, so it can be compressed
+		CloseDoc();
+		m_nDocs++;
+		if(IsCompressed()&&m_buf.size()>=nDeflateChunk)Deflate();
+	}
+	virtual void BeginField(const char* szName)=0;
+	virtual void EndField()=0;
+	size_t Mark() const { return m_buf.size(); }
+	void Rollback(size_t nMark) { if(nMark<m_buf.size())m_buf.resize(nMark); } // Drops a partly written document
+
+	// Field content
+	virtual void BeginText()=0; // Opens a filtered text value, written with Text() and Raw()
+	virtual void EndText()=0;
+	virtual void Text(const char* in, size_t n)=0;
+	void Text(const std::string& str) { Text(str.data(), str.length()); }
+	void Raw(const char* sz, size_t n) { Append(sz, n); } // Within text, for content known to need no escaping
+	void Clean(const std::string& str)
+	{
+		BeginText();
+		Text(str);
+		EndText();
+	}
+	virtual void Plain(const char* sz, size_t n)=0; // A short value from the store, such as the message class
+	void Plain(const std::string& str) { Plain(str.data(), str.length()); }
+	void Plain(const char* sz) { Plain(sz, strlen(sz)); }
+	virtual void Number(unsigned long long n)=0;
+	virtual void Hex(const std::vector<unsigned char>& v)=0;
+	virtual void Date(const tm& tmDate)=0;
+
+	// Buffer hand over
+	size_t Size() const { return m_nDeflated+m_buf.size(); } // Uncompressed
+	size_t WireSize() const { return IsCompressed()?m_gzip.size():m_buf.size(); }
+	const std::string& Buffer() const { return IsCompressed()?m_gzip:m_buf; }
+	void Swap(std::string& str) { (IsCompressed()?m_gzip:m_buf).swap(str); } // Takes str (cleared, capacity kept) in exchange for the batch
+};
+
+class CXmlDocumentBuilder : public CDocumentBuilder {
+	// <add><doc><field name="..."> batches, with text in CDATA sections exactly as CleanString writes them
+protected:
+	void OpenBatch()
+	{
+		if(m_strCommitWithin.empty())
+		{
+			Append("<add>");
+			return;
+		}
+		Append("<add commitWithin=\"");
+		Append(m_strCommitWithin.data(), m_strCommitWithin.length());
+		Append("\">");
+	}
+	void CloseBatch() { Append("</add>"); }
+	void OpenDoc() { Append("<doc>"); }
+	void CloseDoc() { Append("</doc>"); }
+public:
+	CXmlDocumentBuilder(size_t nReserve=64*1024):CDocumentBuilder(nReserve) {}
+	const char* ContentType() const { return "text/xml"; }
+	std::string CommitCommand() const { return "<commit/> "; }
+	std::string DeleteCommand(const std::vector<std::string>& ids) const
+	{
+		// Ids are hex, so need no escaping in a query
+		std::string strBody("<delete>");
+		for(size_t i=0;i<ids.size();++i)strBody+="<query>id:"+ids[i]+"*</query>";
+		return strBody+"</delete>";
+	}
+	void BeginField(const char* szName)
+	{
+		Append("<field name=\"");
+		Append(szName);
+		Append("\">");
+	}
+	void EndField() { Append("</field>"); }
+	void BeginText() { Append("<![CDATA["); }
+	void EndText() { Append("]]>"); }
+	void Text(const char* in, size_t n)
+	{
+		// Filters control characters and defuses ]]>, exactly as CleanString does, within an open CDATA section.
+		// The worst case (all ]]>) doubles in size, so room is made once and trimmed afterwards.
+		size_t nStart=m_buf.size();
+		m_buf.resize(nStart+2*n);
+		m_buf.resize(nStart+SanitiseText(in, n, &m_buf[0]+nStart));
+	}
+	void Plain(const char* sz, size_t n)
+	{
+		// Outside CDATA, so markup characters are escaped; other bytes are kept or dropped as Text
+		// does, which is also what the JSON builder keeps
+		for(size_t i=0;i<n;++i)
+		{
+			unsigned char u=(unsigned char)sz[i];
+			switch(u)
+			{
+			case '&': Append("&amp;"); break;
+			case '<': Append("&lt;"); break;
+			case '>': Append("&gt;"); break;
+			case '"': Append("&quot;"); break;
+			default:
+				if((u>31&&u<128)||u=='\t'||u=='\n'||u=='\r')m_buf+=(char)u;
+			}
+		}
+	}
+	void Number(unsigned long long n) { AppendDigits(n, 1); }
+	void Hex(const std::vector<unsigned char>& v) { AppendHex(v); }
+	void Date(const tm& tmDate) { AppendDate(tmDate); }
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+// Which fields each document gets, and where they come from. A plan is read once at startup,
+// from a text file of one field per line (blank lines and lines starting # are ignored):
+//   name  source  [type  [fallback]]
+// source is a property ID (eg 0x1035), or one of the fields worked out from several properties:
+//   @id @pstfile @created @sender @subject @to @attachments @filenames @body @attachmenttext
+// type applies to properties: string (as stored), text (cleaned up, for free text), number,
+// date or hex (binary). fallback says what to do when a message lacks the property: leave the
+// field out (the default, or -), fail the message (!), or write the rest of the line instead.
+// Names are letters, digits and _, so they need no escaping in either format.
+// The built in plan is the set of fields that has always been written.
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <ctype.h>
+
+enum EFieldSource {
+	eFieldProperty, // A single property
+	eFieldId, eFieldPstFile, eFieldCreated, eFieldSender, eFieldSubject, eFieldTo,
+	eFieldAttachments, eFieldFilenames, eFieldBody, eFieldAttachmentText
+};
+
+enum EFieldType { eTypeString, eTypeText, eTypeNumber, eTypeDate, eTypeHex };
+
+enum EFieldMissing { eMissingOmit, eMissingFail, eMissingValue };
+
+struct CField {
+	std::string strName;
+	EFieldSource eSource;
+	unsigned short nProp; // For eFieldProperty
+	EFieldType eType;
+	EFieldMissing eMissing;
+	std::string strFallback; // For eMissingValue
+	CField():eSource(eFieldProperty),nProp(0),eType(eTypeString),eMissing(eMissingOmit) {}
+};
+
+class CFieldPlan {
+private:
+	std::vector<CField> m_fields; // In the order written
+	unsigned int m_nSources; // Bit for each EFieldSource used
+
+	static bool ParseSource(const std::string& str, CField& field)
+	{
+		static const char* const szSources[]={"@id","@pstfile","@created","@sender","@subject","@to","@attachments","@filenames","@body","@attachmenttext"};
+		for(size_t i=0;i<sizeof(szSources)/sizeof(szSources[0]);++i)
+		{
+			if(str!=szSources[i])continue;
+			field.eSource=(EFieldSource)(eFieldId+i);
+			return true;
+		}
+		char* szEnd=0;
+		unsigned long nProp=strtoul(str.c_str(),&szEnd,0);
+		if(str.empty()||*szEnd||nProp==0||nProp>0xffff)return false;
+		field.nProp=(unsigned short)nProp;
+		return true;
+	}
+	static bool ValidName(const std::string& str)
+	{
+		for(size_t i=0;i<str.length();++i)
+			if(!isalnum((unsigned char)str[i])&&str[i]!='_')return false;
+		return true;
+	}
+	static bool ParseType(const std::string& str, EFieldType& eType)
+	{
+		static const char* const szTypes[]={"string","text","number","date","hex"};
+		for(size_t i=0;i<sizeof(szTypes)/sizeof(szTypes[0]);++i)
+		{
+			if(str!=szTypes[i])continue;
+			eType=(EFieldType)i;
+			return true;
+		}
+		return false;
+	}
+public:
+	CFieldPlan():m_nSources(0) {}
+	bool Parse(std::istream& in, std::string& strError)
+	{
+		// Replaces the plan; on failure strError names the line at fault
+		std::vector<CField> fields;
+		std::string strLine;
+		for(int nLine=1;std::getline(in, strLine);++nLine)
+		{
+			if(!strLine.empty()&&strLine[strLine.length()-1]=='\r')strLine.erase(strLine.length()-1);
+			std::istringstream line(strLine);
+			CField field;
+			std::string strSource, strType;
+			if(!(line >> field.strName)||field.strName[0]=='#')continue;
+			std::ostringstream ostrError;
+			ostrError << "line " << nLine << ": ";
+			if(!ValidName(field.strName))
+			{
+				strError=ostrError.str()+field.strName+" is not a field name (letters, digits and _ only)";
+				return false;
+			}
+			if(!(line >> strSource)||!ParseSource(strSource, field))
+			{
+				strError=ostrError.str()+"expected a property ID or built in field after "+field.strName;
+				return false;
+			}
+			if(field.eSource==eFieldProperty)
+			{
+				if(!(line >> strType)||!ParseType(strType, field.eType))
+				{
+					strError=ostrError.str()+"expected string, text, number, date or hex for "+field.strName;
+					return false;
+				}
+				std::string strFallback;
+				std::getline(line >> std::ws, strFallback);
+				if(strFallback=="!")field.eMissing=eMissingFail;
+				else if(strFallback!=""&&strFallback!="-")
+				{
+					field.eMissing=eMissingValue;
+					field.strFallback=strFallback;
+				}
+			}
+			for(size_t i=0;i<fields.size();++i)
+			{
+				if(fields[i].strName!=field.strName)continue;
+				strError=ostrError.str()+field.strName+" appears twice";
+				return false;
+			}
+			fields.push_back(field);
+		}
+		unsigned int nSources=0;
+		for(size_t i=0;i<fields.size();++i)nSources|=1u<<fields[i].eSource;
+		if(!(nSources&(1u<<eFieldId)))
+		{
+			strError="no @id field, which Solr needs as the unique key";
+			return false;
+		}
+		m_fields.swap(fields);
+		m_nSources=nSources;
+		return true;
+	}
+	bool Load(const std::string& strPath, std::string& strError)
+	{
+		std::ifstream in(strPath.c_str());
+		if(!in.is_open())
+		{
+			strError="unable to open";
+			return false;
+		}
+		return Parse(in, strError);
+	}
+	static CFieldPlan Default()
+	{
+		std::istringstream in(
+			"id             @id\n"
+			"pstfile        @pstfile\n"
+			"created        @created\n"
+			"sender         @sender\n"
+			"subject        @subject\n"
+			"to             @to\n"
+			"attachments    @attachments\n"
+			"filenames      @filenames\n"
+			"class          0x001A string !\n"
+			"body           @body\n"
+			"attachmenttext @attachmenttext\n");
+		CFieldPlan plan;
+		std::string strError;
+		plan.Parse(in, strError);
+		return plan;
+	}
+	const std::vector<CField>& Fields() const { return m_fields; }
+	bool Has(EFieldSource eSource) const { return (m_nSources&(1u<<eSource))!=0; }
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+// Incremental gzip compression into a std::string, fed piece by piece as a batch is built
+// so that the finished batch is already compressed when it is handed to a sender.
+
+#include <string>
+#include <string.h>
+#include <zlib.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "zlib.lib")
+#endif
+
+class CGzipStream {
+private:
+	z_stream m_zs;
+	bool m_bInit;
+	int m_nLevel;
+
+	CGzipStream(const CGzipStream&);
+	CGzipStream& operator=(const CGzipStream&);
+
+	void Deflate(const char* in, size_t n, std::string& out, int nFlush)
+	{
+		// Output is written straight into the tail of out, grown as needed
+		m_zs.next_in=(Bytef*)in;
+		m_zs.avail_in=(uInt)n;
+		int nResult;
+		do
+		{
+			size_t nOld=out.size();
+			size_t nRoom=deflateBound(&m_zs, m_zs.avail_in)+64;
+			out.resize(nOld+nRoom);
+			m_zs.next_out=(Bytef*)&out[nOld];
+			m_zs.avail_out=(uInt)nRoom;
+			nResult=deflate(&m_zs, nFlush);
+			out.resize(nOld+nRoom-m_zs.avail_out);
+		} while(nResult==Z_OK&&(m_zs.avail_in>0||(nFlush==Z_FINISH)));
+	}
+public:
+	CGzipStream():m_bInit(false),m_nLevel(0)
+	{
+		memset(&m_zs, 0, sizeof(m_zs));
+	}
+	~CGzipStream()
+	{
+		if(m_bInit)deflateEnd(&m_zs);
+	}
+	bool Init(int nLevel)
+	{
+		// Level 1 (fastest) to 9 (smallest); 16 added to the window bits asks zlib for a gzip wrapper
+		if(m_bInit)deflateEnd(&m_zs);
+		memset(&m_zs, 0, sizeof(m_zs));
+		m_nLevel=nLevel;
+		m_bInit=(deflateInit2(&m_zs, nLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY)==Z_OK);
+		return m_bInit;
+	}
+	bool IsOpen() const { return m_bInit; }
+	int Level() const { return m_nLevel; }
+	void Reset() { if(m_bInit)deflateReset(&m_zs); } // Starts a new gzip member
+	void Write(const char* in, size_t n, std::string& out) { if(n)Deflate(in, n, out, Z_NO_FLUSH); }
+	void Finish(std::string& out) { Deflate(0, 0, out, Z_FINISH); } // Flushes and writes the gzip trailer
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+// Streaming writer for Solr's JSON update command format:
+//   {"add":{"commitWithin":60000,"doc":{"id":"...",...}},"add":{...}}
+// which is cheaper for Solr to parse than the XML. Text is filtered the same way as for
+// the XML (control characters other than tab, CR and LF, and 8 bit bytes, are dropped)
+// so both formats index identical content.
+
+#include "DocumentBuilder.h"
+
+class CJsonDocumentBuilder : public CDocumentBuilder {
+private:
+	bool m_bFirstField;
+
+	void AppendEscaped(const char* in, size_t n)
+	{
+		// At most one escape per input byte, so room for twice the input is made once and trimmed afterwards
+		size_t nStart=m_buf.size();
+		m_buf.resize(nStart+2*n);
+		m_buf.resize(nStart+EscapeJsonText(in, n, &m_buf[0]+nStart));
+	}
+protected:
+	void OpenBatch() { m_buf+='{'; }
+	void CloseBatch() { m_buf+='}'; }
+	void OpenDoc()
+	{
+		if(m_nDocs)m_buf+=',';
+		if(m_strCommitWithin.empty())
+			Append("\"add\":{\"doc\":{");
+		else
+		{
+			Append("\"add\":{\"commitWithin\":");
+			Append(m_strCommitWithin.data(), m_strCommitWithin.length());
+			Append(",\"doc\":{");
+		}
+		m_bFirstField=true;
+	}
+	void CloseDoc() { Append("}}"); }
+public:
+	CJsonDocumentBuilder(size_t nReserve=64*1024):CDocumentBuilder(nReserve),m_bFirstField(true) {}
+	const char* ContentType() const { return "application/json"; }
+	std::string CommitCommand() const { return "{\"commit\":{}}"; }
+	std::string DeleteCommand(const std::vector<std::string>& ids) const
+	{
+		// Repeated keys, as for add
+		std::string strBody("{");
+		for(size_t i=0;i<ids.size();++i)strBody+=(i?",":"")+std::string("\"delete\":{\"query\":\"id:")+ids[i]+"*\"}";
+		return strBody+"}";
+	}
+	void BeginField(const char* szName)
+	{
+		if(!m_bFirstField)m_buf+=',';
+		m_bFirstField=false;
+		m_buf+='"';
+		Append(szName);
+		Append("\":");
+	}
+	void EndField() {}
+	void BeginText() { m_buf+='"'; }
+	void EndText() { m_buf+='"'; }
+	void Text(const char* in, size_t n) { AppendEscaped(in, n); }
+	void Plain(const char* sz, size_t n)
+	{
+		m_buf+='"';
+		AppendEscaped(sz, n);
+		m_buf+='"';
+	}
+	void Number(unsigned long long n) { AppendDigits(n, 1); }
+	void Hex(const std::vector<unsigned char>& v)
+	{
+		m_buf+='"';
+		AppendHex(v);
+		m_buf+='"';
+	}
+	void Date(const tm& tmDate)
+	{
+		m_buf+='"';
+		AppendDate(tmDate);
+		m_buf+='"';
+	}
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+// A read only view of a whole pst, shared by every thread parsing it. Fairport reads through a
+// file handle of its own, a block at a time and in B-tree rather than file order, which on a cold
+// cache costs a seek for most blocks. Reading the view ahead of the parsers, in file order and
+// with sequential and will-need hints, turns that into one streaming pass, after which fairport's
+// reads are served from the system cache. The view's pages are the cache's, so mapping a large
+// file takes address space but no memory of its own. Reading ahead stops at a byte budget: past
+// what the cache can hold, early pages would be evicted before fairport reached them.
+
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class CMappedFile {
+private:
+#ifdef _WIN32
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+#else
+	int m_fd;
+#endif
+	const unsigned char* m_pData;
+	unsigned long long m_nSize;
+	std::thread m_reader;
+	std::atomic<bool> m_bStop;
+	std::atomic<unsigned long long> m_nRead; // Bytes read ahead so far
+	unsigned long long m_nLimit; // Where reading ahead stops, 0 when not reading ahead
+	static const unsigned long long m_nPage=4096;
+
+	CMappedFile(const CMappedFile&);
+	CMappedFile& operator=(const CMappedFile&);
+
+	void ReadAhead()
+	{
+		// Touches a byte of every page, a window at a time, each window hinted before it is touched
+		static const unsigned long long nWindow=8*1024*1024;
+		volatile unsigned char nSink=0;
+		for(unsigned long long nOffset=0;nOffset<m_nLimit&&!m_bStop;nOffset+=nWindow)
+		{
+			unsigned long long nEnd=std::min(m_nLimit, nOffset+nWindow);
+#ifndef _WIN32
+			madvise((void*)(m_pData+nOffset), (size_t)(nEnd-nOffset), MADV_WILLNEED);
+#endif
+			for(unsigned long long n=nOffset;n<nEnd&&!m_bStop;n+=m_nPage)nSink^=m_pData[n];
+			m_nRead=nEnd;
+		}
+	}
+public:
+	CMappedFile():
+#ifdef _WIN32
+		m_hFile(INVALID_HANDLE_VALUE),m_hMapping(0),
+#else
+		m_fd(-1),
+#endif
+		m_pData(0),m_nSize(0),m_bStop(false),m_nRead(0),m_nLimit(0) {}
+	~CMappedFile()
+	{
+		Close();
+	}
+	bool Open(const std::string& strPath)
+	{
+		Close();
+#ifdef _WIN32
+		m_hFile=CreateFileA(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+		if(m_hFile==INVALID_HANDLE_VALUE)return false;
+		LARGE_INTEGER size;
+		if(!GetFileSizeEx(m_hFile, &size)||size.QuadPart==0)
+		{
+			Close();
+			return false;
+		}
+		m_nSize=(unsigned long long)size.QuadPart;
+		m_hMapping=CreateFileMappingA(m_hFile, 0, PAGE_READONLY, 0, 0, 0);
+		if(m_hMapping)m_pData=(const unsigned char*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		m_fd=open(strPath.c_str(), O_RDONLY);
+		if(m_fd<0)return false;
+		struct stat st;
+		if(fstat(m_fd, &st)!=0||st.st_size==0)
+		{
+			Close();
+			return false;
+		}
+		m_nSize=(unsigned long long)st.st_size;
+		void* p=mmap(0, (size_t)m_nSize, PROT_READ, MAP_SHARED, m_fd, 0);
+		if(p!=MAP_FAILED)
+		{
+			m_pData=(const unsigned char*)p;
+			madvise(p, (size_t)m_nSize, MADV_SEQUENTIAL);
+		}
+#endif
+		if(!m_pData)
+		{
+			Close();
+			return false;
+		}
+		return true;
+	}
+	void ReadAheadInBackground(unsigned long long nBudget=0)
+	{
+		// On a thread of its own, stopped by Close(); the first nBudget bytes, or all with 0
+		if(!m_pData||m_reader.joinable())return;
+		m_nLimit=(nBudget&&nBudget<m_nSize?nBudget:m_nSize);
+		m_bStop=false;
+		m_reader=std::thread(&CMappedFile::ReadAhead, this);
+	}
+	void WillNeed(unsigned long long nOffset, unsigned long long nBytes) const
+	{
+		// Brings part of the file into the cache, for a read expected shortly
+		if(!m_pData||nOffset>=m_nSize)return;
+		unsigned long long nEnd=std::min(m_nSize, nOffset+(nBytes?nBytes:1));
+		nOffset&=~(m_nPage-1);
+#ifndef _WIN32
+		madvise((void*)(m_pData+nOffset), (size_t)(nEnd-nOffset), MADV_WILLNEED);
+#endif
+		volatile unsigned char nSink=0;
+		for(unsigned long long n=nOffset;n<nEnd;n+=m_nPage)nSink^=m_pData[n];
+	}
+	void Close()
+	{
+		m_bStop=true;
+		if(m_reader.joinable())m_reader.join();
+#ifdef _WIN32
+		if(m_pData)UnmapViewOfFile(m_pData);
+		if(m_hMapping)CloseHandle(m_hMapping);
+		if(m_hFile!=INVALID_HANDLE_VALUE)CloseHandle(m_hFile);
+		m_hMapping=0;
+		m_hFile=INVALID_HANDLE_VALUE;
+#else
+		if(m_pData)munmap((void*)m_pData, (size_t)m_nSize);
+		if(m_fd>=0)close(m_fd);
+		m_fd=-1;
+#endif
+		m_pData=0;
+		m_nSize=0;
+		m_nLimit=0;
+	}
+	const unsigned char* Data() const { return m_pData; }
+	unsigned long long Size() const { return m_nSize; }
+	unsigned long long ReadSoFar() const { return m_nRead; }
+	bool ReadsAll() const { return m_pData&&m_nLimit==m_nSize; } // Whole file being read ahead
+};
@@ -0,0 +1,346 @@
+#pragma once
+
+// Live figures for the whole run, shared by every pst being processed, for seeing while it runs
+// whether parsing, encoding or Solr is what holds it up. Counters and per-stage latency histograms
+// are relaxed atomics with fixed buckets, so recording takes no lock on the parsing and sending
+// threads. They are served in Prometheus text format on a loopback port (/METRICS:port), and
+// can be appended to a file as one JSON object per line every few seconds (/METRICSLOG:file).
+// The per-pst totals printed with /S are kept as before.
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <algorithm>
+#include <boost/asio.hpp>
+
+class CLatencyHistogram {
+	// Durations counted against fixed upper bounds, from 50us to 10s, and a sum
+public:
+	static const size_t nBuckets=16; // Plus one for anything longer
+	static unsigned long long Bound(size_t i)
+	{
+		// Upper bound of bucket i, in microseconds
+		static const unsigned long long nBounds[nBuckets]={50,100,250,500,1000,2500,5000,10000,25000,50000,100000,250000,500000,1000000,2500000,10000000};
+		return nBounds[i];
+	}
+private:
+	std::atomic<unsigned long long> m_counts[nBuckets+1];
+	std::atomic<unsigned long long> m_nSum; // Microseconds
+public:
+	CLatencyHistogram():m_nSum(0)
+	{
+		for(size_t i=0;i<=nBuckets;++i)m_counts[i]=0;
+	}
+	void Observe(unsigned long long nMicros)
+	{
+		size_t i=0;
+		while(i<nBuckets&&nMicros>Bound(i))i++;
+		m_counts[i].fetch_add(1, std::memory_order_relaxed);
+		m_nSum.fetch_add(nMicros, std::memory_order_relaxed);
+	}
+	unsigned long long Bucket(size_t i) const { return m_counts[i].load(std::memory_order_relaxed); }
+	unsigned long long Sum() const { return m_nSum.load(std::memory_order_relaxed); }
+	unsigned long long Count() const
+	{
+		unsigned long long n=0;
+		for(size_t i=0;i<=nBuckets;++i)n+=Bucket(i);
+		return n;
+	}
+	double Percentile(double dFraction) const
+	{
+		// In milliseconds, as the upper bound of the bucket holding it (the last bound where beyond)
+		unsigned long long nTotal=Count();
+		if(nTotal==0)return 0;
+		unsigned long long nRank=(unsigned long long)(dFraction*nTotal+0.999999), n=0;
+		if(nRank<1)nRank=1;
+		for(size_t i=0;i<nBuckets;++i)
+		{
+			n+=Bucket(i);
+			if(n>=nRank)return Bound(i)/1000.0;
+		}
+		return Bound(nBuckets-1)/1000.0;
+	}
+};
+
+class CMetrics {
+public:
+	enum ECounter {
+		eMessages, eFailed, eSkipped, eAttachments, eEmbedded, eTruncated, eBatches, eBatchesFailed, eRetries, eDeadLettered, eRawBytes, eWireBytes, eCounters
+	};
+	enum EStage {
+		eStageParse,           // A whole document, from opening it to its last field
+		eStageRead,            // Its property list and attachment walk, before any field is written
+		eStageEncode,          // Writing its fields, with the property values they need
+		eStageSubmit,          // A request to Solr and its response
+		eStageAttachmentWrite, // An attachment's content to disk, by whichever thread writes it
+		eStages
+	};
+private:
+	std::atomic<unsigned long long> m_counters[eCounters];
+	CLatencyHistogram m_stages[eStages];
+	std::chrono::steady_clock::time_point m_start;
+
+	CMetrics(const CMetrics&);
+	CMetrics& operator=(const CMetrics&);
+
+	static const char* CounterName(ECounter e)
+	{
+		static const char* const szNames[eCounters]={"messages","failed","skipped","attachments","embedded","truncated","batches","batches_failed","retries","dead_lettered","raw_bytes","wire_bytes"};
+		return szNames[e];
+	}
+	static const char* CounterHelp(ECounter e)
+	{
+		static const char* const szHelp[eCounters]={
+			"Messages indexed as documents",
+			"Messages that failed to parse",
+			"Messages left out as already indexed or unchanged",
+			"Attachments met",
+			"Attachments that are messages",
+			"Embedded messages left out by the depth or size limits",
+			"Batches accepted by Solr",
+			"Batches that failed to send or were refused",
+			"Requests sent again after failing",
+			"Failed batches written to the dead letter directory",
+			"Batch payload bytes before compression",
+			"Batch payload bytes as sent"};
+		return szHelp[e];
+	}
+	static const char* StageName(EStage e)
+	{
+		static const char* const szNames[eStages]={"parse","read","encode","submit","attachment_write"};
+		return szNames[e];
+	}
+public:
+	CMetrics():m_start(std::chrono::steady_clock::now())
+	{
+		for(size_t i=0;i<eCounters;++i)m_counters[i]=0;
+	}
+	void Add(ECounter e, unsigned long long n=1) { m_counters[e].fetch_add(n, std::memory_order_relaxed); }
+	void Observe(EStage e, unsigned long long nMicros) { m_stages[e].Observe(nMicros); }
+	unsigned long long Counter(ECounter e) const { return m_counters[e].load(std::memory_order_relaxed); }
+	const CLatencyHistogram& Stage(EStage e) const { return m_stages[e]; }
+	double Uptime() const
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-m_start).count()/1e6;
+	}
+	std::string Prometheus() const
+	{
+		// Text exposition format 0.0.4
+		std::ostringstream out;
+		out << "# HELP pstreader_uptime_seconds Time since the run started\n# TYPE pstreader_uptime_seconds gauge\n"
+			<< "pstreader_uptime_seconds " << Uptime() << "\n";
+		for(size_t i=0;i<eCounters;++i)
+		{
+			std::string strName=std::string("pstreader_")+CounterName((ECounter)i)+"_total";
+			out << "# HELP " << strName << " " << CounterHelp((ECounter)i) << "\n# TYPE " << strName << " counter\n"
+				<< strName << " " << Counter((ECounter)i) << "\n";
+		}
+		out << "# HELP pstreader_stage_seconds Time taken by each unit of work in a stage\n# TYPE pstreader_stage_seconds histogram\n";
+		for(size_t i=0;i<eStages;++i)
+		{
+			const CLatencyHistogram& h=m_stages[i];
+			std::string strStage=StageName((EStage)i);
+			unsigned long long n=0;
+			for(size_t b=0;b<CLatencyHistogram::nBuckets;++b)
+			{
+				n+=h.Bucket(b);
+				out << "pstreader_stage_seconds_bucket{stage=\"" << strStage << "\",le=\"" << CLatencyHistogram::Bound(b)/1e6 << "\"} " << n << "\n";
+			}
+			n+=h.Bucket(CLatencyHistogram::nBuckets);
+			out << "pstreader_stage_seconds_bucket{stage=\"" << strStage << "\",le=\"+Inf\"} " << n << "\n"
+				<< "pstreader_stage_seconds_sum{stage=\"" << strStage << "\"} " << h.Sum()/1e6 << "\n"
+				<< "pstreader_stage_seconds_count{stage=\"" << strStage << "\"} " << n << "\n";
+		}
+		return out.str();
+	}
+	std::string JsonLine() const
+	{
+		// {"time":"...Z","uptime_s":x,"messages":n,...,"stages":{"parse":{"count":n,"sum_s":x,"p50_ms":x,"p90_ms":x,"p99_ms":x},...}}
+		std::ostringstream out;
+		time_t now=time(0);
+		tm tmNow=*gmtime(&now);
+		char szTime[32];
+		strftime(szTime, sizeof(szTime), "%Y-%m-%dT%H:%M:%SZ", &tmNow);
+		out << "{\"time\":\"" << szTime << "\",\"uptime_s\":" << std::fixed << std::setprecision(3) << Uptime();
+		for(size_t i=0;i<eCounters;++i)out << ",\"" << CounterName((ECounter)i) << "\":" << Counter((ECounter)i);
+		out << ",\"stages\":{";
+		for(size_t i=0;i<eStages;++i)
+		{
+			const CLatencyHistogram& h=m_stages[i];
+			out << (i?",":"") << "\"" << StageName((EStage)i) << "\":{\"count\":" << h.Count() << ",\"sum_s\":" << h.Sum()/1e6
+				<< ",\"p50_ms\":" << h.Percentile(0.5) << ",\"p90_ms\":" << h.Percentile(0.9) << ",\"p99_ms\":" << h.Percentile(0.99) << "}";
+		}
+		out << "}}";
+		return out.str();
+	}
+};
+
+class CStageTimer {
+	// Times a stage from construction until Stop(), Next() or going out of scope, recording
+	// nothing without metrics
+private:
+	CMetrics* m_pMetrics;
+	CMetrics::EStage m_eStage;
+	bool m_bRunning;
+	std::chrono::steady_clock::time_point m_start;
+public:
+	CStageTimer(CMetrics* pMetrics, CMetrics::EStage eStage):m_pMetrics(pMetrics),m_eStage(eStage),m_bRunning(pMetrics!=0)
+	{
+		if(m_bRunning)m_start=std::chrono::steady_clock::now();
+	}
+	~CStageTimer()
+	{
+		Stop();
+	}
+	void Stop()
+	{
+		if(!m_bRunning)return;
+		m_bRunning=false;
+		m_pMetrics->Observe(m_eStage, (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-m_start).count());
+	}
+	void Next(CMetrics::EStage eStage)
+	{
+		// Records this stage and starts timing the one following it
+		Stop();
+		m_eStage=eStage;
+		m_bRunning=(m_pMetrics!=0);
+		if(m_bRunning)m_start=std::chrono::steady_clock::now();
+	}
+};
+
+class CMetricsServer {
+	// Answers GET /metrics on 127.0.0.1:port, one connection at a time, each closed after its response
+private:
+	const CMetrics& m_metrics;
+	boost::asio::io_service m_io;
+	boost::asio::ip::tcp::acceptor m_acceptor;
+	std::thread m_listener;
+	std::atomic<bool> m_bStop;
+
+	CMetricsServer(const CMetricsServer&);
+	CMetricsServer& operator=(const CMetricsServer&);
+
+	void Serve(boost::asio::ip::tcp::socket& socket)
+	{
+		boost::asio::streambuf buf;
+		boost::system::error_code error;
+		boost::asio::read_until(socket, buf, "\r\n\r\n", error);
+		if(error)return;
+		std::string strRequest(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_end(buf.data()));
+		std::string strStatus="200 OK", strBody;
+		if(strRequest.find("GET /metrics ")==0||strRequest.find("GET / ")==0)
+		{
+			strBody=m_metrics.Prometheus();
+		}
+		else
+		{
+			strStatus="404 Not Found";
+			strBody="Not found\n";
+		}
+		std::ostringstream ostrResponse;
+		ostrResponse << "HTTP/1.1 " << strStatus << "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " << strBody.length()
+			<< "\r\nConnection: close\r\n\r\n" << strBody;
+		boost::asio::write(socket, boost::asio::buffer(ostrResponse.str()), error);
+	}
+	void Listen()
+	{
+		for(;;)
+		{
+			boost::asio::ip::tcp::socket socket(m_io);
+			boost::system::error_code error;
+			m_acceptor.accept(socket, error);
+			if(m_bStop)break;
+			if(!error)Serve(socket);
+		}
+	}
+public:
+	CMetricsServer(const CMetrics& metrics):m_metrics(metrics),m_acceptor(m_io),m_bStop(false) {}
+	~CMetricsServer()
+	{
+		Stop();
+	}
+	bool Start(unsigned short nPort, boost::system::error_code& error)
+	{
+		// Loopback only: the figures are for whoever runs the job, not the network
+		boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), nPort);
+		m_acceptor.open(endpoint.protocol(), error);
+		if(!error)m_acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), error);
+		if(!error)m_acceptor.bind(endpoint, error);
+		if(!error)m_acceptor.listen(boost::asio::socket_base::max_connections, error);
+		if(error)return false;
+		m_listener=std::thread(&CMetricsServer::Listen, this);
+		return true;
+	}
+	void Stop()
+	{
+		// A connection of its own wakes the listener
+		if(!m_listener.joinable())return;
+		m_bStop=true;
+		{
+			boost::asio::ip::tcp::socket wake(m_io);
+			boost::system::error_code error;
+			wake.connect(m_acceptor.local_endpoint(), error);
+		}
+		m_listener.join();
+	}
+	unsigned short Port() const { return m_acceptor.local_endpoint().port(); }
+};
+
+class CMetricsLog {
+	// Appends the metrics to a file as a JSON line every so often, and once more when stopped
+private:
+	const CMetrics& m_metrics;
+	std::ofstream m_file;
+	unsigned long m_nSeconds;
+	std::thread m_writer;
+	std::mutex m_mutex;
+	std::condition_variable m_cvStop;
+	bool m_bStop;
+
+	CMetricsLog(const CMetricsLog&);
+	CMetricsLog& operator=(const CMetricsLog&);
+
+	void Write()
+	{
+		m_file << m_metrics.JsonLine() << "\n";
+		m_file.flush();
+	}
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(!m_cvStop.wait_for(lock, std::chrono::seconds(m_nSeconds), [this]() { return m_bStop; }))Write();
+		Write();
+	}
+public:
+	CMetricsLog(const CMetrics& metrics):m_metrics(metrics),m_nSeconds(10),m_bStop(false) {}
+	~CMetricsLog()
+	{
+		Stop();
+	}
+	bool Start(const std::string& strPath, unsigned long nSeconds)
+	{
+		m_file.open(strPath.c_str(), std::ios::out|std::ios::app);
+		if(!m_file.is_open())return false;
+		m_nSeconds=(nSeconds?nSeconds:1);
+		m_writer=std::thread(&CMetricsLog::Run, this);
+		return true;
+	}
+	void Stop()
+	{
+		if(!m_writer.joinable())return;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bStop=true;
+		}
+		m_cvStop.notify_all();
+		m_writer.join();
+	}
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+// The few calls that differ between Windows and POSIX systems, so that the rest of the code
+// needs no conditional compilation: finding files by wildcard, full paths, file sizes and
+// times, flushing a file to disk and the size of physical memory.
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <glob.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+static const char PATH_SEPARATOR='\\';
+static const char* const PATH_SEPARATORS="\\/"; // Either is accepted
+#else
+static const char PATH_SEPARATOR='/';
+static const char* const PATH_SEPARATORS="/";
+#endif
+
+struct CFoundFile {
+	std::string strName; // Without the directory
+	unsigned long long nSize;
+};
+
+static std::vector<CFoundFile> FindMatching(const std::string& strPattern)
+{
+	// Whatever matches a wildcard pattern, in the order the system lists it
+	std::vector<CFoundFile> files;
+#ifdef _WIN32
+	intptr_t file;
+	_finddatai64_t filedata; // 64 bit sizes, as pst files often pass 4GB
+	file=_findfirsti64(strPattern.c_str(),&filedata);
+	if(file!=-1)
+	{
+		do
+		{
+			CFoundFile found;
+			found.strName=filedata.name;
+			found.nSize=(unsigned long long)filedata.size;
+			files.push_back(found);
+		} while(_findnexti64(file,&filedata)==0);
+		_findclose(file);
+	}
+#else
+	glob_t matches;
+	if(glob(strPattern.c_str(),0,0,&matches)==0)
+	{
+		for(size_t i=0;i<matches.gl_pathc;++i)
+		{
+			CFoundFile found;
+			std::string strPath(matches.gl_pathv[i]);
+			size_t pos=strPath.rfind('/');
+			found.strName=(pos==std::string::npos?strPath:strPath.substr(pos+1));
+			struct stat st;
+			found.nSize=(stat(matches.gl_pathv[i],&st)==0?(unsigned long long)st.st_size:0);
+			files.push_back(found);
+		}
+	}
+	globfree(&matches);
+#endif
+	return files;
+}
+
+static std::string FullPath(const std::string& strPath)
+{
+	// As given where it cannot be resolved
+#ifdef _WIN32
+	char szPath[2048];
+	if(_fullpath(szPath,strPath.c_str(),sizeof(szPath)))return szPath;
+#else
+	char szPath[PATH_MAX];
+	if(realpath(strPath.c_str(),szPath))return szPath;
+#endif
+	return strPath;
+}
+
+static bool FileInfo(const std::string& strPath, unsigned long long& nSize, long long& nModified)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if(_stat64(strPath.c_str(),&st)!=0)return false;
+#else
+	struct stat st;
+	if(stat(strPath.c_str(),&st)!=0)return false;
+#endif
+	nSize=(unsigned long long)st.st_size;
+	nModified=(long long)st.st_mtime;
+	return true;
+}
+
+static bool SyncFile(FILE* fp)
+{
+	// Whatever has been written reaches the disk, not just the system's cache
+	if(fflush(fp)!=0)return false;
+#ifdef _WIN32
+	return _commit(_fileno(fp))==0;
+#else
+	return fsync(fileno(fp))==0;
+#endif
+}
+
+static unsigned long long PhysicalMemory()
+{
+	// In bytes, 0 where it cannot be found
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength=sizeof(status);
+	return GlobalMemoryStatusEx(&status)?(unsigned long long)status.ullTotalPhys:0;
+#else
+	long nPages=sysconf(_SC_PHYS_PAGES), nPageSize=sysconf(_SC_PAGE_SIZE);
+	return (nPages>0&&nPageSize>0)?(unsigned long long)nPages*(unsigned long long)nPageSize:0;
+#endif
+}
+
+static void ClearScreen()
+{
+	// Only on a Windows console; elsewhere output is usually a log
+#ifdef _WIN32
+	system("cls");
+#endif
+}
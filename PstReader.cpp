@@ -9,58 +9,238 @@
 #include <iomanip>
 #include <stdio.h>
 #include <regex>
-#include <io.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
 
 #define BOOST_DATE_TIME_NO_LIB 
 #define BOOST_REGEX_NO_LIB 
 
 #include <boost/asio.hpp>
 #include "fairport/pst.h"
+#include "Platform.h"
+#include "SolrConnection.h"
+#include "BoundedQueue.h"
+#include "WorkStealingPool.h"
+#include "BatchPolicy.h"
+#include "JsonDocumentBuilder.h"
+#include "BatchSink.h"
+#include "Checkpoint.h"
+#include "DeltaState.h"
+#include "AttachmentStore.h"
+#include "TextExtractor.h"
+#include "FieldPlan.h"
+#include "MappedFile.h"
+#include "Metrics.h"
+#include "Benchmark.h"
 
 #pragma comment( compiler )
 #pragma comment( user, "PstReader v0.2 compiled on " __DATE__ " at " __TIME__ )
 
 class CTimer{
-	__int64	m_ticksStart;
-	__int64	m_ticks;
-	static __int64 m_freq; // Adjusted so as to return time in microseconds
+	// Monotonic, in 64 bit microseconds, so long runs no longer wrap after a little over an hour
+	std::chrono::steady_clock::time_point m_start;
+	unsigned long long m_us;
 public:
-	CTimer():m_ticksStart(0),m_ticks(0)
+	CTimer():m_start(std::chrono::steady_clock::now()),m_us(0) {};
+	// Between Start() and Mark(), or the last two marks
+	unsigned long long MicroSeconds() const 
 	{
-		if(!m_freq)
-		{
-			QueryPerformanceFrequency((LARGE_INTEGER*)&m_freq);
-			m_freq/=1000000;
-		}
-	};
-	// Maximum is 2^32/1000000=2^32/~2^20=2^12 seconds or a few minutes over an hour....
-	const unsigned long MicroSeconds() const 
-	{
-		return (const unsigned long)(m_ticks/m_freq);
+		return m_us;
 	};	
-	const std::string Seconds() const
+	std::string Seconds() const
 	{
-		long ms = MicroSeconds();
-		long div=ms/1000000;
-		long rem=ms%1000000;
-		char szBuff[2*_MAX_INT_DIG];
-		sprintf_s(szBuff, sizeof(szBuff), "%d.%d", div,rem);
+		unsigned long long us = MicroSeconds();
+		char szBuff[48];
+		snprintf(szBuff, sizeof(szBuff), "%llu.%06llu", us/1000000, us%1000000);
 		return (std::string(szBuff));
 	}
+	// Time since Start() or the last Mark(), in microseconds, without marking
+	unsigned long long Elapsed() const
+	{
+		return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-m_start).count();
+	};
 	void Start() 
 	{
-		QueryPerformanceCounter((LARGE_INTEGER*)&m_ticksStart);
+		m_start=std::chrono::steady_clock::now();
 	};
 	void Mark() 
 	{
-		QueryPerformanceCounter((LARGE_INTEGER *)&m_ticks);
-		__int64 ticks=m_ticks;
-		m_ticks-=m_ticksStart;
-		m_ticksStart=ticks;
+		std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now();
+		m_us=(unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(now-m_start).count();
+		m_start=now;
 	};
 };
 
-__int64 CTimer::m_freq=0;
+struct CFolderTally {
+	// Per folder counts; the folder line is printed by whichever of the parser or
+	// the senders finishes with the folder last
+	std::string strIndent;
+	std::atomic<size_t> nParsed;
+	std::atomic<size_t> nSubmitted;
+	std::atomic<int> nPending; // Ranges still being parsed, plus batches holding its documents
+	unsigned int nid; // For the checkpoint
+	CTimer oTimer;
+	CFolderTally(const std::string& indent, unsigned int id=0):strIndent(indent),nParsed(0),nSubmitted(0),nPending(1),nid(id) {}
+};
+
+struct CPSTTotals {
+	// Summary statistics, for one pst or summed over a run
+	unsigned long nFiles;
+	unsigned long nFolders;
+	unsigned long nProcessed;
+	unsigned long nMsgAttachment;
+	unsigned long nTruncated; // Embedded messages beyond the depth or size limits
+	unsigned long nProcFail;
+	unsigned long nSkipped;
+	unsigned long nRemoved; // Gone from the pst since the last delta run
+	unsigned long nSubmitted;
+	unsigned long nFail;
+	unsigned long nRetries;
+	unsigned long nDeadLetter; // Failed batches kept for replay
+	unsigned long long sentBytes;
+	unsigned long long rawBytes; // Update payloads before compression
+	unsigned long long wireBytes; // and as sent
+	unsigned long nAttachments;
+	unsigned long nAttSaved;
+	unsigned long nAttDuplicate; // Content already in the attachment store
+	unsigned long nAttFailed;
+	CPSTTotals():nFiles(0),nFolders(0),nProcessed(0),nMsgAttachment(0),nTruncated(0),nProcFail(0),nSkipped(0),nRemoved(0),nSubmitted(0),nFail(0),nRetries(0),nDeadLetter(0),
+		sentBytes(0),rawBytes(0),wireBytes(0),nAttachments(0),nAttSaved(0),nAttDuplicate(0),nAttFailed(0) {}
+	CPSTTotals& operator+=(const CPSTTotals& o)
+	{
+		nFiles+=o.nFiles;
+		nFolders+=o.nFolders;
+		nProcessed+=o.nProcessed;
+		nMsgAttachment+=o.nMsgAttachment;
+		nTruncated+=o.nTruncated;
+		nProcFail+=o.nProcFail;
+		nSkipped+=o.nSkipped;
+		nRemoved+=o.nRemoved;
+		nSubmitted+=o.nSubmitted;
+		nFail+=o.nFail;
+		nRetries+=o.nRetries;
+		nDeadLetter+=o.nDeadLetter;
+		sentBytes+=o.sentBytes;
+		rawBytes+=o.rawBytes;
+		wireBytes+=o.wireBytes;
+		nAttachments+=o.nAttachments;
+		nAttSaved+=o.nAttSaved;
+		nAttDuplicate+=o.nAttDuplicate;
+		nAttFailed+=o.nAttFailed;
+		return *this;
+	}
+	void Print(std::ostream& out, const CTimer& oTimer) const
+	{
+		out << std::endl << std::endl
+			<< "Total time: " << oTimer.Seconds() << " seconds" << std::endl;
+		if(nFiles>1)out << "Pst files processed: " << nFiles << std::endl;
+		out << "Folders traversed: " << nFolders << std::endl
+			<< "Messages successfully processed (of which are embedded attachments): " << nProcessed << " (" << nMsgAttachment << ")" << std::endl
+			<< "Messages failed to process: " << nProcFail << std::endl;
+		if(nTruncated)out << "Embedded messages skipped (depth/size limits): " << nTruncated << std::endl;
+		if(nSkipped)out << "Messages skipped (already indexed): " << nSkipped << std::endl;
+		if(nRemoved)out << "Messages removed since the last run: " << nRemoved << std::endl;
+		out
+			<< "Successfully submitted: " << nSubmitted << std::endl
+			<< "Failed to submit: " << nFail << std::endl;
+		if(nRetries)out << "Requests retried: " << nRetries << std::endl;
+		if(nDeadLetter)out << "Failed batches kept for replay: " << nDeadLetter << std::endl;
+		out
+			<< "Bytes sent: " << sentBytes << std::endl
+			<< "Payload bytes (uncompressed/on the wire): " << rawBytes << "/" << wireBytes;
+		if(wireBytes)out << " (" << std::fixed << std::setprecision(1) << (double)rawBytes/wireBytes << ":1)";
+		out.unsetf(std::ios::floatfield);
+		out << std::endl
+			<< "Attachments processed (saved/already stored/failed to save): " << nAttachments << " (" << nAttSaved << "/" << nAttDuplicate << "/" << nAttFailed << ")" << std::endl << std::endl;
+	}
+};
+
+struct CBatch {
+	std::string strBody;
+	size_t nRawBytes; // Before compression
+	size_t nDocs;
+	std::vector<unsigned int> messages; // Message nids, in folder order, when checkpointing
+	std::vector<std::pair<std::shared_ptr<CFolderTally>,size_t> > folders; // Folders with documents in the batch, and how many
+	bool bOK; // Written to every sink so far
+	unsigned int nAttempt; // Solr requests made for it
+	std::chrono::steady_clock::time_point due; // When to send it to Solr again, once it has failed
+	CBatch():nRawBytes(0),nDocs(0),bOK(true),nAttempt(0) {}
+};
+
+struct CPSTOptions {
+	// Settings from the command line, shared by every pst in the run
+	std::string strHost; // eg:localhost
+	std::string strPort; // eg:8984
+	std::string strUrlPath; // eg:/solr/PstSearch/update
+	std::string strTimeoutMs; // commitWithin
+	bool bDoIndex;
+	bool bDoAttachments;
+	bool bDoFireForget;
+	bool bCommit; // Commit once at the end of the run, rather than relying on commitWithin alone
+	std::string strExtensions;
+	std::string strFolder;
+	unsigned int nSenders;
+	unsigned int nWorkers;
+	int nGzipLevel; // 0 to send batches uncompressed
+	std::string strFormat; // Update format, xml or json
+	unsigned int nMaxDepth; // Nesting of embedded messages processed
+	unsigned long nMaxEmbeddedBytes; // Largest embedded message processed, 0 for any
+	CFieldPlan plan; // Fields written for each message
+	bool bHeadersOnly; // Fields from folder contents tables only
+	bool bMapPst; // Read each pst ahead through a shared mapping
+	unsigned long long nMapBudget; // Bytes of each pst read ahead at most
+	bool bDiskOrder; // Parse messages in the order their data lies in the file
+	std::vector<std::pair<std::string,std::string> > moreNodes; // Further Solr nodes, as host and port
+	unsigned int nRetries; // Times a failed request is sent again
+	unsigned long nRetryBaseMs; // First backoff, doubling each time
+	unsigned long nRetryMaxMs;
+	CPSTOptions():strHost("null"),strPort("null"),strUrlPath("null"),strTimeoutMs("60000"),
+		bDoIndex(false),bDoAttachments(false),bDoFireForget(false),bCommit(true),
+		nSenders(2),nWorkers(1),nGzipLevel(0),strFormat("xml"),nMaxDepth(16),nMaxEmbeddedBytes(0),plan(CFieldPlan::Default()),bHeadersOnly(false),bMapPst(false),nMapBudget(0),bDiskOrder(false),
+		nRetries(4),nRetryBaseMs(500),nRetryMaxMs(30000) {}
+};
+
+static CDocumentBuilder* CreateDocumentBuilder(const std::string& strFormat, size_t nReserve=64*1024)
+{
+	if(strFormat=="json")return new CJsonDocumentBuilder(nReserve);
+	return new CXmlDocumentBuilder(nReserve);
+}
+
+struct CDiskMessage {
+	// A message to parse in file order, and the folder it counts towards
+	unsigned int nid;
+	unsigned long long nOffset; // Of its data block
+	unsigned long nSize;
+	unsigned long long nSubOffset; // Of its subnode block (attachments, recipients), if any
+	unsigned long nSubSize;
+	unsigned long long nModified; // For a delta run
+	std::shared_ptr<CFolderTally> pFolder;
+	CDiskMessage():nid(0),nOffset(0),nSize(0),nSubOffset(0),nSubSize(0),nModified(0) {}
+};
+
+struct CFolderTask {
+	// A folder to traverse, or (when pFolder is set) a range of messages within one, or (when
+	// pDisk is set) a range of messages in file order
+	fairport::node_id nid;
+	std::string name; // Path of the parent folder
+	int indent;
+	size_t nBegin;
+	size_t nEnd;
+	std::shared_ptr<CFolderTally> pFolder;
+	std::shared_ptr<const std::vector<CDiskMessage> > pDisk;
+	CFolderTask():nid(0),indent(1),nBegin(0),nEnd(0) {}
+};
+
+struct CEmbedded {
+	// A message embedded in another, waiting to be processed
+	fairport::message msg;
+	std::string strID; // Parent's id with .att(n)
+	tm tmCreated; // Parent's, for when the message has none
+	unsigned int nDepth;
+	CEmbedded(const fairport::message& m, const std::string& id, unsigned int depth):msg(m),strID(id),nDepth(depth) {}
+};
 
 class CPSTProcessor {
 private:
@@ -68,496 +248,1527 @@ private:
 	std::string m_strPort; // eg:8984	
 	std::string m_strPST; // path to PST
 	std::string m_strdgpreamble;
-	std::string m_strmsgpreamble;
-	std::ostringstream m_ostrOut;
+	std::string m_strFormat; // xml or json
+	std::unique_ptr<CDocumentBuilder> m_pFormat; // Content type and commit command for the format
+	std::string m_strCommitWithin;
 	std::regex m_rxFolder;
 	std::regex m_rxExtn;
+	CSolrConnectionPool* m_pPool; // Shared by all processors for the run
+	CBatchPolicy* m_pPolicy; // Likewise
+	CBoundedQueue<CBatch> m_queue; // Completed batches waiting for a sender
+	std::vector<std::thread> m_senders;
+	std::vector<CBatch> m_retrying; // Batches waiting to be sent to Solr again, each with its due time
+	std::mutex m_mutexRetry;
+	unsigned int m_nSenders;
+	unsigned int m_nWorkers; // Parsing threads, each with its own pst handle
+	std::mutex m_mutexOut; // Serialises console output between parsers and senders
+	std::vector<std::string> m_spare; // Batch buffers returned by the senders for reuse
+	std::mutex m_mutexSpare;
+	std::ostream& m_out; // Console, or a per-file buffer when several pst files run at once
+	std::ostream& m_err;
+	bool m_bShowProgress;
 	// Options
 	bool m_bDoExtRE;
 	bool m_bDoFolderRE;
 	bool m_bDoFireForget;
-	// Statistics
-	unsigned long m_sentBytes;
-	unsigned long m_nProcessed; // Number processed successfully
-	unsigned long m_nProcFail; // Number which failed to process due to missing keys etc..
-	unsigned long m_nSuccess;
-	unsigned long m_nFail;
-	unsigned long m_nAttachments;
-	unsigned long m_nAttSaved; // Saved
-	unsigned long m_nAttFailed; // failed to save
-	unsigned long m_nMsgAttachment;
-	unsigned long m_nFolders;
+	int m_nGzipLevel;
+	// Statistics, shared by parsing workers and senders
+	std::atomic<unsigned long long> m_sentBytes;
+	std::atomic<unsigned long long> m_rawBytes; // Batch payloads before compression
+	std::atomic<unsigned long long> m_wireBytes; // Batch payloads as sent
+	std::atomic<unsigned long> m_nProcessed; // Number processed successfully
+	std::atomic<unsigned long> m_nProcFail; // Number which failed to process due to missing keys etc..
+	std::atomic<unsigned long> m_nSuccess;
+	std::atomic<unsigned long> m_nFail;
+	std::atomic<unsigned long> m_nRetries; // Requests sent again after failing
+	std::atomic<unsigned long> m_nDeadLetter; // Batches given up on and kept in the dead letter directory
+	CRetryPolicy m_retry;
+	CBatchSink* m_pDeadLetter; // Optional, shared by the run
+	std::atomic<unsigned long> m_nAttachments;
+	CAttachmentStore::CCounts m_attCounts; // Saved, already saved and failed to save
+	std::atomic<unsigned long> m_nMsgAttachment;
+	std::atomic<unsigned long> m_nTruncated; // Embedded messages left out by the limits
+	unsigned int m_nMaxDepth;
+	unsigned long m_nMaxEmbeddedBytes;
+	std::atomic<unsigned long> m_nFolders;
+	std::atomic<unsigned long> m_nSkipped; // Already indexed according to the checkpoint, or unchanged since the last delta run
+	std::atomic<unsigned long> m_nRemoved;
+	CCheckpoint* m_pCheckpoint; // Optional, shared by the run
+	unsigned int m_nPstId; // This pst in the checkpoint
+	CDeltaState* m_pDelta; // Optional, shared by the run
+	bool m_bDeltaDelete; // Delete messages gone from the pst from the index
+	CPstDelta m_previous; // This pst as of the last delta run
+	CAttachmentStore* m_pAttachments; // Where attachments are saved, shared by the run
+	CExtractorPool* m_pExtractors; // Attachment text extraction, shared by the run
+	CMetrics* m_pMetrics; // Live figures, shared by the run
+	CFieldPlan m_plan;
+	bool m_bHeadersOnly; // Documents from contents tables, without opening messages
+	bool m_bMapPst;
+	unsigned long long m_nMapBudget;
+	bool m_bDiskOrder; // Folders are walked first, and their messages then parsed in file order
+	std::atomic<size_t> m_nDiskDone; // Messages parsed in file order, for the read ahead to keep in front of
+	static const size_t m_nMessagesPerTask=1000; // Larger folders are split into ranges when parsing in parallel
+	static const size_t m_nDiskMessagesPerTask=100; // Small, so that the workers keep close together in the file
 
 	bool m_bStripAttachments;
 	bool m_bSubmitToSearch;
 
-	static std::string CleanString(const std::string & in) 
+	class CSolrSink : public CBatchSink {
+		// Submits batches through the owning processor, which keeps the statistics
+	private:
+		CPSTProcessor& m_owner;
+	public:
+		CSolrSink(CPSTProcessor& owner):m_owner(owner) {}
+		bool Write(const std::string& strBody, size_t nRawBytes, bool bGzip) { return m_owner.SubmitMessage(strBody,nRawBytes,bGzip); }
+	};
+	CSolrSink m_solr;
+	std::vector<CBatchSink*> m_sinks; // Solr and/or shard files; batches are only built for nothing when empty
+
+	struct CWorker {
+		// Per thread parsing state; fairport readers are not shared between threads.
+		// The open batch may hold documents from several folders.
+		fairport::pst store;
+		std::unique_ptr<CDocumentBuilder> doc;
+		size_t nDocs;
+		std::vector<std::pair<std::shared_ptr<CFolderTally>,size_t> > folders;
+		std::vector<unsigned int> messages;
+		CTimer oAge; // Since the first document of the open batch
+		// Delta state: every message met, the latest modification time, and the earliest of a message that failed
+		std::vector<unsigned int> seen;
+		unsigned long long nNewest;
+		unsigned long long nRetryFrom;
+		std::vector<unsigned char> vPrefix; // Entry ID less the nid
+		// File order: messages noted by the folder walk, and the folders they count towards
+		std::vector<CDiskMessage> disk;
+		std::vector<std::shared_ptr<CFolderTally> > planned;
+		CWorker(const std::wstring& path, CDocumentBuilder* pDoc):store(path),doc(pDoc),nDocs(0),nNewest(0),nRetryFrom((unsigned long long)-1) {}
+	};
+
+	template<typename T> void Count(std::atomic<T>& n, CMetrics::ECounter eCounter, unsigned long long nBy=1)
+	{
+		// A total for this pst, and the same for the run's live metrics
+		n+=(T)nBy;
+		if(m_pMetrics)m_pMetrics->Add(eCounter,nBy);
+	}
+	void SaveAttachment(const fairport::attachment& attch, const std::string& strID, const std::string& strFileName)
 	{
-		// Removes control characters, and encloses raw string in CDATA tags
-		std::string out("<![CDATA[");
-		for(size_t i=0;i<in.length();++i)
+		// Save attachement to the store - assumes not a message
+		if(!m_pAttachments)return;
+		if(m_bDoExtRE)
 		{
-			char wcIn=in[i];
-			if(wcIn==']'&&i<in.length()-2)
-			{
-				if(in[i+1]==']'&&in[i+2]=='>')
-				{
-					// avoid ]]> 
-					out+="]]&gt;";
-					i+=2;
-				} 
-				else
-				{
-					out+="]";
-				}
-			} 
-			else if((wcIn>8&&wcIn<14&&wcIn!=11&&wcIn!=12)||(wcIn>31&&wcIn<128))
+			size_t pos = strFileName.rfind(".");
+			if(pos==std::string::npos)return; // nothing to compare against
+			std::string strFilter=strFileName.substr(pos+1); // skip dot
+			if(!regex_search(strFilter,m_rxExtn))return;
+		}
+		// Save attachment, or just record it where the same content is already saved. The content
+		// is streamed from the pst a chunk at a time; an empty attachment counts as failed.
+		// With writer threads the outcome is counted once written; failures to write are only counted.
+		bool bOK=false;
+		if(attch.get_property_bag().prop_exists(0x3701))
+		{
+			fairport::attachment content(attch);
+			fairport::hnid_stream_device stream=content.open_byte_stream();
+			bOK=m_pAttachments->Save(stream,strID,strFileName,m_attCounts);
+		}
+		else
+		{
+			m_attCounts.nFailed++;
+		}
+		if(!bOK)
+		{
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_out << "Failed to save: " << strID << "." << strFileName << std::endl;
+		}
+	}
+	std::string ReadAttachment(const fairport::attachment& attch, size_t nMaxBytes)
+	{
+		// Up to nMaxBytes of the content, read on the parsing thread as fairport readers are not shared
+		std::string strContent;
+		fairport::attachment content(attch);
+		fairport::hnid_stream_device stream=content.open_byte_stream();
+		char szChunk[65536];
+		while(strContent.size()<nMaxBytes)
+		{
+			std::streamsize n=stream.read(szChunk,(std::streamsize)std::min(sizeof(szChunk),nMaxBytes-strContent.size()));
+			if(n<=0)break;
+			strContent.append(szChunk,(size_t)n);
+		}
+		return strContent;
+	}
+	bool SendOnce(const std::string& strFields, const std::string& strBody, unsigned int& status_code, std::string& strHeaders, std::string& strResponse, std::string& strError)
+	{
+		// One attempt at a request over a pooled keep-alive connection; true once sent and (unless
+		// fire and forget) answered, whatever the status. strFields are the headers after the preamble
+		// and Host, which names whichever node the connection is to.
+		CStageTimer submit(m_pMetrics,CMetrics::eStageSubmit); // Round trip, including waiting for a connection
+		CHttpConnection* pConn = m_pPool->Acquire();
+		boost::system::error_code error;
+		const char* szStage = "Connect";
+		bool bSent = false;
+		// A kept-alive socket may have been dropped by the server since it was last used,
+		// so a failure on a reused connection is retried at once on a fresh one
+		for(int nTry=0;nTry<2&&!bSent;++nTry)
+		{
+			bool bReused = pConn->IsOpen();
+			szStage = "Connect";
+			if(!bReused&&!m_pPool->Connect(*pConn, error))break;
+			if(m_bDoFireForget)pConn->DiscardAvailable();
+			szStage = "Send";
+			std::string strHeader = m_strdgpreamble + "Host: " + pConn->Host() + "\r\n" + strFields;
+			size_t nBytes = pConn->Write(strHeader, strBody, error);
+			if(!error)
 			{
-				// Preserve 
-				out+=wcIn;
-			} // else ignore character
+				m_sentBytes+=nBytes;
+				szStage = "Response";
+				if(m_bDoFireForget||pConn->ReadResponse(status_code, strHeaders, strResponse, error))bSent=true;
+			}
+			if(!bSent&&!bReused)break;
 		}
-		out=out+"]]>";
-		return out;
+		m_pPool->Release(pConn);
+		if(!bSent)strError=std::string(szStage)+" error: "+error.message();
+		return bSent;
 	}
-	void SaveAttachment(const fairport::attachment& attch, const std::string& strFileName)
+	enum ESubmit { eSubmitted, eSubmitRetry, eSubmitFailed };
+	ESubmit TrySubmit(const std::string& strBody, size_t nRawBytes, bool bGzip, unsigned int nAttempt, unsigned long& nDelayMs)
 	{
-		// Save attachement to file - assumes not a message
-		size_t pos = strFileName.rfind(".");
-		std::string strBase, strExtn;
-		if(pos==std::string::npos)
+		// One attempt at submitting a well-formed message to the Solr service. While Solr cannot be
+		// reached, or answers 5xx or 429, it is to be sent again after nDelayMs, up to the retry limit;
+		// other statuses are final. nRawBytes is the size of a gzip compressed body before compression.
+		std::ostringstream ostrFields;
+		if(bGzip)ostrFields << "Content-Encoding: gzip\r\n";
+		ostrFields << "Content-Length: " << strBody.length() << "\r\n";
+		ostrFields << "Connection: keep-alive\r\n\r\n";
+
+		unsigned int status_code = 0;
+		std::string strHeaders, strResponse, strError;
+		bool bSent=SendOnce(ostrFields.str(), strBody, status_code, strHeaders, strResponse, strError);
+		if(bSent&&(m_bDoFireForget||status_code==200))
+		{
+			Count(m_rawBytes,CMetrics::eRawBytes,bGzip?nRawBytes:strBody.length());
+			Count(m_wireBytes,CMetrics::eWireBytes,strBody.length());
+			Count(m_nSuccess,CMetrics::eBatches);
+			return eSubmitted;
+		}
+		if((!bSent||CRetryPolicy::IsRetryable(status_code))&&nAttempt<m_retry.Retries())
+		{
+			nDelayMs=m_retry.DelayMs(nAttempt, strHeaders);
+			{
+				std::lock_guard<std::mutex> lock(m_mutexOut);
+				if(bSent)m_err << "Response returned with status code " << status_code;
+				else m_err << strError;
+				m_err << ", retrying in " << nDelayMs << "ms (" << nAttempt+1 << " of " << m_retry.Retries() << ")" << std::endl;
+			}
+			Count(m_nRetries,CMetrics::eRetries);
+			return eSubmitRetry;
+		}
+		std::lock_guard<std::mutex> lock(m_mutexOut);
+		if(!bSent)
 		{
-			strBase=strFileName;
-			strExtn="";
+			m_err << strError << std::endl;
 		}
 		else
 		{
-			strBase=strFileName.substr(0, pos);
-			strExtn=strFileName.substr(pos);
+			m_err << "Response returned with status code " << status_code << std::endl;
+			m_err << strHeaders << "\n";
+			m_err << strResponse << std::endl;
+			if(bGzip)m_err << "(gzip body, " << nRawBytes << " bytes uncompressed)" << std::endl;
+			else m_err << strBody << std::endl;
 		}
-		if(m_bDoExtRE)
+		Count(m_nFail,CMetrics::eBatchesFailed);
+		return eSubmitFailed;
+	}
+	bool SubmitMessage(const std::string& strBody, size_t nRawBytes=0, bool bGzip=false) 
+	{
+		// Submits a message, waiting out each retry on this thread; for the commit and delta deletes.
+		// The senders instead put a batch aside while it waits (see SenderLoop).
+		for(unsigned int nAttempt=0;;++nAttempt)
 		{
-			if(strExtn=="")return; // nothing to compare against
-			std::string strFilter=strExtn.substr(1); // skip dot
-			//std::transform(strFilter.begin(), strFilter.end(), strFilter.begin(), tolower);
-			if(!regex_search(strFilter,m_rxExtn))return;
-			//if(m_strExtensions.find(strFilter)==std::string::npos)return;
+			unsigned long nDelayMs=0;
+			ESubmit eResult=TrySubmit(strBody, nRawBytes, bGzip, nAttempt, nDelayMs);
+			if(eResult!=eSubmitRetry)return eResult==eSubmitted;
+			std::this_thread::sleep_for(std::chrono::milliseconds(nDelayMs));
 		}
-		if(attch.content_size()==0)
+	}
+	void DeadLetter(const CBatch& batch)
+	{
+		// A batch Solr would not take, even when retried, kept where /R can send it again later
+		if(!m_pDeadLetter)return;
+		if(m_pDeadLetter->Write(batch.strBody,batch.nRawBytes,m_nGzipLevel>0))
 		{
-			m_nAttFailed++;
+			Count(m_nDeadLetter,CMetrics::eDeadLettered);
 			return;
 		}
-		bool done = false;
-		unsigned int i=1;
-		std::stringstream ss;
-		ss << strFileName;
-		do
-		{
-			// Check if the file already exists
-			std::ifstream testFile(ss.str().c_str(), std::ios::in|std::ios::binary);
-			if(testFile.is_open())
-			{
-				testFile.close();
-				// File with the name of current attachment already exists.
-				// Do not overwrite the existing file, instead use a different name
-				// for this file.
-				ss.str(std::string());
-				ss.clear();
-				ss << strBase;
-				ss << "(" << i++ << ")";
-				ss << strExtn;
-			}
-			else
+		std::lock_guard<std::mutex> lock(m_mutexOut);
+		m_err << "Unable to write a failed batch to the dead letter directory" << std::endl;
+	}
+	static unsigned long long Modified(const fairport::const_table_row& row)
+	{
+		// PR_LAST_MODIFICATION_TIME, as a FILETIME; 0 where missing
+		return row.prop_exists(0x3008)?row.read_prop<fairport::ulonglong>(0x3008):0;
+	}
+	void UpdateDelta(const std::string& strPath, std::vector<std::unique_ptr<CWorker> >& workers)
+	{
+		// Called once the whole pst has been parsed and acknowledged. Messages of the last run not met
+		// this time have gone from the pst; the rest, and any new ones, make up the new state.
+		CPstDelta delta;
+		delta.nWatermark=m_previous.nWatermark;
+		unsigned long long nRetryFrom=(unsigned long long)-1;
+		for(size_t i=0;i<workers.size();++i)
+		{
+			delta.nids.insert(delta.nids.end(),workers[i]->seen.begin(),workers[i]->seen.end());
+			if(workers[i]->nNewest>delta.nWatermark)delta.nWatermark=workers[i]->nNewest;
+			if(workers[i]->nRetryFrom<nRetryFrom)nRetryFrom=workers[i]->nRetryFrom;
+			if(delta.vPrefix.empty())delta.vPrefix=workers[i]->vPrefix;
+		}
+		if(delta.vPrefix.empty())delta.vPrefix=m_previous.vPrefix;
+		// A message that failed to parse is tried again next time
+		if(nRetryFrom<delta.nWatermark)delta.nWatermark=nRetryFrom;
+		std::sort(delta.nids.begin(),delta.nids.end());
+		delta.nids.erase(std::unique(delta.nids.begin(),delta.nids.end()),delta.nids.end());
+		std::vector<unsigned int> gone;
+		std::set_difference(m_previous.nids.begin(),m_previous.nids.end(),delta.nids.begin(),delta.nids.end(),std::back_inserter(gone));
+		m_nRemoved+=(unsigned long)gone.size();
+		if(m_bDeltaDelete&&!gone.empty()&&!m_sinks.empty())
+		{
+			// Deleted in requests of up to 500, through the same sinks as the updates; those that fail
+			// stay in the state to be tried again
+			static const size_t nPerRequest=500;
+			size_t nDeleted=0;
+			for(size_t nFirst=0;nFirst<gone.size();nFirst+=nPerRequest)
 			{
-				done = true;
+				size_t nLast=std::min(gone.size(),nFirst+nPerRequest);
+				std::vector<std::string> ids;
+				for(size_t i=nFirst;i<nLast;++i)ids.push_back(m_previous.SolrId(gone[i]));
+				std::string strBody=m_pFormat->DeleteCommand(ids);
+				bool bOK=true;
+				for(size_t i=0;i<m_sinks.size();++i)
+				{
+					if(!m_sinks[i]->Write(strBody,strBody.length(),false))
+					{
+						bOK=false;
+						if(m_sinks[i]!=&m_solr)Count(m_nFail,CMetrics::eBatchesFailed);
+					}
+				}
+				if(bOK)nDeleted+=nLast-nFirst;
+				else delta.nids.insert(delta.nids.end(),gone.begin()+nFirst,gone.begin()+nLast);
 			}
-		} while(!done);
-		// Save attachment
-		if(attch.get_property_bag().prop_exists(0x3701))
+			std::sort(delta.nids.begin(),delta.nids.end());
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_out << nDeleted << " (of " << gone.size() << ") removed messages deleted from the index" << std::endl;
+		}
+		m_pDelta->Update(strPath,delta);
+		if(!m_pDelta->Save())
+		{
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_err << "Unable to save delta state" << std::endl;
+		}
+	}
+	void AddToBatch(CWorker& w, const std::shared_ptr<CFolderTally>& pFolder, unsigned int nid)
+	{
+		// Counts a document just written to the worker's open batch, and sends the batch once full
+		if(w.nDocs==0)w.oAge.Start();
+		w.nDocs++;
+		if(m_pCheckpoint)w.messages.push_back(nid);
+		if(w.folders.empty()||w.folders.back().first!=pFolder)
+		{
+			pFolder->nPending++; // Held until the batch is acknowledged
+			w.folders.push_back(std::make_pair(pFolder,(size_t)0));
+		}
+		w.folders.back().second++;
+		if(m_pPolicy->IsFull(w.nDocs,w.doc->Size(),(unsigned long)(w.oAge.Elapsed()/1000)))QueueBatch(w);
+	}
+	void FlushStale(CWorker& w)
+	{
+		// Called while the worker waits for work, so that a batch left part filled (its folder done,
+		// and nothing else to parse) still goes within the time limit; by the worker's own thread,
+		// as only it touches its batch
+		if(m_pPolicy->IsStale(w.nDocs,(unsigned long)(w.oAge.Elapsed()/1000)))QueueBatch(w);
+	}
+	void QueueBatch(CWorker& w)
+	{
+		// Hands the open batch over to the senders, blocking while the queue is full
+		if(w.nDocs==0)return;
+		w.doc->EndBatch();
+		CBatch batch;
+		batch.nDocs=w.nDocs;
+		batch.nRawBytes=w.doc->Size();
+		batch.folders.swap(w.folders);
+		batch.messages.swap(w.messages);
+		batch.strBody=TakeSpareBuffer();
+		w.doc->Swap(batch.strBody); // The finished batch goes to the sender as is, never copied
+		if(!m_sinks.empty())
 		{
-			std::ofstream binFile(ss.str().c_str(), std::ios::out | std::ios::binary);
-			binFile << attch;
-			binFile.close();
-			m_nAttSaved++;
+			size_t nBytes=batch.strBody.length();
+			m_queue.Push(std::move(batch), nBytes);
 		}
 		else
 		{
-			std::cout << "Failed to save: " << strFileName << std::endl;
-			m_nAttFailed++;
-		}
-	}
-	bool SubmitMessage(const std::ostringstream& ostrBody ) 
-	{
-		using boost::asio::ip::tcp;
-		// Submits a well-formed message to Solr service
-		boost::asio::io_service io_service;
-		boost::system::error_code error = boost::asio::error::host_not_found;
-		tcp::resolver resolver(io_service);
-		tcp::resolver::query query(m_strHost, m_strPort);
-		tcp::resolver::iterator endpoint_iterator = resolver.resolve(query, error);
-		tcp::resolver::iterator end;
-		if (error) {
-			std::cerr << error.message() << std::endl;
-			m_nFail++;
-			return false;
-		}
-
-		// Use endpoint.
-		tcp::socket socket(io_service);
-		error = boost::asio::error::host_not_found;
-		while (error && endpoint_iterator != end)
-	    {
-			socket.close();
-			boost::asio::connect(socket, endpoint_iterator++,error);
-			//socket.connect(*endpoint_iterator++, error);
-		}
-		//boost::asio::connect(socket, endpoint_iterator,error);
-		if (error) {
-			std::cerr << error.message() << std::endl;
-			m_nFail++;
-			return false;
-		}
-
-		// Form request.
-		boost::asio::streambuf request;
-		std::ostream request_stream(&request);	
-		request_stream << m_strdgpreamble;
-		std::string strBody = ostrBody.str();
-		//strBody.resize(strBody.length()-1); // strip terminating null
-		request_stream << "Content-Length: " << strBody.length() << "\r\n";
-		request_stream << (m_bDoFireForget?"Connection: keep-alive\r\n":"Connection: close\r\n");		
-		request_stream << "\r\n" << strBody;
-
-		// Send request.
-		size_t nBytes = boost::asio::write(socket, request, error);
-
-		if (error) {
-			std::cerr << "Send error: " << error.message() << std::endl;
-			m_nFail++;
-			socket.close();
-			return false;
-		}
-		m_sentBytes+=nBytes;
-		
-		if(m_bDoFireForget)
+			for(size_t i=0;i<batch.folders.size();++i)FinishFolder(*batch.folders[i].first);
+			RecycleBuffer(batch.strBody);
+		}
+		w.doc->BeginBatch();
+		w.nDocs=0;
+	}
+	std::string TakeSpareBuffer()
+	{
+		std::lock_guard<std::mutex> lock(m_mutexSpare);
+		if(m_spare.empty())return std::string();
+		std::string str;
+		str.swap(m_spare.back());
+		m_spare.pop_back();
+		return str;
+	}
+	void RecycleBuffer(std::string& str)
+	{
+		// Sent batch buffers go back to the workers, keeping their capacity
+		str.clear();
+		std::lock_guard<std::mutex> lock(m_mutexSpare);
+		if(m_spare.size()<2*m_nSenders+2*m_nWorkers+2)
 		{
-			m_nSuccess++;
-			return true;
+			m_spare.push_back(std::string());
+			m_spare.back().swap(str);
 		}
-
-		// Read the response status line. The response streambuf will automatically
-		// grow to accommodate the entire line. The growth may be limited by passing
-		// a maximum size to the streambuf constructor.
-		boost::asio::streambuf response;
-		boost::asio::read_until(socket, response, "\r\n", error);
-		if (error) {
-			std::cerr << "Response error: " << error.message() << std::endl;
-			m_nFail++;
-			socket.close();
-			return false;
-		}
-
-		// Check that response is OK.
-		std::istream response_stream(&response);
-		std::string http_version;
-		response_stream >> http_version;
-		unsigned int status_code;
-		response_stream >> status_code;
-		std::string status_message;
-		std::getline(response_stream, status_message);
-
-		if (!response_stream || http_version.substr(0, 5) != "HTTP/")
-		{
-			std::cerr << "Invalid response" << std::endl;
-			m_nFail++;
-			socket.close();
-			return false;
-		}
-
-		// Read the response headers, which are terminated by a blank line.
-		if (status_code != 200)
-		{
-			std::cerr << "Response returned with status code " << status_code << std::endl;
-			boost::asio::read_until(socket, response, "\r\n\r\n");
-			// Process the response headers.
-			std::string header;
-			while (std::getline(response_stream, header) && header != "\r")
-				std::cerr << header << "\n";
-			std::cerr << "\n";
-
-			// Write whatever content we already have to output.
-			if (response.size() > 0)
-				std::cerr << &response;
-
-			// Read until EOF, writing data to output as we go.
-			while (boost::asio::read(socket, response,boost::asio::transfer_at_least(1), error))
-				std::cerr << &response;
-
-			//std::cerr << std::endl << "Msg ID : " << strID << std::endl;
-			std::cerr << strBody << std::endl;
-			m_nFail++;
-			socket.close();
-			return false;
-		}
-		m_nSuccess++;
-		socket.close();
+	}
+	void FinishFolder(CFolderTally& folder)
+	{
+		if(--folder.nPending)return;
+		if(m_pCheckpoint&&folder.nSubmitted==folder.nParsed)m_pCheckpoint->MarkFolder(m_nPstId,folder.nid);
+		folder.oTimer.Mark();
+		std::lock_guard<std::mutex> lock(m_mutexOut);
+		m_out << folder.strIndent << folder.nSubmitted << " (of " << folder.nParsed << ") messages successfully processed in " << folder.oTimer.Seconds() << " seconds\t\t" << std::endl;
+	}
+	void FinishBatch(CBatch& batch)
+	{
+		// Once every sink has taken the batch, or one has failed for good
+		if(batch.bOK&&m_pCheckpoint&&batch.messages.size()==batch.nDocs)
+		{
+			// Recorded only now that the batch is acknowledged
+			size_t nOffset=0;
+			for(size_t i=0;i<batch.folders.size();++i)
+			{
+				m_pCheckpoint->MarkMessages(m_nPstId,batch.folders[i].first->nid,&batch.messages[nOffset],batch.folders[i].second);
+				nOffset+=batch.folders[i].second;
+			}
+		}
+		batch.messages.clear();
+		for(size_t i=0;i<batch.folders.size();++i)
+		{
+			if(batch.bOK)batch.folders[i].first->nSubmitted+=batch.folders[i].second;
+			FinishFolder(*batch.folders[i].first);
+		}
+		batch.folders.clear();
+		RecycleBuffer(batch.strBody);
+	}
+	void SubmitBatch(CBatch& batch)
+	{
+		// Sends the batch to Solr, putting it aside with a due time where it is to be tried again. With
+		// as many put aside as there are senders, it is waited for here instead.
+		ESubmit eResult=eSubmitFailed;
+		CTimer oTimer;
+		for(;;)
+		{
+			unsigned long nDelayMs=0;
+			oTimer.Start();
+			try {
+				eResult=TrySubmit(batch.strBody,batch.nRawBytes,m_nGzipLevel>0,batch.nAttempt,nDelayMs);
+			}
+			catch(...)
+			{
+				eResult=eSubmitFailed;
+				Count(m_nFail,CMetrics::eBatchesFailed);
+			}
+			oTimer.Mark();
+			if(eResult!=eSubmitRetry)break;
+			batch.nAttempt++;
+			batch.due=std::chrono::steady_clock::now()+std::chrono::milliseconds(nDelayMs);
+			{
+				std::lock_guard<std::mutex> lock(m_mutexRetry);
+				if(m_retrying.size()<m_nSenders)
+				{
+					m_retrying.push_back(std::move(batch));
+					batch=CBatch();
+					return;
+				}
+			}
+			std::this_thread::sleep_until(batch.due);
+		}
+		if(eResult==eSubmitted&&batch.nAttempt==0)m_pPolicy->Observe(batch.nRawBytes,(unsigned long)(oTimer.MicroSeconds()/1000));
+		if(eResult==eSubmitFailed)
+		{
+			DeadLetter(batch);
+			batch.bOK=false;
+		}
+		FinishBatch(batch);
+	}
+	bool TakeRetry(CBatch& batch, std::chrono::steady_clock::time_point& next, bool& bFull)
+	{
+		// The batch waiting to be sent again that is due first, if it is due now; otherwise next is
+		// when it will be (max with none waiting), and bFull says new batches should wait for it
+		std::lock_guard<std::mutex> lock(m_mutexRetry);
+		next=std::chrono::steady_clock::time_point::max();
+		bFull=(m_retrying.size()>=m_nSenders);
+		size_t nFirst=0;
+		for(size_t i=0;i<m_retrying.size();++i)
+		{
+			if(m_retrying[i].due>=next)continue;
+			next=m_retrying[i].due;
+			nFirst=i;
+		}
+		if(m_retrying.empty()||next>std::chrono::steady_clock::now())return false;
+		batch=std::move(m_retrying[nFirst]);
+		m_retrying.erase(m_retrying.begin()+nFirst);
 		return true;
 	}
-	void CommitMessages()
+	void SenderLoop()
 	{
-		if(m_bSubmitToSearch)
+		// A batch Solr is to be sent again waits aside until due rather than holding up its sender,
+		// which goes on with the queue meanwhile; with as many waiting as there are senders, new
+		// batches wait for them. Senders stop once the queue is closed and drained and none waits.
+		CBatch batch;
+		for(;;)
 		{
-			std::ostringstream ostrOut;
-			ostrOut << "<commit/> ";
-			SubmitMessage(ostrOut);
+			std::chrono::steady_clock::time_point next;
+			bool bFull=false;
+			if(TakeRetry(batch, next, bFull))
+			{
+				SubmitBatch(batch);
+				continue;
+			}
+			bool bItem=false;
+			if(next==std::chrono::steady_clock::time_point::max())
+			{
+				if(!m_queue.Pop(batch))return;
+				bItem=true;
+			}
+			else if(bFull||!m_queue.Pop(batch, next, bItem))
+			{
+				std::this_thread::sleep_until(next);
+				continue;
+			}
+			if(!bItem)continue;
+			for(size_t i=0;i<m_sinks.size();++i)
+			{
+				if(m_sinks[i]==&m_solr)continue; // Last, as it may have to wait
+				try {
+					if(!m_sinks[i]->Write(batch.strBody,batch.nRawBytes,m_nGzipLevel>0))
+					{
+						batch.bOK=false;
+						Count(m_nFail,CMetrics::eBatchesFailed);
+					}
+				}
+				catch(...)
+				{
+					Count(m_nFail,CMetrics::eBatchesFailed);
+					batch.bOK=false;
+				}
+			}
+			if(m_bSubmitToSearch)SubmitBatch(batch);
+			else FinishBatch(batch);
 		}
 	}
+	void StartSenders()
+	{
+		if(m_sinks.empty())return;
+		for(unsigned int i=0;i<m_nSenders;++i)
+			m_senders.push_back(std::thread(&CPSTProcessor::SenderLoop, this));
+	}
+	void StopSenders()
+	{
+		// Lets the senders drain the queue, then waits for them
+		m_queue.Close();
+		for(size_t i=0;i<m_senders.size();++i)m_senders[i].join();
+		m_senders.clear();
+	}
 public:
-	CPSTProcessor(const std::string& pst, const std::string& host, const std::string& port, const std::string& path, const std::string& timeout_ms, bool bDoIndex=false,bool bDoAttachments=false,const std::string& ext="", const std::string& fld="", bool bDoFireForget=false):
-		m_strPST(pst), m_strHost(host), m_strPort(port),
-		m_bSubmitToSearch(bDoIndex), m_bStripAttachments(bDoAttachments),
-		m_bDoExtRE(false),m_bDoFolderRE(false),m_bDoFireForget(bDoFireForget),
-		m_sentBytes(0), 
-		m_nProcessed(0), m_nProcFail(0), m_nSuccess(0), m_nFail(0),
-		m_nAttachments(0), m_nMsgAttachment(0),m_nAttSaved(0),m_nAttFailed(0),
-		m_nFolders(0)
+	CPSTProcessor(const std::string& pst, const CPSTOptions& opts, CSolrConnectionPool* pPool, CBatchPolicy* pPolicy, CBatchSink* pShards, std::ostream& out=std::cout, std::ostream& err=std::cerr):
+		m_strHost(opts.strHost), m_strPort(opts.strPort), m_strPST(pst),
+		m_strFormat(opts.strFormat), m_pFormat(CreateDocumentBuilder(opts.strFormat,0)), m_strCommitWithin(opts.strTimeoutMs),
+		m_pPool(pPool), m_pPolicy(pPolicy),
+		m_queue(2*opts.nSenders+2, std::max((size_t)64*1024*1024, 4*pPolicy->MaxBytes())), m_nSenders(opts.nSenders), m_nWorkers(opts.nWorkers<1?1:opts.nWorkers),
+		m_out(out), m_err(err), m_bShowProgress(&out==&std::cout),
+		m_bDoExtRE(false),m_bDoFolderRE(false),m_bDoFireForget(opts.bDoFireForget),m_nGzipLevel(opts.nGzipLevel),
+		m_sentBytes(0), m_rawBytes(0), m_wireBytes(0),
+		m_nProcessed(0), m_nProcFail(0), m_nSuccess(0), m_nFail(0), m_nRetries(0), m_nDeadLetter(0),
+		m_retry(opts.nRetries,opts.nRetryBaseMs,opts.nRetryMaxMs), m_pDeadLetter(0),
+		m_nAttachments(0), m_nMsgAttachment(0), m_nTruncated(0), m_nMaxDepth(opts.nMaxDepth), m_nMaxEmbeddedBytes(opts.nMaxEmbeddedBytes),
+		m_nFolders(0), m_nSkipped(0), m_nRemoved(0), m_pCheckpoint(0), m_nPstId(0), m_pDelta(0), m_bDeltaDelete(false), m_pAttachments(0), m_pExtractors(0), m_pMetrics(0), m_plan(opts.plan), m_bHeadersOnly(opts.bHeadersOnly), m_bMapPst(opts.bMapPst), m_nMapBudget(opts.nMapBudget),
+		m_bDiskOrder(opts.bDiskOrder&&!opts.bHeadersOnly), m_nDiskDone(0),
+		m_bStripAttachments(opts.bDoAttachments), m_bSubmitToSearch(opts.bDoIndex), m_solr(*this)
 		{
 		m_strdgpreamble=
-			  	"POST " + path + " HTTP/1.1\r\n" + 
-				"Host: " + m_strHost + ":" + m_strPort + "\r\n" +
-				"Content-Type: text/xml\r\n";
-		m_strmsgpreamble="<add commitWithin=\"" + timeout_ms + "\">";
-
-	m_ostrOut << m_strmsgpreamble;
+			  	"POST " + opts.strUrlPath + " HTTP/1.1\r\n" + 
+				"Content-Type: " + m_pFormat->ContentType() + "\r\n";
+		if(m_bSubmitToSearch)m_sinks.push_back(&m_solr);
+		if(pShards)m_sinks.push_back(pShards);
 		
-		if(ext!="")
+		if(opts.strExtensions!="")
 			{
-			m_rxExtn=std::regex(ext.c_str(),
+			m_rxExtn=std::regex(opts.strExtensions.c_str(),
 				std::regex_constants::ECMAScript|std::regex_constants::icase|std::regex_constants::nosubs|std::regex_constants::optimize);
 			m_bDoExtRE=true;
 			}
-		if(fld!="")
+		if(opts.strFolder!="")
 			{
-			m_rxFolder=std::regex(fld.c_str(),
+			m_rxFolder=std::regex(opts.strFolder.c_str(),
 				std::regex_constants::ECMAScript|std::regex_constants::nosubs|std::regex_constants::optimize);
 			m_bDoFolderRE=true;
 			}
 		}
-	bool ProcessMessage(const fairport::message& m, const std::string& attachmentid="", tm*creationtm=0)
+	bool ProcessMessage(CDocumentBuilder& doc, const fairport::message& m)
 	{
-		// Process an entire message
-		// Rather than amend Fairport, in most cases I've used the relevant property ID where a native Fairport accessor doesn't exist
-		std::ostringstream ostrID; // m_ostrOut, 
+		// Process a message and, depth first, the messages embedded in it, from a stack rather than
+		// by recursion. True if the message itself was added.
+		std::vector<CEmbedded> embedded;
+		bool bOK=ProcessDocument(doc,m,"",0,0,embedded);
+		while(!embedded.empty())
+		{
+			CEmbedded e(std::move(embedded.back()));
+			embedded.pop_back();
+			ProcessDocument(doc,e.msg,e.strID,&e.tmCreated,e.nDepth,embedded);
+		}
+		return bOK;
+	}
+	static void PresentProps(const fairport::const_property_object& props, std::vector<fairport::prop_id>& present)
+	{
+		// Every property there is, read at once and sorted, so that asking whether one exists
+		// no longer costs a second lookup of the property before it is read
+		present=props.get_prop_list();
+		std::sort(present.begin(),present.end());
+	}
+	static bool Has(const std::vector<fairport::prop_id>& present, fairport::prop_id id)
+	{
+		return std::binary_search(present.begin(),present.end(),id);
+	}
+	static std::string HexId(const std::vector<unsigned char>& vID)
+	{
+		// Entry ID as string, Standard Outlook format suitable for direct use for lookup
+		static const char szHex[]="0123456789ABCDEF";
 		std::string strID;
-		try {
-			m_ostrOut << "<doc><field name=\"id\">"; //m_strmsgpreamble;
-			if(attachmentid!="")
-			{
-				strID=attachmentid;
-			}
-			else
+		strID.reserve(2*vID.size());
+		for(size_t i=0;i<vID.size();i++)
+		{
+			strID+=szHex[vID[i]>>4];
+			strID+=szHex[vID[i]&15];
+		}
+		return strID;
+	}
+	static tm FileTimeToTm(fairport::ulonglong nTime)
+	{
+		// FILETIME, in 100ns units since 1601
+		return to_tm(boost::posix_time::from_time_t((time_t)(nTime/10000000-11644473600ULL)));
+	}
+	static std::string AttachmentName(const fairport::attachment& attch, const std::vector<fairport::prop_id>& present)
+	{
+		// Long file name, else short, else "Null"
+		if(Has(present,0x3707))return attch.get_property_bag().read_prop<std::string>(0x3707);
+		if(Has(present,0x3704))return attch.get_property_bag().read_prop<std::string>(0x3704);
+		return "Null";
+	}
+	static void WriteProperty(CDocumentBuilder& doc, const fairport::const_property_object& props, const CField& field)
+	{
+		// A field of the plan that is a single property, known to exist
+		switch(field.eType)
+		{
+		case eTypeString:
+			doc.Plain(props.read_prop<std::string>(field.nProp));
+			break;
+		case eTypeText:
+			doc.Clean(props.read_prop<std::string>(field.nProp));
+			break;
+		case eTypeNumber:
 			{
-				// Entry ID as string, Standard Outlook format suitable for direct use for lookup:
-				std::vector<unsigned char> vID=m.get_entry_id();	
-				for(size_t i=0;i<vID.size();i++)
-					ostrID << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << long(vID[i]);
-				strID=ostrID.str();
+				// 32 bit and smaller values (short, long, boolean) are all read from the same four bytes
+				fairport::slong n=props.read_prop<fairport::slong>(field.nProp);
+				if(n<0)doc.Plain(std::to_string((long long)n));
+				else doc.Number((unsigned long long)n);
 			}
-			// Parent PST file
-			m_ostrOut << strID << "</field><field name=\"pstfile\">" << m_strPST;
+			break;
+		case eTypeDate:
+			doc.Date(FileTimeToTm(props.read_prop<fairport::ulonglong>(field.nProp)));
+			break;
+		case eTypeHex:
+			doc.Hex(props.read_prop<std::vector<fairport::byte> >(field.nProp));
+			break;
+		}
+	}
+	bool ProcessDocument(CDocumentBuilder& doc, const fairport::message& m, const std::string& attachmentid, tm*creationtm, unsigned int nDepth, std::vector<CEmbedded>& embedded)
+	{
+		// Process one message as a document with the fields of the plan; its embedded messages are pushed onto embedded, first on top
+		// Rather than amend Fairport, in most cases I've used the relevant property ID where a native Fairport accessor doesn't exist
+		std::string strID;
+		size_t nMark=doc.Mark(); // A message that fails part way is dropped from the batch
+		CStageTimer parse(m_pMetrics,CMetrics::eStageParse), stage(m_pMetrics,CMetrics::eStageRead);
+		try {
+			strID=(attachmentid!=""?attachmentid:HexId(m.get_entry_id()));
+			// Which properties the message has; only those the plan asks for are read
+			const fairport::property_bag& props=m.get_property_bag();
+			std::vector<fairport::prop_id> present;
+			PresentProps(props,present);
+			size_t nAttach=m.get_attachment_count();
+			Count(m_nAttachments,CMetrics::eAttachments,nAttach);
 
 			// Occasionally in messages as attachments the creation time and sender don't exist.
 			// For these cases we use the parent's creation time and an empty sender
-			tm tmDate;
-			if(attachmentid!=""&&!m.get_property_bag().prop_exists(0x0e06))
-				tmDate=*creationtm;
-			else
-				tmDate=to_tm(m.get_delivery_time());
-			// Creation time, as YYYY-MM-DDTHH:mm:ssZ datetime 
-			m_ostrOut << "</field><field name=\"created\">"
-				<< std::dec << std::setw(4) << 1900+tmDate.tm_year << "-" << std::setw(2) << std::setfill('0') << 1+tmDate.tm_mon << "-" // 0-11, need to add one
-				<< std::setw(2) << std::setfill('0') << tmDate.tm_mday << "T" << std::setw(2) << std::setfill('0') << tmDate.tm_hour << ":"
-				<< std::setw(2) << std::setfill('0') << tmDate.tm_min << ":" << std::setw(2) << std::setfill('0') << tmDate.tm_sec << "Z";
-
-			// Display name of sender.
-			std::string strSender;
-			if(attachmentid!=""&&!m.get_property_bag().prop_exists(0x0C1A))
-				strSender="Missing";
-			else
-				strSender=CleanString(m.get_property_bag().read_prop<std::string>(0x0C1A));
-			m_ostrOut << "</field><field name=\"sender\">" << strSender;
-
-			// Subject, as ASCII string (or "Empty")
-			std::string strSubj="Empty";
-			if(m.has_subject())
-			{
-				strSubj=m.get_property_bag().read_prop<std::string>(0x37);
-				if(strSubj.size() && strSubj[0] == fairport::message_subject_prefix_lead_byte) strSubj=strSubj.substr(2);
-				strSubj=CleanString(strSubj);
-			}
-			m_ostrOut << "</field><field name=\"subject\">" << strSubj;
-
-			// Full set of recipients
-			std::string strRecipients;
-			m_ostrOut << "</field><field name=\"to\">";
-			for(fairport::message::recipient_iterator ri=m.recipient_begin();ri!=m.recipient_end();++ri)
+			tm tmDate=tm();
+			if(m_plan.Has(eFieldCreated)||nAttach)
 			{
-				strRecipients+=ri->get_property_row().read_prop<std::string>(0x3001);
-				strRecipients+=" ;"; // get_name()
+				if(attachmentid!=""&&!Has(present,0x0e06))
+					tmDate=*creationtm;
+				else if(Has(present,0x0e06)||m_plan.Has(eFieldCreated))
+					tmDate=to_tm(m.get_delivery_time());
 			}
-			m_ostrOut << CleanString(strRecipients); // occasionally contain non-XML compliant characters
 
-			// Number of attachments
-			size_t nAttach=m.get_attachment_count();
-			m_nAttachments+=nAttach;
-			m_ostrOut << "</field><field name=\"attachments\">" << nAttach;
-
-			// Filenames of attachments (where possible)
-			std::string strAttach;
-			bool bHasEmbeddedMsg=false;
-			if(nAttach==0)
+			// One pass over the attachments, before any field is written: it finds embedded messages,
+			// saves and extracts attachments, and collects the filenames (where possible)
+			std::vector<CEmbedded> children;
+			std::vector<std::string> filenames;
+			std::vector<std::future<std::string> > extracted; // Attachment text, being extracted meanwhile
+			CExtractorPool* pExtractors=(m_plan.Has(eFieldAttachmentText)?m_pExtractors:0);
+			bool bNames=(m_plan.Has(eFieldFilenames)||m_bStripAttachments||pExtractors);
+			int i=1;
+			for(fairport::message::attachment_iterator ai=m.attachment_begin();ai!=m.attachment_end();++ai)
 			{
-				strAttach="None";
-			}
-			else
-			{		
-				int i=1;
-				for(fairport::message::attachment_iterator ai=m.attachment_begin();ai!=m.attachment_end();++ai)
+				std::string strFilename;
+				const fairport::attachment attch=*ai; // The iterator builds a new attachment each time it is dereferenced
+				if (attch.is_message())
 				{
-					std::string strFilename;
-					if (ai->is_message())
+					Count(m_nMsgAttachment,CMetrics::eEmbedded);
+					// Mostly this is null, but occasionally not. For uniformity, keep consistent naming
+					strFilename=strID + ".att(" + std::to_string((long long)i) + ")";
+					const fairport::property_bag& attprops=attch.get_property_bag();
+					if(nDepth>=m_nMaxDepth||(m_nMaxEmbeddedBytes&&attprops.prop_exists(0x0E20)&&attprops.read_prop<fairport::ulong>(0x0E20)>m_nMaxEmbeddedBytes))
 					{
-						m_nMsgAttachment++;
-						// Mostly this is null, but occasionally not. For uniformity, keep consistent naming
-						strFilename=strID + ".att(" + std::to_string((_Longlong)i) + ")";
-						bHasEmbeddedMsg=true;
+						Count(m_nTruncated,CMetrics::eTruncated); // PR_ATTACH_SIZE over the limit, or nested too deep
 					}
 					else
 					{
-						if(ai->get_property_bag().prop_exists(0x3707))
-							strFilename=ai->get_property_bag().read_prop<std::string>(0x3707);
-						else if(ai->get_property_bag().prop_exists(0x3704))
-							strFilename=ai->get_property_bag().read_prop<std::string>(0x3704);
-						else
-							strFilename="Null";
-						if (strFilename!="Null"&&m_bStripAttachments)
-							SaveAttachment(*ai,strID+"."+strFilename);
+						children.push_back(CEmbedded(attch.open_as_message(),strFilename,nDepth+1));
+						children.back().tmCreated=tmDate;
 					}
-					strAttach+=strFilename;
-					strAttach+=" ;";
-					i++;
 				}
+				else if(bNames)
+				{
+					std::vector<fairport::prop_id> attpresent;
+					PresentProps(attch.get_property_bag(),attpresent);
+					strFilename=AttachmentName(attch,attpresent);
+					if (strFilename!="Null"&&m_bStripAttachments)
+						SaveAttachment(attch,strID,strFilename);
+					const CTextExtractor* pExtractor=(pExtractors?pExtractors->Find(strFilename):0);
+					if(pExtractor&&Has(attpresent,0x3701))
+						extracted.push_back(pExtractors->Submit(pExtractor,ReadAttachment(attch,pExtractors->MaxBytes())));
+				}
+				if(m_plan.Has(eFieldFilenames))filenames.push_back(strFilename);
+				i++;
 			}
-			m_ostrOut << "</field><field name=\"filenames\">" << CleanString(strAttach);
 
-			// IPM class of message. 
-			m_ostrOut << "</field><field name=\"class\">" << m.get_property_bag().read_prop<std::string>(0x001A);
-
-			// ASCII string of body text, or "Empty" if not available
-			std::string strBody = "Empty";
-			if (m.has_body()) strBody = CleanString(m.get_property_bag().read_prop<std::string>(0x1000));
-			m_ostrOut << "</field><field name=\"body\">" << strBody;
-			m_ostrOut << "</field></doc>";// << std::ends;
-			m_nProcessed++;
-			int i=1;
-			if(!bHasEmbeddedMsg)return true;
-			for(fairport::message::attachment_iterator ai=m.attachment_begin();ai!=m.attachment_end();++ai)
+			stage.Next(CMetrics::eStageEncode);
+			doc.BeginDoc();
+			const std::vector<CField>& fields=m_plan.Fields();
+			for(size_t f=0;f<fields.size();++f)
 			{
-				if (ai->is_message())
+				const CField& field=fields[f];
+				if(field.eSource==eFieldProperty&&field.eMissing!=eMissingFail&&!Has(present,field.nProp))
 				{
-					fairport::message msg=ai->open_as_message();
-					ProcessMessage(msg,strID + ".att(" + std::to_string((_Longlong)i) + ")",&tmDate);
+					// Missing, but not a reason to drop the message
+					if(field.eMissing==eMissingOmit)continue;
+					doc.BeginField(field.strName.c_str());
+					doc.Plain(field.strFallback);
+					doc.EndField();
+					continue;
 				}
-				i++;
+				if(field.eSource==eFieldAttachmentText&&!m_pExtractors)continue;
+				doc.BeginField(field.strName.c_str());
+				switch(field.eSource)
+				{
+				case eFieldProperty:
+					WriteProperty(doc,props,field);
+					break;
+				case eFieldId:
+					doc.Plain(strID);
+					break;
+				case eFieldPstFile:
+					// Parent PST file
+					doc.Plain(m_strPST);
+					break;
+				case eFieldCreated:
+					// Creation time, as YYYY-MM-DDTHH:mm:ssZ datetime 
+					doc.Date(tmDate);
+					break;
+				case eFieldSender:
+					// Display name of sender.
+					if(attachmentid!=""&&!Has(present,0x0C1A))
+						doc.Plain("Missing");
+					else
+						doc.Clean(props.read_prop<std::string>(0x0C1A));
+					break;
+				case eFieldSubject:
+					// Subject, as ASCII string (or "Empty")
+					if(Has(present,0x37))
+					{
+						std::string strSubj=props.read_prop<std::string>(0x37);
+						size_t nSkip=(strSubj.size() && strSubj[0] == fairport::message_subject_prefix_lead_byte)?2:0;
+						doc.BeginText();
+						if(strSubj.size()>nSkip)doc.Text(strSubj.data()+nSkip,strSubj.size()-nSkip);
+						doc.EndText();
+					}
+					else
+					{
+						doc.Plain("Empty");
+					}
+					break;
+				case eFieldTo:
+					// Full set of recipients, occasionally containing non-XML compliant characters
+					doc.BeginText();
+					for(fairport::message::recipient_iterator ri=m.recipient_begin();ri!=m.recipient_end();++ri)
+					{
+						doc.Text(ri->get_property_row().read_prop<std::string>(0x3001));
+						doc.Raw(" ;",2); // get_name()
+					}
+					doc.EndText();
+					break;
+				case eFieldAttachments:
+					// Number of attachments
+					doc.Number(nAttach);
+					break;
+				case eFieldFilenames:
+					doc.BeginText();
+					if(nAttach==0)doc.Raw("None",4);
+					for(size_t n=0;n<filenames.size();++n)
+					{
+						doc.Text(filenames[n]);
+						doc.Raw(" ;",2);
+					}
+					doc.EndText();
+					break;
+				case eFieldBody:
+					{
+						// ASCII string of body text, or "Empty" if not available
+						std::string strRtfBody;
+						if (Has(present,0x1000)) 
+							doc.Clean(props.read_prop<std::string>(0x1000));
+						else if (m_pExtractors&&Has(present,0x1009)&&
+							!(strRtfBody=m_pExtractors->ExtractRtf(props.read_prop<std::vector<fairport::byte> >(0x1009))).empty())
+							doc.Clean(strRtfBody); // PR_RTF_COMPRESSED, where there is no plain text body
+						else
+							doc.Plain("Empty");
+					}
+					break;
+				case eFieldAttachmentText:
+					// Text extracted from attachments
+					doc.BeginText();
+					for(size_t n=0;n<extracted.size();++n)
+					{
+						std::string strText=extracted[n].get();
+						if(strText.empty())continue;
+						doc.Text(strText);
+						doc.Raw(" ;",2);
+					}
+					doc.EndText();
+					break;
+				}
+				doc.EndField();
 			}
+			doc.EndDoc();
+			stage.Stop();
+			nMark=doc.Mark(); // The message is complete (and may already be compressed)
+			Count(m_nProcessed,CMetrics::eMessages);
+			// Reversed, so the first comes off the stack first
+			for(size_t i=children.size();i>0;--i)embedded.push_back(std::move(children[i-1]));
 			return true;
-			//return (m_bSubmitToSearch?SubmitMessage(m_ostrOut,strID):true);
 		}
 		catch(fairport::key_not_found<fairport::prop_id>&a)
 		{
-			std::cerr << "Key not found: 0x" << std::hex << long(a.which()) << std::dec << "\t\t" << "Msg ID was:" << strID << std::endl;
-			m_nProcFail++;
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_err << "Key not found: 0x" << std::hex << long(a.which()) << std::dec << "\t\t" << "Msg ID was:" << strID << std::endl;
+			Count(m_nProcFail,CMetrics::eFailed);
+			doc.Rollback(nMark);
 		}
 		catch(...)
 		{
-			std::cerr << "General error! Msg ID was:" << strID << std::endl;
-			m_nProcFail++;
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_err << "General error! Msg ID was:" << strID << std::endl;
+			Count(m_nProcFail,CMetrics::eFailed);
+			doc.Rollback(nMark);
 		}
 		return false;
 	}
-	void ProcessFolder(const fairport::folder& f,const std::string& path,std::string name,int indent)
+	bool ProcessHeaders(CWorker& w, const fairport::const_table_row& row)
 	{
-		m_nFolders++;
-		std::string strFolder=f.get_property_bag().read_prop<std::string>(0x3001); // Folder name
-		if(strFolder!="")name = name + "/" + strFolder;
-		int k=indent;
-		std::string strIndent;
-		while(--k)strIndent+="  ";
-		size_t iMax=f.get_message_count();
-		std::cout << strIndent << name << " (" << iMax << " items)\n";
-		if(!m_bDoFolderRE||std::regex_search(strFolder,m_rxFolder))
-		{
-			size_t i=0,j=0;
-			CTimer oTimer;
-			oTimer.Start();
-			for(fairport::folder::message_iterator mi=f.message_begin();mi!=f.message_end();++mi)
+		// A message as a document from its row in the folder's contents table alone (/H). Fields of the plan
+		// that the table lacks are left out, as are the body, attachment text and embedded messages. The
+		// message is opened only when it has attachments and the plan wants their number or names.
+		CDocumentBuilder& doc=*w.doc;
+		fairport::node_id nid=row.get_row_id();
+		std::vector<unsigned char> vID(w.vPrefix);
+		for(int n=0;n<4;++n)vID.push_back((unsigned char)(nid>>(8*n)));
+		std::string strID=HexId(vID);
+		size_t nMark=doc.Mark();
+		CStageTimer parse(m_pMetrics,CMetrics::eStageParse);
+		try {
+			std::vector<fairport::prop_id> present;
+			PresentProps(row,present);
+			// PR_MESSAGE_FLAGS has MSGFLAG_HASATTACH
+			bool bAttach=Has(present,0x0E07)&&(row.read_prop<fairport::slong>(0x0E07)&0x10)!=0;
+			size_t nAttach=0;
+			std::vector<std::string> filenames;
+			if(bAttach&&(m_plan.Has(eFieldAttachments)||m_plan.Has(eFieldFilenames)))
 			{
-				ProcessMessage(*mi);
-				i++;
-				if(m_bSubmitToSearch&&(i%20==0||i==iMax))
+				fairport::message m=w.store.open_message(nid);
+				nAttach=m.get_attachment_count();
+				Count(m_nAttachments,CMetrics::eAttachments,nAttach);
+				for(fairport::message::attachment_iterator ai=m.attachment_begin();ai!=m.attachment_end()&&m_plan.Has(eFieldFilenames);++ai)
 				{
-					m_ostrOut << "</add>";
-					if(SubmitMessage(m_ostrOut))
+					const fairport::attachment attch=*ai;
+					if(attch.is_message())
 					{
-						if(i==iMax)j+=iMax%20;
-						else j+=20;
+						filenames.push_back(strID + ".att(" + std::to_string((long long)filenames.size()+1) + ")");
+						continue;
 					}
-					std::ostringstream().swap(m_ostrOut);
-					m_ostrOut << m_strmsgpreamble;
+					std::vector<fairport::prop_id> attpresent;
+					PresentProps(attch.get_property_bag(),attpresent);
+					filenames.push_back(AttachmentName(attch,attpresent));
 				}
-				if(i%100==0)
+			}
+
+			doc.BeginDoc();
+			const std::vector<CField>& fields=m_plan.Fields();
+			for(size_t f=0;f<fields.size();++f)
+			{
+				const CField& field=fields[f];
+				switch(field.eSource)
 				{
-					std::cout << strIndent << i << " messages processed\t\t\r";
+				case eFieldProperty:
+					if(field.eMissing!=eMissingFail&&!Has(present,field.nProp))
+					{
+						if(field.eMissing==eMissingOmit)break;
+						doc.BeginField(field.strName.c_str());
+						doc.Plain(field.strFallback);
+						doc.EndField();
+						break;
+					}
+					doc.BeginField(field.strName.c_str());
+					WriteProperty(doc,row,field);
+					doc.EndField();
+					break;
+				case eFieldId:
+					doc.BeginField(field.strName.c_str());
+					doc.Plain(strID);
+					doc.EndField();
+					break;
+				case eFieldPstFile:
+					doc.BeginField(field.strName.c_str());
+					doc.Plain(m_strPST);
+					doc.EndField();
+					break;
+				case eFieldCreated:
+					if(!Has(present,0x0E06))break;
+					doc.BeginField(field.strName.c_str());
+					doc.Date(FileTimeToTm(row.read_prop<fairport::ulonglong>(0x0E06)));
+					doc.EndField();
+					break;
+				case eFieldSender:
+					// The sender's name, where the table has a column for it, or whoever it was sent for
+					doc.BeginField(field.strName.c_str());
+					if(Has(present,0x0C1A))
+						doc.Clean(row.read_prop<std::string>(0x0C1A));
+					else if(Has(present,0x0042))
+						doc.Clean(row.read_prop<std::string>(0x0042));
+					else
+						doc.Plain("Missing");
+					doc.EndField();
+					break;
+				case eFieldSubject:
+					doc.BeginField(field.strName.c_str());
+					if(Has(present,0x37))
+					{
+						std::string strSubj=row.read_prop<std::string>(0x37);
+						size_t nSkip=(strSubj.size() && strSubj[0] == fairport::message_subject_prefix_lead_byte)?2:0;
+						doc.BeginText();
+						if(strSubj.size()>nSkip)doc.Text(strSubj.data()+nSkip,strSubj.size()-nSkip);
+						doc.EndText();
+					}
+					else
+					{
+						doc.Plain("Empty");
+					}
+					doc.EndField();
+					break;
+				case eFieldTo:
+					// PR_DISPLAY_TO, the recipients' names as one string
+					if(!Has(present,0x0E04))break;
+					doc.BeginField(field.strName.c_str());
+					doc.Clean(row.read_prop<std::string>(0x0E04));
+					doc.EndField();
+					break;
+				case eFieldAttachments:
+					doc.BeginField(field.strName.c_str());
+					doc.Number(nAttach);
+					doc.EndField();
+					break;
+				case eFieldFilenames:
+					doc.BeginField(field.strName.c_str());
+					doc.BeginText();
+					if(filenames.empty())doc.Raw("None",4);
+					for(size_t n=0;n<filenames.size();++n)
+					{
+						doc.Text(filenames[n]);
+						doc.Raw(" ;",2);
+					}
+					doc.EndText();
+					doc.EndField();
+					break;
+				case eFieldBody:
+				case eFieldAttachmentText:
+					break;
 				}
 			}
-			CommitMessages();
-			oTimer.Mark();
-			std::cout << strIndent << j << " (of " << i << ") messages successfully processed in " << oTimer.Seconds() << " seconds\t\t" << std::endl;
+			doc.EndDoc();
+			Count(m_nProcessed,CMetrics::eMessages);
+			return true;
 		}
-		for(fairport::folder::folder_iterator subf = f.sub_folder_begin(); subf != f.sub_folder_end(); ++subf)
+		catch(fairport::key_not_found<fairport::prop_id>&a)
 		{
-			ProcessFolder(*subf, path, name, indent+1);
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_err << "Key not found: 0x" << std::hex << long(a.which()) << std::dec << "\t\t" << "Msg ID was:" << strID << std::endl;
+			Count(m_nProcFail,CMetrics::eFailed);
+			doc.Rollback(nMark);
 		}
-	}
-	void ProcessPst(bool bShowStats)
-	{
-		std::wstring wpath(m_strPST.begin(), m_strPST.end());
-		fairport::pst store(wpath);
-		char szPath[2048];
-		_fullpath(szPath,m_strPST.c_str(),2048);
-		std::string fPath(szPath);
-		std::string strPST = store.get_property_bag().read_prop<std::string>(0x3001);
-		std::cout << "Processing PST: " << strPST << " (file: " <<fPath << ")" << std::endl;
-		CTimer oTimer;
-		oTimer.Start();
-		ProcessFolder(store.open_root_folder(),fPath,strPST,1);
-		oTimer.Mark();
-		if(bShowStats)
+		catch(...)
 		{
-			std::cout << std::endl << std::endl
-				<< "Total time: " << oTimer.Seconds() << " seconds" << std::endl
-				<< "Folders traversed: " << m_nFolders << std::endl
-				<< "Messages successfully processed (of which are embedded attachments): " << m_nProcessed << " (" << m_nMsgAttachment << ")" << std::endl
-				<< "Messages failed to process: " << m_nProcFail << std::endl
-				<< "Successfully submitted: " << (m_nSuccess==0?0:m_nSuccess-m_nFolders) << std::endl // Each folder comes with a "commit" submission
-				<< "Failed to submit: " << m_nFail << std::endl
-				<< "Bytes sent: " << m_sentBytes << std::endl
-				<< "Attachments processed (saved/failed to save): " << m_nAttachments << " (" << m_nAttSaved << "/" << m_nAttFailed << ")" << std::endl << std::endl;
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_err << "General error! Msg ID was:" << strID << std::endl;
+			Count(m_nProcFail,CMetrics::eFailed);
+			doc.Rollback(nMark);
 		}
+		return false;
+	}
+	bool Skip(CWorker& w, const fairport::const_table_row& row, const CCheckpoint::CMessageSet* pDone, unsigned long long& nModified)
+	{
+		// Whether a message is left out, as acknowledged by an earlier run or unchanged since the last
+		// delta run; a delta run notes it as still present either way
+		unsigned int nRow=(unsigned int)row.get_row_id();
+		bool bSkip=(pDone&&pDone->count(nRow));
+		if(m_pDelta)
+		{
+			nModified=Modified(row);
+			w.seen.push_back(nRow);
+			if(nModified>w.nNewest)w.nNewest=nModified;
+			// Changed at or after the last run's newest time is sent again, in case of equal times
+			if(m_previous.Seen(nRow)&&nModified<m_previous.nWatermark)bSkip=true;
+		}
+		return bSkip;
+	}
+	void ProcessRange(CWorker& w, const fairport::folder& f, const std::shared_ptr<CFolderTally>& pFolder, size_t nBegin, size_t nEnd)
+	{
+		// Parses messages [nBegin,nEnd) of a folder into the worker's open batch
+		size_t i=nBegin;
+		size_t nSkipped=0;
+		// Messages already acknowledged by an earlier run are looked up by nid in the contents table,
+		// without opening them
+		// and so, for a delta run, are modification times, and with /H everything indexed
+		const CCheckpoint::CMessageSet* pDone=(m_pCheckpoint?m_pCheckpoint->FolderMessages(m_nPstId,pFolder->nid):0);
+		const fairport::table* pContents=(pDone||m_pDelta||m_bHeadersOnly?&f.get_contents_table():0);
+		fairport::folder::message_iterator mi=f.message_begin();
+		std::advance(mi,nBegin);
+		for(;i<nEnd&&mi!=f.message_end();++mi)
+		{
+			unsigned long long nModified=0;
+			if(pContents&&i<pContents->size()&&Skip(w,(*pContents)[(fairport::ulong)i],pDone,nModified))
+			{
+				i++;
+				nSkipped++;
+				continue;
+			}
+			unsigned int nid;
+			bool bOK;
+			if(m_bHeadersOnly&&i<pContents->size())
+			{
+				fairport::const_table_row row=(*pContents)[(fairport::ulong)i];
+				nid=(unsigned int)row.get_row_id();
+				if(w.vPrefix.empty())
+				{
+					// Every entry ID in the pst starts the same, so one message is opened to find out how
+					std::vector<unsigned char> vID=w.store.open_message(nid).get_entry_id();
+					if(vID.size()>4)w.vPrefix.assign(vID.begin(),vID.end()-4);
+				}
+				bOK=ProcessHeaders(w,row);
+			}
+			else
+			{
+				fairport::message m=*mi;
+				nid=(unsigned int)m.get_id();
+				if(m_pDelta&&w.vPrefix.empty())
+				{
+					std::vector<unsigned char> vID=m.get_entry_id();
+					if(vID.size()>4)w.vPrefix.assign(vID.begin(),vID.end()-4);
+				}
+				bOK=ProcessMessage(*w.doc,m);
+			}
+			if(!bOK&&nModified<w.nRetryFrom)w.nRetryFrom=nModified;
+			i++;
+			// A message that failed added nothing, and is left out of the checkpoint to be tried again
+			if(bOK)AddToBatch(w,pFolder,nid);
+			if(m_bShowProgress&&m_nWorkers==1&&i%100==0)
+			{
+				std::lock_guard<std::mutex> lock(m_mutexOut);
+				m_out << pFolder->strIndent << i << " messages processed\t\t\r";
+			}
+		}
+		pFolder->nParsed+=i-nBegin-nSkipped;
+		Count(m_nSkipped,CMetrics::eSkipped,nSkipped);
+		FinishFolder(*pFolder);
+	}
+	void PlanFolder(CWorker& w, const fairport::folder& f, const std::shared_ptr<CFolderTally>& pFolder)
+	{
+		// Notes where in the file each message of the folder to be parsed lies, rather than parsing
+		// it; those skipped are counted here, as ProcessRange would. The folder is held open until
+		// the messages have been parsed.
+		const CCheckpoint::CMessageSet* pDone=(m_pCheckpoint?m_pCheckpoint->FolderMessages(m_nPstId,pFolder->nid):0);
+		const fairport::table& contents=f.get_contents_table();
+		fairport::shared_db_ptr db=w.store.get_db();
+		size_t nSkipped=0;
+		for(size_t i=0;i<contents.size();++i)
+		{
+			fairport::const_table_row row=contents[(fairport::ulong)i];
+			CDiskMessage msg;
+			if(Skip(w,row,pDone,msg.nModified))
+			{
+				nSkipped++;
+				continue;
+			}
+			msg.nid=(unsigned int)row.get_row_id();
+			msg.pFolder=pFolder;
+			try {
+				fairport::node_info node=db->lookup_node_info(msg.nid);
+				fairport::block_info block=db->lookup_block_info(node.data_bid);
+				msg.nOffset=block.address;
+				msg.nSize=block.size;
+				if(node.sub_bid)
+				{
+					block=db->lookup_block_info(node.sub_bid);
+					msg.nSubOffset=block.address;
+					msg.nSubSize=block.size;
+				}
+			}
+			catch(...)
+			{
+				// Sorted first, and left to fail when ProcessDiskRange opens it
+			}
+			w.disk.push_back(msg);
+		}
+		Count(m_nSkipped,CMetrics::eSkipped,nSkipped);
+		w.planned.push_back(pFolder);
+	}
+	void ProcessDiskRange(CWorker& w, const std::vector<CDiskMessage>& messages, size_t nBegin, size_t nEnd)
+	{
+		// Parses messages [nBegin,nEnd) of those noted by PlanFolder, each counted towards its own folder
+		for(size_t i=nBegin;i<nEnd;++i)
+		{
+			const CDiskMessage& msg=messages[i];
+			msg.pFolder->nParsed++;
+			bool bOK=false;
+			try {
+				fairport::message m=w.store.open_message(msg.nid);
+				if(m_pDelta&&w.vPrefix.empty())
+				{
+					std::vector<unsigned char> vID=m.get_entry_id();
+					if(vID.size()>4)w.vPrefix.assign(vID.begin(),vID.end()-4);
+				}
+				bOK=ProcessMessage(*w.doc,m);
+			}
+			catch(...)
+			{
+				// A message that cannot be opened (its node lookup may already have failed in PlanFolder)
+				// fails alone, as it would in its folder
+				std::lock_guard<std::mutex> lock(m_mutexOut);
+				m_err << "Unable to open message, nid: " << msg.nid << std::endl;
+				Count(m_nProcFail,CMetrics::eFailed);
+			}
+			if(bOK)AddToBatch(w,msg.pFolder,msg.nid);
+			else if(msg.nModified<w.nRetryFrom)w.nRetryFrom=msg.nModified;
+			m_nDiskDone++; // Whatever the outcome, so the prefetch keeps moving
+		}
+	}
+	void ProcessFolder(unsigned int nWorker, CWorker& w, CFolderTask& task, CWorkStealingPool<CFolderTask>& pool)
+	{
+		if(task.pDisk)
+		{
+			ProcessDiskRange(w, *task.pDisk, task.nBegin, task.nEnd);
+			return;
+		}
+		fairport::folder f=w.store.open_folder(task.nid);
+		if(task.pFolder)
+		{
+			// A range of messages split off from a large folder
+			ProcessRange(w, f, task.pFolder, task.nBegin, task.nEnd);
+			return;
+		}
+		m_nFolders++;
+		std::string name=task.name;
+		std::string strFolder=f.get_property_bag().read_prop<std::string>(0x3001); // Folder name
+		if(strFolder!="")name = name + "/" + strFolder;
+		int k=task.indent;
+		std::string strIndent;
+		while(--k)strIndent+="  ";
+		size_t iMax=f.get_message_count();
+		{
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_out << strIndent << name << " (" << iMax << " items)\n";
+		}
+
+		// Subfolders are pushed last first, so that a lone worker still visits them in order
+		const fairport::table& hierarchy=f.get_hierarchy_table();
+		for(size_t i=hierarchy.size();i>0;--i)
+		{
+			CFolderTask sub;
+			sub.nid=hierarchy[(fairport::ulong)(i-1)].get_row_id();
+			sub.name=name;
+			sub.indent=task.indent+1;
+			pool.Push(nWorker, std::move(sub));
+		}
+
+		if(m_pCheckpoint&&m_pCheckpoint->IsFolderDone(m_nPstId,(unsigned int)task.nid))
+		{
+			Count(m_nSkipped,CMetrics::eSkipped,iMax);
+			if(m_pDelta)
+			{
+				// Still present, so not to be deleted
+				const fairport::table& contents=f.get_contents_table();
+				for(size_t i=0;i<contents.size();++i)
+				{
+					w.seen.push_back((unsigned int)contents[(fairport::ulong)i].get_row_id());
+					unsigned long long nModified=Modified(contents[(fairport::ulong)i]);
+					if(nModified>w.nNewest)w.nNewest=nModified;
+				}
+			}
+			std::lock_guard<std::mutex> lock(m_mutexOut);
+			m_out << strIndent << "Already indexed" << std::endl;
+		}
+		else if(!m_bDoFolderRE||std::regex_search(strFolder,m_rxFolder))
+		{
+			std::shared_ptr<CFolderTally> pFolder(new CFolderTally(strIndent,(unsigned int)task.nid));
+			pFolder->oTimer.Start();
+			if(m_bDiskOrder)
+			{
+				PlanFolder(w, f, pFolder);
+				return;
+			}
+			size_t nFirstEnd=iMax;
+			if(m_nWorkers>1&&iMax>m_nMessagesPerTask)
+			{
+				// Leave the first range to this worker, and the rest for others to steal
+				size_t nRanges=(iMax+m_nMessagesPerTask-1)/m_nMessagesPerTask;
+				pFolder->nPending+=(int)(nRanges-1);
+				for(size_t r=nRanges-1;r>0;--r)
+				{
+					CFolderTask range;
+					range.nid=task.nid;
+					range.nBegin=r*m_nMessagesPerTask;
+					range.nEnd=(r==nRanges-1?(size_t)-1:(r+1)*m_nMessagesPerTask); // Last range runs to the end of the folder
+					range.pFolder=pFolder;
+					pool.Push(nWorker, std::move(range));
+				}
+				nFirstEnd=m_nMessagesPerTask;
+			}
+			else
+			{
+				nFirstEnd=(size_t)-1;
+			}
+			ProcessRange(w, f, pFolder, 0, nFirstEnd);
+		}
+	}
+	void ProcessDiskOrder(std::vector<std::unique_ptr<CWorker> >& workers, CWorkStealingPool<CFolderTask>& pool, const CMappedFile& mapped)
+	{
+		// Parses what the folder walk noted, sorted by file offset, so that reads move forward through
+		// the file rather than back and forth. Ranges are dealt out in turn, first range last, so that
+		// each worker takes its own in order and together they keep close to one place in the file.
+		std::shared_ptr<std::vector<CDiskMessage> > pDisk(new std::vector<CDiskMessage>);
+		for(size_t i=0;i<workers.size();++i)
+		{
+			pDisk->insert(pDisk->end(), workers[i]->disk.begin(), workers[i]->disk.end());
+			workers[i]->disk.clear();
+		}
+		std::stable_sort(pDisk->begin(), pDisk->end(), [](const CDiskMessage& a, const CDiskMessage& b) { return a.nOffset<b.nOffset; });
+		size_t nRanges=(pDisk->size()+m_nDiskMessagesPerTask-1)/m_nDiskMessagesPerTask;
+		for(size_t r=nRanges;r>0;--r)
+		{
+			CFolderTask range;
+			range.pDisk=pDisk;
+			range.nBegin=(r-1)*m_nDiskMessagesPerTask;
+			range.nEnd=std::min(pDisk->size(), r*m_nDiskMessagesPerTask);
+			pool.Push((unsigned int)((r-1)%workers.size()), std::move(range));
+		}
+
+		// Unless the whole file is being read ahead anyway, the blocks of the messages next in line
+		// are brought into the cache just before the workers reach them
+		std::atomic<bool> bStop(false);
+		std::thread prefetch;
+		if(mapped.Data()&&!mapped.ReadsAll())
+		{
+			prefetch=std::thread([&]() {
+				size_t nAhead=2*workers.size()*m_nDiskMessagesPerTask;
+				for(size_t i=0;i<pDisk->size()&&!bStop;++i)
+				{
+					while(i>=m_nDiskDone+nAhead&&!bStop)std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					const CDiskMessage& msg=(*pDisk)[i];
+					mapped.WillNeed(msg.nOffset, msg.nSize);
+					if(msg.nSubSize)mapped.WillNeed(msg.nSubOffset, msg.nSubSize);
+				}
+			});
+		}
+		try {
+			pool.Run([&](unsigned int nWorker, CFolderTask& task) { ProcessFolder(nWorker, *workers[nWorker], task, pool); },
+				[&](unsigned int nWorker) { FlushStale(*workers[nWorker]); });
+		}
+		catch(...)
+		{
+			bStop=true;
+			if(prefetch.joinable())prefetch.join();
+			throw;
+		}
+		bStop=true;
+		if(prefetch.joinable())prefetch.join();
+		// Folders are done with once their messages are parsed, as ProcessRange does for its range
+		for(size_t i=0;i<workers.size();++i)
+		{
+			for(size_t j=0;j<workers[i]->planned.size();++j)FinishFolder(*workers[i]->planned[j]);
+			workers[i]->planned.clear();
+		}
+	}
+	void ProcessPst(bool bShowStats)
+	{
+		// The file is read ahead of the workers, in file order, while they parse, up to the budget; in
+		// file order parsing, only the blocks next in line are, unless the whole file fits the budget
+		CMappedFile mapped;
+		if(m_bMapPst||m_bDiskOrder)
+		{
+			if(!mapped.Open(m_strPST))m_err << "Unable to map " << m_strPST << ", reading it as usual" << std::endl;
+			else if(m_bMapPst&&(!m_bDiskOrder||mapped.Size()<=m_nMapBudget))mapped.ReadAheadInBackground(m_nMapBudget);
+		}
+		std::wstring wpath(m_strPST.begin(), m_strPST.end());
+		fairport::pst store(wpath);
+		std::string fPath=FullPath(m_strPST);
+		std::string strPST = store.get_property_bag().read_prop<std::string>(0x3001);
+		m_out << "Processing PST: " << strPST << " (file: " <<fPath << ")" << std::endl;
+		if(m_pDelta)m_previous=m_pDelta->Find(fPath);
+		CTimer oTimer;
+		oTimer.Start();
+
+		// Each worker opens the pst for itself
+		std::vector<std::unique_ptr<CWorker> > workers;
+		for(unsigned int i=0;i<m_nWorkers;++i)
+		{
+			workers.push_back(std::unique_ptr<CWorker>(new CWorker(wpath, CreateDocumentBuilder(m_strFormat))));
+			workers.back()->doc->SetCommitWithin(m_strCommitWithin);
+			if(m_nGzipLevel>0&&!workers.back()->doc->SetCompression(m_nGzipLevel))m_nGzipLevel=0;
+			workers.back()->doc->BeginBatch();
+		}
+		CWorkStealingPool<CFolderTask> pool(m_nWorkers);
+		CFolderTask root;
+		root.nid=store.open_root_folder().get_id();
+		root.name=strPST;
+		pool.Push(0, std::move(root));
+
+		StartSenders();
+		try {
+			pool.Run([&](unsigned int nWorker, CFolderTask& task) { ProcessFolder(nWorker, *workers[nWorker], task, pool); },
+				[&](unsigned int nWorker) { FlushStale(*workers[nWorker]); });
+			if(m_bDiskOrder)ProcessDiskOrder(workers, pool, mapped);
+			// Batches span folders, so whatever is left open is sent once the whole tree is parsed
+			for(size_t i=0;i<workers.size();++i)QueueBatch(*workers[i]);
+		}
+		catch(...)
+		{
+			StopSenders();
+			throw;
+		}
+		StopSenders();
+		if(m_pAttachments)m_pAttachments->Flush(m_attCounts); // Attachment counts are final from here
+		if(m_pCheckpoint&&m_nFail==0&&!m_bDoFolderRE)m_pCheckpoint->MarkFile(m_nPstId);
+		if(m_pDelta&&m_nFail==0&&!m_bDoFolderRE)UpdateDelta(fPath,workers);
+		oTimer.Mark();
+		if(bShowStats&&m_bMapPst&&mapped.Size())m_out << "Read ahead: " << mapped.ReadSoFar()/(1024*1024) << " of " << mapped.Size()/(1024*1024) << "MB" << std::endl;
+		if(bShowStats)GetTotals().Print(m_out,oTimer);
+	}
+	void SetCheckpoint(CCheckpoint* pCheckpoint, unsigned int nPstId)
+	{
+		m_pCheckpoint=pCheckpoint;
+		m_nPstId=nPstId;
+	}
+	void SetAttachmentStore(CAttachmentStore* pAttachments)
+	{
+		m_pAttachments=pAttachments;
+	}
+	void SetExtractors(CExtractorPool* pExtractors)
+	{
+		m_pExtractors=pExtractors;
+	}
+	void SetMetrics(CMetrics* pMetrics)
+	{
+		m_pMetrics=pMetrics;
+	}
+	void SetDeadLetter(CBatchSink* pDeadLetter)
+	{
+		m_pDeadLetter=pDeadLetter;
+	}
+	void SetDelta(CDeltaState* pDelta, bool bDelete)
+	{
+		m_pDelta=pDelta;
+		m_bDeltaDelete=bDelete;
+	}
+	bool Commit()
+	{
+		// A single explicit commit for the run, sent once every batch has been acknowledged
+		return m_bSubmitToSearch&&SubmitMessage(m_pFormat->CommitCommand());
+	}
+	void Replay(const std::vector<std::string>& files)
+	{
+		// Streams batches from shard files to the sinks, without parsing anything
+		CTimer oTimer;
+		oTimer.Start();
+		CGzipStream deflate;
+		if(m_nGzipLevel>0&&!deflate.Init(m_nGzipLevel))m_nGzipLevel=0;
+		unsigned long nBatches=0;
+		StartSenders();
+		for(size_t i=0;i<files.size();++i)
+		{
+			CShardReader reader(files[i]);
+			if(!reader.IsOpen())
+			{
+				m_err << "Unable to open shard: " << files[i] << std::endl;
+				continue;
+			}
+			if(m_strFormat!=reader.Format())
+			{
+				m_err << "Skipping " << files[i] << ", not in " << m_strFormat << " format" << std::endl;
+				continue;
+			}
+			m_out << "Replaying shard: " << files[i] << std::endl;
+			CBatch batch;
+			std::string strBatch;
+			while(reader.Next(strBatch))
+			{
+				batch.nRawBytes=strBatch.length();
+				if(m_nGzipLevel>0)
+				{
+					batch.strBody=TakeSpareBuffer();
+					deflate.Reset();
+					deflate.Write(strBatch.data(), strBatch.length(), batch.strBody);
+					deflate.Finish(batch.strBody);
+				}
+				else
+				{
+					batch.strBody.swap(strBatch);
+				}
+				size_t nBytes=batch.strBody.length();
+				m_queue.Push(std::move(batch), nBytes);
+				batch=CBatch();
+				nBatches++;
+			}
+		}
+		StopSenders();
+		oTimer.Mark();
+		m_out << nBatches << " batches replayed in " << oTimer.Seconds() << " seconds, " << m_nSuccess << " submitted, " << m_nFail << " failed" << std::endl;
+	}
+	CPSTTotals GetTotals() const
+	{
+		CPSTTotals totals;
+		totals.nFiles=1;
+		totals.nFolders=m_nFolders;
+		totals.nProcessed=m_nProcessed;
+		totals.nMsgAttachment=m_nMsgAttachment;
+		totals.nTruncated=m_nTruncated;
+		totals.nProcFail=m_nProcFail;
+		totals.nSkipped=m_nSkipped;
+		totals.nRemoved=m_nRemoved;
+		totals.nSubmitted=m_nSuccess;
+		totals.nFail=m_nFail;
+		totals.nRetries=m_nRetries;
+		totals.nDeadLetter=m_nDeadLetter;
+		totals.sentBytes=m_sentBytes;
+		totals.rawBytes=m_rawBytes;
+		totals.wireBytes=m_wireBytes;
+		totals.nAttachments=m_nAttachments;
+		totals.nAttSaved=m_attCounts.nSaved;
+		totals.nAttDuplicate=m_attCounts.nDuplicate;
+		totals.nAttFailed=m_attCounts.nFailed;
+		return totals;
 	}
 };
 
+static std::vector<std::pair<std::string,unsigned long long> > FindFiles(const std::string& strPattern)
+{
+	// Files matching a wildcard, with their sizes
+	std::vector<std::pair<std::string,unsigned long long> > files;
+	size_t pos = strPattern.find_last_of(PATH_SEPARATORS);
+	std::string strPathPart="";
+	if(pos!=std::string::npos)strPathPart=strPattern.substr(0, pos+1);
+	std::vector<CFoundFile> found=FindMatching(strPattern);
+	for(size_t i=0;i<found.size();++i)files.push_back(std::make_pair(strPathPart + found[i].strName, found[i].nSize));
+	return files;
+}
+
+static void RunFormatBenchmark(const std::string& strFile, CPSTOptions opts, CSolrConnectionPool& oPool, CBatchPolicy& policy, CBenchReport& report)
+{
+	// Runs the same pst through each update format: once without submitting, for the client side
+	// parse and encode time, and then submitted and committed, for Solr's ingest rate; without a
+	// URL they go to a mock Solr that discards them, which times parsing and sending together
+	const char* szFormats[]={"xml","json"};
+	std::unique_ptr<CMockSolr> pMock;
+	std::unique_ptr<CSolrConnectionPool> pMockPool; // Closed before the mock
+	CSolrConnectionPool* pPool=&oPool;
+	if(!opts.bDoIndex)
+	{
+		pMock.reset(new CMockSolr());
+		pMockPool.reset(new CSolrConnectionPool(pMock->Host(),pMock->Port(),opts.nSenders+2));
+		boost::system::error_code error;
+		if(!pMockPool->Resolve(error))
+		{
+			std::cout << "Mock Solr: " << error.message() << std::endl;
+			return;
+		}
+		pPool=pMockPool.get();
+		opts.strHost=pMock->Host();
+		opts.strPort=pMock->Port();
+		opts.strUrlPath="/solr/update";
+	}
+	const char* szSubmit=(pMock?"mock":"ingest");
+	std::ostringstream ostrQuiet;
+	std::cout << "Format\tRun\tSeconds\tMessages\tMessages/s\tPayload bytes" << std::endl;
+	for(int nPass=0;nPass<2;++nPass)
+	{
+		for(size_t f=0;f<sizeof(szFormats)/sizeof(szFormats[0]);++f)
+		{
+			opts.strFormat=szFormats[f];
+			opts.bDoIndex=(nPass==1);
+			CTimer oTimer;
+			oTimer.Start();
+			CPSTProcessor pp(strFile,opts,pPool,&policy,0,ostrQuiet,std::cerr);
+			try{
+				pp.ProcessPst(false);
+				if(opts.bDoIndex&&opts.bCommit)pp.Commit();
+			}
+			catch(...)
+			{
+				std::cout << "An unhandled error occured :-(" << std::endl;
+				return;
+			}
+			oTimer.Mark();
+			ostrQuiet.str(std::string());
+			CPSTTotals totals=pp.GetTotals();
+			double dSeconds=oTimer.MicroSeconds()/1e6;
+			report.Add(std::string("pst_")+(nPass?szSubmit:"encode")+"_"+opts.strFormat,totals.nProcessed,nPass?totals.rawBytes:0,dSeconds);
+			std::cout << opts.strFormat << "\t" << (nPass?szSubmit:"encode") << "\t" << std::fixed << std::setprecision(3) << dSeconds << "\t"
+				<< totals.nProcessed << "\t" << std::setprecision(0) << totals.nProcessed/(dSeconds>0?dSeconds:1) << "\t";
+			if(nPass)std::cout << totals.rawBytes;
+			else std::cout << "-";
+			std::cout.unsetf(std::ios::floatfield);
+			std::cout << std::endl;
+		}
+	}
+}
+
 static void Usage(char*szName)
 {
 	std::string strAppName(szName);
@@ -565,25 +1776,70 @@ static void Usage(char*szName)
 	std::cout 
 		<< std::endl
 		<< "Usage :" << std::endl
-		<< "\t" << strAppName << " [/Z] [/A[:ext]] [/F:folder] [/S] [URL] pstfile.pst" << std::endl << std::endl 
+		<< "\t" << strAppName << " [/Z] [/J:jobs] [/P:threads] [/N:senders] [/B:batch] [/G[:level]] [/O:format] [/X:dir[,mb[,gz]]] [/K:checkpoint] [/D:state[,delete]] [/C:none] [/A[:ext]] [/W[:writers[,mb]]] [/E[:threads[,kb[,ms]]]] [/M:depth[,mb]] [/L:plan] [/H] [/MMAP[:mb]] [/DISKORDER] [/METRICS:port] [/METRICSLOG:file[,s]] [/RETRY:n[,ms[,maxms]]] [/DL:dir] [/F:folder] [/S] [URL] pstfile.pst" << std::endl
+		<< "\t" << strAppName << " [/N:senders] [/G[:level]] [/C:none] [/RETRY:n[,ms[,maxms]]] [/DL:dir] /R:shards URL" << std::endl
+		<< "\t" << strAppName << " /BENCH[:results.json] [[URL] pstfile.pst]" << std::endl << std::endl 
 		<< "where :" << std::endl 
 		<< "\tpstfile.pst is pst file to process." << std::endl
 		<< "\tURL is optional fully qualified Solr URL of the form:\n\t  http://hostname:port/update_url" << std::endl
 		<< "\tfor example:\n\t  http://localhost:8984/solr/PstSearch/update ." << std::endl
+		<< "\tSeveral Solr nodes are given as http://host1:port1,host2:port2/update_url ." << std::endl
 		<< "\tOptional command /Z to stream updates (ignores server responses - faster but doesn't validate);" << std::endl 
-		<< "\tOptional command /A indicates to strip attachments [file extension .ext only];" << std::endl 
+		<< "\tOptional command /J processes up to jobs pst files at once, largest first;" << std::endl 
+		<< "\tOptional command /P parses each pst on threads threads, splitting up its folders;" << std::endl 
+		<< "\tOptional command /N sets the number of threads submitting to Solr while parsing continues (default 2)," << std::endl 
+		<< "\t  each with one batch in flight;" << std::endl 
+		<< "\tOptional command /RETRY sends requests that fail, or that Solr answers 5xx or 429, again up to n times" << std::endl 
+		<< "\t  (default 4), after random pauses of up to ms milliseconds (default 500), doubling to maxms (default 30000);" << std::endl 
+		<< "\tOptional command /DL writes batches that still fail to shard files in dir, for sending later with /R;" << std::endl 
+		<< "\tOptional command /B sets when batches are sent, as docs[,kbytes[,ms]] (default 500,4096)," << std::endl 
+		<< "\t  or auto[,ms] to size batches from Solr response times (default target 1000ms);" << std::endl 
+		<< "\t  ms is checked as documents are added and while a parser waits for work, not during one long message;" << std::endl 
+		<< "\tOptional command /G sends batches gzip compressed, at level 1-9 (default 6);" << std::endl 
+		<< "\tOptional command /O sets the update format, xml (default) or json;" << std::endl 
+		<< "\tOptional command /X also (or, without a URL, only) writes batches to rotating shard files in dir," << std::endl 
+		<< "\t  of up to mb megabytes each (default 256), gzip compressed with gz;" << std::endl 
+		<< "\tOptional command /K records acknowledged messages, folders and pst files in checkpoint," << std::endl 
+		<< "\t  and skips whatever it already holds, so an interrupted run can be resumed (not with /Z);" << std::endl 
+		<< "\tOptional command /D keeps the modification times and messages of each pst in state, and on later runs" << std::endl 
+		<< "\t  sends only new and changed messages, and with delete removes messages gone from the pst from the index;" << std::endl 
+		<< "\t/R sends previously exported shard files (wildcards allowed) to Solr without opening any pst;" << std::endl 
+		<< "\tOptional command /C:none skips the commit at the end of the run, relying on commitWithin;" << std::endl 
+		<< "\tOptional command /A indicates to strip attachments [file extension .ext only], saving each distinct" << std::endl 
+		<< "\t  content once and listing every attachment in attachments.manifest;" << std::endl 
+		<< "\tOptional command /W saves attachments on writers threads (default 4) while parsing continues," << std::endl 
+		<< "\t  with up to mb megabytes queued (default 64);" << std::endl 
+		<< "\tOptional command /E indexes the text of plain text, HTML and RTF attachments in attachmenttext," << std::endl 
+		<< "\t  on threads threads (default 2), reading up to kb (default 1024) and spending up to ms (default 2000)" << std::endl 
+		<< "\t  on each; messages with only an RTF body are indexed from that;" << std::endl 
+		<< "\tOptional command /M limits embedded messages to depth levels of nesting (default 16)" << std::endl 
+		<< "\t  and mb megabytes each (default no limit);" << std::endl 
+		<< "\tOptional command /L writes the fields listed in the file plan rather than the usual ones (see ReadMe);" << std::endl 
+		<< "\tOptional switch /H indexes only what folder contents tables hold (sender, subject, dates, recipients)," << std::endl 
+		<< "\t  without bodies or embedded messages, opening only messages with attachments for their names;" << std::endl 
+		<< "\tOptional switch /MMAP maps each pst and reads it ahead in file order while it is parsed," << std::endl 
+		<< "\t  so that parsing is served from the system cache rather than by seeks; at most mb of each" << std::endl 
+		<< "\t  (default half of memory, shared by /J jobs) is read ahead;" << std::endl 
+		<< "\tOptional switch /DISKORDER walks the folders first, then parses their messages in the order" << std::endl 
+		<< "\t  their data lies in the file, reading each message's blocks just ahead of the parsers;" << std::endl 
+		<< "\tOptional command /METRICS serves live counters and per-stage latencies on 127.0.0.1:port/metrics," << std::endl 
+		<< "\t  in Prometheus text format;" << std::endl 
+		<< "\tOptional command /METRICSLOG appends the same to file as a JSON line every s seconds (default 10);" << std::endl 
 		<< "\toptional command /F indicates to process only folders matching folder;" << std::endl
 		<< "\toptional switch /S indicates to show summary statistics after processing each pst." << std::endl 
 		<< "\tBoth /A and /F take regular expressions as patterns to match," <<std::endl
-		<< "\tcomplex patterns should be enclosed in quotes." <<std::endl << std::endl;
+		<< "\tcomplex patterns should be enclosed in quotes." <<std::endl
+		<< "\t/BENCH runs the built in microbenchmarks on synthetic data and exits;" <<std::endl
+		<< "\tgiven a pst it instead times encoding and sending it in each update format, to Solr given a URL" <<std::endl
+		<< "\tor else to a mock Solr; with results.json the figures are also written there as JSON." <<std::endl << std::endl;
 	exit(EXIT_SUCCESS);
 }
 
 int main(int argc, char** argv)
 {
-	system("cls");
+	ClearScreen();
 	// Program name for usage
-	char*szProgName=strrchr(argv[0],'\\');
+	char*szProgName=strrchr(argv[0],PATH_SEPARATOR);
 	if(szProgName==0)
 	{
 		szProgName=argv[0];
@@ -592,119 +1848,600 @@ int main(int argc, char** argv)
 		szProgName++; // skip "\"
 	}
 	if(argc<2)Usage(szProgName);
-	std::string strHost("null"),strUrlPath("null"),strPort("null");
-	std::string strExtensions(""),strPath(""),strFolder("");
+	std::string strPath("");
+	CPSTOptions opts;
+	CBatchPolicy policy;
 
 	// Parse command line
-	bool bDoAttachments(false),bDoSolr(false),bShowStats(false),bDoFireForget(false);
+	bool bShowStats(false);
+	bool bBench(false);
+	std::string strBenchJson(""); // Benchmark figures, as JSON
+	std::string strShardDir(""); // Export batches to shard files here
+	unsigned long nShardMB(256);
+	bool bShardGzip(false);
+	std::string strReplay(""); // Shard files to send on to Solr
+	std::string strCheckpoint(""); // Journal of what has been indexed, for resuming
+	std::string strDelta(""); // State of the last run, for indexing only what changed
+	bool bDeltaDelete(false);
+	unsigned int nExtractors(0); // Threads extracting attachment text, or none not to
+	unsigned long nExtractKB(1024), nExtractMs(2000); // Limits for each attachment
+	unsigned int nAttachmentWriters(0); // Threads saving attachments, or none to save them while parsing
+	unsigned long nAttachmentMB(64); // Attachment content queued for the writers
+	unsigned int nJobs(1);
+	std::string strDeadLetter(""); // Batches Solr would not take, as shards
+	unsigned short nMetricsPort(0); // Prometheus endpoint, or none
+	std::string strMetricsLog(""); // Metrics as JSON lines
+	unsigned long nMetricsSeconds(10);
 	while(--argc)
 	{
 		std::string strArg(argv[argc]);
 		std::string strArgOrig(strArg);
 		std::transform(strArg.begin(), strArg.end(), strArg.begin(), tolower);
-		if(strArg.find("http://")==0)
+		bool bPath=false;
+#ifndef _WIN32
+		// Absolute paths start with / as options do; one with another / before any : is a path
+		bPath=(strArg[0]=='/'&&strArg.find('/',1)<strArg.find(':'));
+#endif
+		if(bPath)
 		{
-			// Parse out host, path, port
-			int i=strArg.find(":",7);
-			if(i==std::string::npos)
-			{
-				std::cout << "Must specify port." << std::endl;
-				Usage(szProgName);
-			}
-			strHost=strArg.substr(7,i-7);
-			if(strHost.length()<3)
-			{
-				std::cout << "Must specify hostname." << std::endl;
-				Usage(szProgName);
-			}
-			std::cout << "Host: " << strHost << std::endl;
-			int ii=strArg.find("/",i);
+			strPath=strArgOrig;
+		}
+		else if(strArg.find("http://")==0)
+		{
+			// Parse out host, path, port; several nodes serving the same path are given as host:port,host:port
+			size_t ii=strArg.find("/",7);
 			if(ii==std::string::npos)
 			{
 				std::cout << "Must specify path (or ""/"" for none)" << std::endl;
 				Usage(szProgName);
 			}
-			strPort=strArg.substr(i+1,ii-i-1);
-			std::cout << "Port: " << strPort << std::endl;
-			strUrlPath=strArgOrig.substr(ii);
-			std::cout << "Path: " << strUrlPath << std::endl;
-			bDoSolr=true;
+			opts.moreNodes.clear();
+			for(size_t nStart=7;nStart<ii;)
+			{
+				size_t nComma=std::min(strArg.find(",",nStart),ii);
+				size_t i=strArg.find(":",nStart);
+				if(i>=nComma)
+				{
+					std::cout << "Must specify port." << std::endl;
+					Usage(szProgName);
+				}
+				std::string strHost=strArg.substr(nStart,i-nStart);
+				if(strHost.length()<3)
+				{
+					std::cout << "Must specify hostname." << std::endl;
+					Usage(szProgName);
+				}
+				std::string strPort=strArg.substr(i+1,nComma-i-1);
+				std::cout << "Host: " << strHost << std::endl;
+				std::cout << "Port: " << strPort << std::endl;
+				if(nStart==7)
+				{
+					opts.strHost=strHost;
+					opts.strPort=strPort;
+				}
+				else
+				{
+					opts.moreNodes.push_back(std::make_pair(strHost,strPort));
+				}
+				nStart=nComma+1;
+			}
+			opts.strUrlPath=strArgOrig.substr(ii);
+			std::cout << "Path: " << opts.strUrlPath << std::endl;
+			opts.bDoIndex=true;
 		}
 		else if(strArg.find("/a")==0||strArg.find("-a")==0)
 		{
-			bDoAttachments=true;
+			opts.bDoAttachments=true;
 			std::cout << "Extension(s) specified: ";
 			if(strArg.length()>3&&strArg[2]==':')
 			{
-				strExtensions=strArgOrig.substr(3);
-				std::cout << strExtensions << std::endl;
+				opts.strExtensions=strArgOrig.substr(3);
+				std::cout << opts.strExtensions << std::endl;
 			} 
 			else
 			{ 
 				std::cout << "*" << std::endl;
 			}
 		}
+		else if(strArg=="/h"||strArg=="-h")
+		{
+			opts.bHeadersOnly=true;
+			std::cout << "Headers only, from folder contents tables" << std::endl;
+		}
 		else if(strArg.find("/s")==0||strArg.find("-s")==0)
 		{
 			bShowStats=true;
 		}
+		else if(strArg.find("/mmap")==0||strArg.find("-mmap")==0)
+		{
+			// /MMAP[:mb]
+			opts.bMapPst=true;
+			if(strArg.length()>6&&strArg[5]==':')opts.nMapBudget=strtoull(strArg.substr(6).c_str(),0,10)*1024*1024;
+		}
+		else if(strArg=="/diskorder"||strArg=="-diskorder")
+		{
+			opts.bDiskOrder=true;
+			std::cout << "Parsing messages in the order they lie in each pst file" << std::endl;
+		}
+		else if(strArg.find("/m:")==0||strArg.find("-m:")==0)
+		{
+			// depth[,mb]
+			unsigned long nMB=0;
+			sscanf(strArg.substr(3).c_str(),"%u,%lu",&opts.nMaxDepth,&nMB);
+			opts.nMaxEmbeddedBytes=nMB*1024*1024;
+			std::cout << "Embedded messages nested up to " << opts.nMaxDepth << " deep";
+			if(nMB)std::cout << ", of up to " << nMB << "MB";
+			std::cout << std::endl;
+		}
+		else if(strArg.find("/l:")==0||strArg.find("-l:")==0)
+		{
+			std::string strError;
+			if(!opts.plan.Load(strArgOrig.substr(3),strError))
+			{
+				std::cout << "Field plan " << strArgOrig.substr(3) << ": " << strError << std::endl;
+				Usage(szProgName);
+			}
+			std::cout << "Field plan: " << strArgOrig.substr(3) << ", " << opts.plan.Fields().size() << " fields" << std::endl;
+		}
+		else if(strArg.find("/e")==0||strArg.find("-e")==0)
+		{
+			// threads[,kb[,ms]]
+			nExtractors=2;
+			if(strArg.length()>3&&strArg[2]==':')sscanf(strArg.substr(3).c_str(),"%u,%lu,%lu",&nExtractors,&nExtractKB,&nExtractMs);
+			if(nExtractors<1)nExtractors=1;
+			if(nExtractKB<1)nExtractKB=1;
+			if(nExtractMs<1)nExtractMs=1;
+			std::cout << "Extracting attachment text on " << nExtractors << " threads, up to " << nExtractKB << "KB and " << nExtractMs << "ms each" << std::endl;
+		}
+		else if(strArg.find("/w")==0||strArg.find("-w")==0)
+		{
+			// threads[,mb]
+			nAttachmentWriters=4;
+			if(strArg.length()>3&&strArg[2]==':')sscanf(strArg.substr(3).c_str(),"%u,%lu",&nAttachmentWriters,&nAttachmentMB);
+			if(nAttachmentWriters<1)nAttachmentWriters=1;
+			if(nAttachmentMB<1)nAttachmentMB=1;
+			std::cout << "Attachment writers: " << nAttachmentWriters << ", queueing up to " << nAttachmentMB << "MB" << std::endl;
+		}
 		else if(strArg.find("/z")==0||strArg.find("-z")==0)
 		{
-			bDoFireForget=true;
+			opts.bDoFireForget=true;
+		}
+		else if(strArg.find("/j")==0||strArg.find("-j")==0)
+		{
+			nJobs=strtoul(strArg.substr(strArg[2]==':'?3:2).c_str(),0,10);
+			if(nJobs<1)nJobs=1;
+			std::cout << "Parallel pst files: " << nJobs << std::endl;
+		}
+		else if(strArg.find("/p:")==0||strArg.find("-p:")==0)
+		{
+			opts.nWorkers=strtoul(strArg.substr(3).c_str(),0,10);
+			if(opts.nWorkers<1)opts.nWorkers=1;
+			std::cout << "Parsing threads per pst: " << opts.nWorkers << std::endl;
+		}
+		else if(strArg.find("/n:")==0||strArg.find("-n:")==0)
+		{
+			opts.nSenders=strtoul(strArg.substr(3).c_str(),0,10);
+			if(opts.nSenders<1)opts.nSenders=1;
+			std::cout << "Senders: " << opts.nSenders << std::endl;
+		}
+		else if(strArg.find("/retry:")==0||strArg.find("-retry:")==0)
+		{
+			// retries[,base_ms[,max_ms]]
+			sscanf(strArg.substr(7).c_str(),"%u,%lu,%lu",&opts.nRetries,&opts.nRetryBaseMs,&opts.nRetryMaxMs);
+			std::cout << "Failed requests retried up to " << opts.nRetries << " times, backing off from " << opts.nRetryBaseMs << "ms to at most " << opts.nRetryMaxMs << "ms" << std::endl;
+		}
+		else if(strArg.find("/dl:")==0||strArg.find("-dl:")==0)
+		{
+			strDeadLetter=strArgOrig.substr(4);
+			std::cout << "Dead letter directory: " << strDeadLetter << std::endl;
+		}
+		else if(strArg.find("/metricslog:")==0||strArg.find("-metricslog:")==0)
+		{
+			// file[,seconds]
+			strMetricsLog=strArgOrig.substr(12);
+			size_t nComma=strMetricsLog.rfind(',');
+			if(nComma!=std::string::npos&&nComma+1<strMetricsLog.length()&&strMetricsLog.find_first_not_of("0123456789",nComma+1)==std::string::npos)
+			{
+				nMetricsSeconds=strtoul(strMetricsLog.c_str()+nComma+1,0,10);
+				if(nMetricsSeconds<1)nMetricsSeconds=10;
+				strMetricsLog=strMetricsLog.substr(0,nComma);
+			}
+			std::cout << "Metrics every " << nMetricsSeconds << " seconds to: " << strMetricsLog << std::endl;
+		}
+		else if(strArg.find("/metrics:")==0||strArg.find("-metrics:")==0)
+		{
+			nMetricsPort=(unsigned short)strtoul(strArg.substr(9).c_str(),0,10);
+		}
+		else if(strArg.find("/bench")==0||strArg.find("-bench")==0)
+		{
+			bBench=true;
+			if(strArg.length()>7&&strArg[6]==':')strBenchJson=strArgOrig.substr(7);
+		}
+		else if(strArg.find("/b:")==0||strArg.find("-b:")==0)
+		{
+			// Either docs[,kbytes[,ms]] or auto[,target_ms]
+			std::string strSpec=strArg.substr(3);
+			if(strSpec.find("auto")==0)
+			{
+				unsigned long nTargetMs=(strSpec.length()>5?strtoul(strSpec.substr(5).c_str(),0,10):1000);
+				policy.SetAdaptive(nTargetMs);
+				std::cout << "Adaptive batches, target response time: " << nTargetMs << "ms" << std::endl;
+			}
+			else
+			{
+				unsigned long nDocs=0,nKBytes=(unsigned long)(policy.MaxBytes()/1024),nMs=0;
+				sscanf(strSpec.c_str(),"%lu,%lu,%lu",&nDocs,&nKBytes,&nMs);
+				if(nDocs<1)nDocs=1;
+				if(nKBytes<1)nKBytes=1;
+				policy.SetLimits(nDocs,nKBytes*1024,nMs);
+				std::cout << "Batches of up to " << nDocs << " documents, " << nKBytes << "KB";
+				if(nMs)std::cout << " or " << nMs << "ms";
+				std::cout << std::endl;
+			}
+		}
+		else if(strArg.find("/g")==0||strArg.find("-g")==0)
+		{
+			// gzip level, default 6
+			opts.nGzipLevel=(strArg.length()>3&&strArg[2]==':'?atoi(strArg.substr(3).c_str()):6);
+			if(opts.nGzipLevel<1)opts.nGzipLevel=1;
+			if(opts.nGzipLevel>9)opts.nGzipLevel=9;
+			std::cout << "Compressing updates with gzip, level " << opts.nGzipLevel << std::endl;
+		}
+		else if(strArg.find("/o:")==0||strArg.find("-o:")==0)
+		{
+			opts.strFormat=strArg.substr(3);
+			if(opts.strFormat!="xml"&&opts.strFormat!="json")
+			{
+				std::cout << "Unknown update format: " << opts.strFormat << std::endl;
+				Usage(szProgName);
+			}
+			std::cout << "Update format: " << opts.strFormat << std::endl;
+		}
+		else if(strArg.find("/x:")==0||strArg.find("-x:")==0)
+		{
+			// dir[,mb[,gz]]
+			std::string strSpec=strArgOrig.substr(3);
+			size_t nComma=strSpec.find(',');
+			strShardDir=strSpec.substr(0,nComma);
+			if(nComma!=std::string::npos)
+			{
+				std::string strRest=strArg.substr(3+nComma+1);
+				nShardMB=strtoul(strRest.c_str(),0,10);
+				if(nShardMB<1)nShardMB=256;
+				bShardGzip=(strRest.find("gz")!=std::string::npos);
+			}
+			std::cout << "Exporting batches to shards of " << nShardMB << "MB" << (bShardGzip?", gzip compressed,":"") << " in: " << strShardDir << std::endl;
+		}
+		else if(strArg.find("/k:")==0||strArg.find("-k:")==0)
+		{
+			strCheckpoint=strArgOrig.substr(3);
+			std::cout << "Checkpoint: " << strCheckpoint << std::endl;
+		}
+		else if(strArg.find("/d:")==0||strArg.find("-d:")==0)
+		{
+			// statefile[,delete]
+			strDelta=strArgOrig.substr(3);
+			if(strArg.length()>10&&strArg.substr(strArg.length()-7)==",delete")
+			{
+				bDeltaDelete=true;
+				strDelta=strDelta.substr(0,strDelta.length()-7);
+			}
+			std::cout << "Delta state: " << strDelta << (bDeltaDelete?", deleting removed messages":"") << std::endl;
+		}
+		else if(strArg.find("/r:")==0||strArg.find("-r:")==0)
+		{
+			strReplay=strArgOrig.substr(3);
+			std::cout << "Replaying shards: " << strReplay << std::endl;
+		}
+		else if(strArg.find("/c:")==0||strArg.find("-c:")==0)
+		{
+			opts.bCommit=(strArg.substr(3)!="none");
+			std::cout << "Commit at end of run: " << (opts.bCommit?"yes":"no (commitWithin only)") << std::endl;
 		}
 		else if(strArg.find("/f:")==0||strArg.find("-f:")==0)
 		{
-			strFolder=strArgOrig.substr(3);
+			opts.strFolder=strArgOrig.substr(3);
 			std::cout << "Folders specified: " << strArgOrig.substr(3) << std::endl;
 		}
 		else
 		{
-			// PST file
-			strPath=strArg;
+			// PST file, as given, for case sensitive file systems
+			strPath=strArgOrig;
 		}
 	}
-	if(strPath=="")
+	if(opts.bHeadersOnly&&(opts.bDoAttachments||nExtractors))
+	{
+		// Neither is possible without reading attachment content
+		std::cout << "Headers only: attachments are neither saved nor extracted" << std::endl;
+		opts.bDoAttachments=false;
+		nExtractors=0;
+	}
+	if(opts.bMapPst)
+	{
+		// By default half of memory, shared by the psts processed at once
+		if(!opts.nMapBudget)opts.nMapBudget=PhysicalMemory()/2/nJobs;
+		if(!opts.nMapBudget)opts.nMapBudget=1024ULL*1024*1024;
+		std::cout << "Reading pst files ahead through a memory mapping, up to " << opts.nMapBudget/(1024*1024) << "MB each" << std::endl;
+	}
+	if(opts.bDoFireForget&&strCheckpoint!="")
+	{
+		// Responses are never read, so nothing is known to have been indexed
+		std::cout << "Streaming (/Z): no checkpoint is kept" << std::endl;
+		strCheckpoint="";
+	}
+	if(opts.bHeadersOnly&&opts.bDiskOrder)
+	{
+		// Contents tables are read in place, with no messages to put in order
+		std::cout << "Headers only: messages are read in folder order" << std::endl;
+		opts.bDiskOrder=false;
+	}
+	if(bBench&&strPath=="")
+	{
+		// Microbenchmarks on synthetic data, no pst or Solr needed
+		exit(RunBenchmarks(std::cout,strBenchJson));
+	}
+	if(strReplay!=""&&!opts.bDoIndex)
+	{
+		std::cout << "Replay needs a Solr URL." << std::endl;
+		Usage(szProgName);
+	}
+	if(strPath==""&&strReplay=="")
 	{
 		std::cout << "PST file not specified." << std::endl;
 		Usage(szProgName);
 	}
 
+	// Live metrics, recorded only when something reads them
+	CMetrics metrics;
+	CMetrics* pMetrics=0;
+	CMetricsServer metricsServer(metrics);
+	CMetricsLog metricsLog(metrics);
+	if(nMetricsPort)
+	{
+		boost::system::error_code error;
+		if(!metricsServer.Start(nMetricsPort,error))
+		{
+			std::cerr << "Unable to serve metrics on port " << nMetricsPort << ": " << error.message() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::cout << "Metrics: http://127.0.0.1:" << metricsServer.Port() << "/metrics" << std::endl;
+		pMetrics=&metrics;
+	}
+	if(strMetricsLog!="")
+	{
+		if(!metricsLog.Start(strMetricsLog,nMetricsSeconds))
+		{
+			std::cerr << "Unable to open metrics log: " << strMetricsLog << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		pMetrics=&metrics;
+	}
+
+	// Solr host is resolved once, and its connections are kept alive across batches and pst files
+	CSolrConnectionPool oPool(opts.strHost,opts.strPort,nJobs*opts.nSenders+2);
+	for(size_t i=0;i<opts.moreNodes.size();++i)oPool.AddNode(opts.moreNodes[i].first,opts.moreNodes[i].second);
+	if(opts.bDoIndex)
+	{
+		boost::system::error_code error;
+		if(!oPool.Resolve(error))
+		{
+			std::cerr << "Unable to resolve Solr: " << error.message() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Shard files are shared by every pst in the run
+	std::unique_ptr<CShardSink> pShards;
+	if(strShardDir!="")
+	{
+		if(opts.nGzipLevel>0)bShardGzip=true; // Batches arrive compressed
+		pShards.reset(new CShardSink(strShardDir,opts.strFormat,nShardMB*1024*1024,bShardGzip));
+	}
+
+	if(strReplay!="")
+	{
+		std::vector<std::pair<std::string,unsigned long long> > shards=FindFiles(strReplay);
+		std::sort(shards.begin(), shards.end());
+		if(shards.empty())
+		{
+			std::cout << "No shards found: " << strReplay << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::vector<std::string> paths;
+		for(size_t i=0;i<shards.size();++i)paths.push_back(shards[i].first);
+		CShardReader first(paths[0]);
+		opts.strFormat=first.Format();
+		// Replayed batches failing again go to a dead letter directory of their own, if given one
+		std::unique_ptr<CShardSink> pDeadLetter;
+		if(strDeadLetter!="")pDeadLetter.reset(new CShardSink(strDeadLetter,opts.strFormat,256*1024*1024,opts.nGzipLevel>0));
+		CPSTProcessor replayer("",opts,&oPool,&policy,0);
+		replayer.SetMetrics(pMetrics);
+		replayer.SetDeadLetter(pDeadLetter.get());
+		replayer.Replay(paths);
+		if(opts.bCommit)replayer.Commit();
+		if(pDeadLetter)
+		{
+			pDeadLetter->Close();
+			std::cout << "Dead letter ";
+			pDeadLetter->Print(std::cout);
+		}
+		metricsLog.Stop(); // With the final figures
+		exit(EXIT_SUCCESS);
+	}
+
+	std::unique_ptr<CCheckpoint> pCheckpoint;
+	if(strCheckpoint!="")
+	{
+		pCheckpoint.reset(new CCheckpoint(strCheckpoint));
+		if(!pCheckpoint->Open())
+		{
+			std::cout << "Unable to open checkpoint: " << strCheckpoint << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	std::unique_ptr<CDeltaState> pDelta;
+	if(strDelta!="")
+	{
+		pDelta.reset(new CDeltaState(strDelta));
+		if(!pDelta->Load())
+		{
+			std::cout << "Unable to read delta state: " << strDelta << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	std::unique_ptr<CAttachmentStore> pAttachments;
+	if(opts.bDoAttachments)
+	{
+		// Attachments from every pst go to one store in the current directory
+		pAttachments.reset(new CAttachmentStore(""));
+		pAttachments->SetMetrics(pMetrics);
+		if(!pAttachments->Open(nAttachmentWriters,(size_t)nAttachmentMB*1024*1024))
+		{
+			std::cout << "Unable to open attachment store" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Batches Solr still refuses after retrying are kept, as shards that /R can send again
+	std::unique_ptr<CShardSink> pDeadLetter;
+	if(strDeadLetter!="")pDeadLetter.reset(new CShardSink(strDeadLetter,opts.strFormat,256*1024*1024,opts.nGzipLevel>0));
+
+	std::unique_ptr<CExtractorPool> pExtractors;
+	if(nExtractors)pExtractors.reset(new CExtractorPool(nExtractors,(size_t)nExtractKB*1024,nExtractMs));
+
 	// Globbing for pst files
-	intptr_t file;
-	_finddata_t filedata;
-	size_t pos = strPath.rfind('\\');
-	std::string strPathPart="";
-	if(pos!=std::string::npos)strPathPart=strPath.substr(0, pos+1);
-	file = _findfirst(strPath.c_str(),&filedata);
-	if(file!=-1)
-	{
-		do
-		{
-			strPath=strPathPart + filedata.name;
-			//std::cout << strPath << std::endl;
-			FILE *fp;
-			int err = fopen_s(&fp, strPath.c_str(), "rb");
-			if(err==0)
-			{
-				fclose(fp);
-				// OK
-				//pstFile.close();
-				CPSTProcessor pp(strPath,strHost,strPort,strUrlPath,"60000",bDoSolr,bDoAttachments,strExtensions,strFolder,bDoFireForget);
-				//"localhost","8984","/solr/PstSearch/update","60000",bDoSolr,bDoAttachments);
+	std::vector<std::pair<std::string,unsigned long long> > files=FindFiles(strPath); // Path and size
+	if(nJobs>1)
+	{
+		// Largest first, so that no single long file is left running alone at the end
+		std::stable_sort(files.begin(), files.end(), 
+			[](const std::pair<std::string,unsigned long long>& a, const std::pair<std::string,unsigned long long>& b) { return a.second>b.second; });
+	}
+
+	if(bBench)
+	{
+		if(files.empty())
+		{
+			std::cout << "Unable to open PST file: " << strPath << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		CBenchReport report;
+		RunFormatBenchmark(files[0].first,opts,oPool,policy,report);
+		std::cout << "Peak working set: " << PeakRss()/(1024*1024) << "MB" << std::endl;
+		if(strBenchJson!=""&&!report.WriteJson(strBenchJson))
+		{
+			std::cout << "Unable to write " << strBenchJson << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	std::mutex mutexOut;
+	std::mutex mutexTotals;
+	CPSTTotals totals;
+	std::atomic<size_t> nNext(0);
+	auto worker=[&]()
+	{
+		// Each worker takes the next file off the list; with several workers a file's output is
+		// buffered and printed in one piece once that file is finished
+		for(size_t k=nNext++;k<files.size();k=nNext++)
+		{
+			const std::string& strFile=files[k].first;
+			std::ostringstream ostrOut;
+			std::ostream& out=(nJobs>1?static_cast<std::ostream&>(ostrOut):std::cout);
+			std::ostream& err=(nJobs>1?static_cast<std::ostream&>(ostrOut):std::cerr);
+			unsigned int nPstId=0;
+			if(pCheckpoint)
+			{
+				// A pst is known by full path, size and modified time, so an unchanged one costs a stat
+				std::string strFullPath=FullPath(strFile);
+				unsigned long long nSize;
+				long long nModified;
+				if(FileInfo(strFullPath,nSize,nModified))
+				{
+					nPstId=pCheckpoint->PstId(CCheckpoint::FileKey(strFullPath,nSize,nModified));
+					if(pCheckpoint->IsFileDone(nPstId))
+					{
+						out << "Already indexed: " << strFile << std::endl;
+						if(nJobs>1)
+						{
+							std::lock_guard<std::mutex> lock(mutexOut);
+							std::cout << ostrOut.str() << std::flush;
+						}
+						continue;
+					}
+				}
+			}
+			std::ifstream pst(strFile.c_str(), std::ios::in|std::ios::binary);
+			if(pst.is_open())
+			{
+				pst.close();
+				CPSTProcessor pp(strFile,opts,&oPool,&policy,pShards.get(),out,err);
+				if(nPstId)pp.SetCheckpoint(pCheckpoint.get(),nPstId);
+				if(pDelta)pp.SetDelta(pDelta.get(),bDeltaDelete);
+				pp.SetAttachmentStore(pAttachments.get());
+				pp.SetExtractors(pExtractors.get());
+				pp.SetMetrics(pMetrics);
+				pp.SetDeadLetter(pDeadLetter.get());
 				try{
 					pp.ProcessPst(bShowStats);
 				}
 				catch(...)
 				{
-					std::cout << "An unhandled error occured :-(" << std::endl;
+					out << "An unhandled error occured :-(" << std::endl;
 				}
+				std::lock_guard<std::mutex> lock(mutexTotals);
+				totals+=pp.GetTotals();
 			}
 			else
 			{
-				std::cout << "Unable to open PST file: " << strPath << std::endl;
+				out << "Unable to open PST file: " << strFile << std::endl;
 			}
-		} while (_findnext(file,&filedata) == 0);
+			if(nJobs>1)
+			{
+				std::lock_guard<std::mutex> lock(mutexOut);
+				std::cout << ostrOut.str() << std::flush;
+			}
+		}
+	};
+	CTimer oTimer;
+	oTimer.Start();
+	if(nJobs>1)
+	{
+		std::vector<std::thread> workers;
+		for(unsigned int i=0;i<nJobs&&i<files.size();++i)workers.push_back(std::thread(worker));
+		for(size_t i=0;i<workers.size();++i)workers[i].join();
+	}
+	else
+	{
+		worker();
+	}
+	if(pAttachments)pAttachments->Close();
+	if(pShards)
+	{
+		pShards->Close();
+		pShards->Print(std::cout);
+	}
+	if(pDeadLetter)
+	{
+		pDeadLetter->Close();
+		std::cout << "Dead letter ";
+		pDeadLetter->Print(std::cout);
+	}
+	if(opts.bCommit)
+	{
+		CPSTProcessor committer("",opts,&oPool,&policy,0);
+		committer.Commit();
+	}
+	oTimer.Mark();
+	if(bShowStats&&totals.nFiles>1)
+	{
+		std::cout << "Totals for all pst files:";
+		totals.Print(std::cout,oTimer);
 	}
+	metricsLog.Stop();
 
 	exit(EXIT_SUCCESS);
 }
\ No newline at end of file
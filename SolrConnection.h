@@ -0,0 +1,312 @@
+#pragma once
+
+// Persistent HTTP/1.1 connections to the Solr update handler.
+// The hosts are resolved once per run, and sockets are kept alive and reused
+// between batches, reconnecting when the server has dropped them. Given several
+// Solr nodes, new connections go to each in turn, passing over any that refuse.
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <boost/asio.hpp>
+
+class CHttpConnection {
+private:
+	boost::asio::ip::tcp::socket m_socket;
+	boost::asio::streambuf m_response; // Anything read past the end of one response is kept for the next
+	bool m_bOpen;
+	std::string m_strHost; // host:port of the node connected to, for the Host header
+
+	CHttpConnection(const CHttpConnection&);
+	CHttpConnection& operator=(const CHttpConnection&);
+
+	std::string TakeBytes(size_t n)
+	{
+		// Removes n bytes (which must already be buffered) from the front of the response buffer
+		std::string out(boost::asio::buffers_begin(m_response.data()), boost::asio::buffers_begin(m_response.data())+n);
+		m_response.consume(n);
+		return out;
+	}
+	bool FillTo(size_t n, boost::system::error_code& error)
+	{
+		if(m_response.size()<n)
+			boost::asio::read(m_socket, m_response, boost::asio::transfer_at_least(n-m_response.size()), error);
+		return !error;
+	}
+	bool ReadLine(std::string& strLine, boost::system::error_code& error)
+	{
+		size_t n=boost::asio::read_until(m_socket, m_response, "\r\n", error);
+		if(error)return false;
+		strLine=TakeBytes(n);
+		strLine.resize(strLine.length()-2);
+		return true;
+	}
+	static bool HeaderIs(const std::string& strHeader, const char* szName, std::string& strValue)
+	{
+		// Case insensitive match of header name, returning the trimmed value
+		size_t n=strlen(szName);
+		if(strHeader.length()<=n||strHeader[n]!=':')return false;
+		for(size_t i=0;i<n;++i)
+			if(tolower((unsigned char)strHeader[i])!=tolower((unsigned char)szName[i]))return false;
+		size_t pos=strHeader.find_first_not_of(" \t",n+1);
+		strValue=(pos==std::string::npos?"":strHeader.substr(pos));
+		std::transform(strValue.begin(), strValue.end(), strValue.begin(), tolower);
+		return true;
+	}
+public:
+	CHttpConnection(boost::asio::io_service& io_service):m_socket(io_service),m_bOpen(false) {}
+	bool IsOpen() const { return m_bOpen; }
+	const std::string& Host() const { return m_strHost; }
+	void Close()
+	{
+		boost::system::error_code ignored;
+		m_socket.close(ignored);
+		m_response.consume(m_response.size());
+		m_bOpen=false;
+	}
+	bool Connect(const std::vector<boost::asio::ip::tcp::endpoint>& endpoints, const std::string& strHost, boost::system::error_code& error)
+	{
+		Close();
+		error=boost::asio::error::host_not_found;
+		for(size_t i=0;error&&i<endpoints.size();++i)
+		{
+			boost::system::error_code ignored;
+			m_socket.close(ignored);
+			m_socket.connect(endpoints[i], error);
+		}
+		if(error)return false;
+		boost::system::error_code ignored;
+		m_socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+		m_strHost=strHost;
+		m_bOpen=true;
+		return true;
+	}
+	size_t Write(const std::string& strHeader, const std::string& strBody, boost::system::error_code& error)
+	{
+		// Header and body go out as one gathered write, so the body is never copied
+		std::vector<boost::asio::const_buffer> buffers;
+		buffers.push_back(boost::asio::buffer(strHeader));
+		buffers.push_back(boost::asio::buffer(strBody));
+		size_t nBytes=boost::asio::write(m_socket, buffers, error);
+		if(error)Close();
+		return nBytes;
+	}
+	void DiscardAvailable()
+	{
+		// Fire and forget mode never reads responses; throw away whatever has arrived
+		// so that the server is never blocked writing to a full socket
+		boost::system::error_code error;
+		char szBuff[4096];
+		while(!error&&m_socket.available(error)>0)
+			m_socket.read_some(boost::asio::buffer(szBuff), error);
+		m_response.consume(m_response.size());
+		if(error)Close();
+	}
+	bool ReadResponse(unsigned int& nStatus, std::string& strHeaders, std::string& strBody, boost::system::error_code& error)
+	{
+		// Reads one complete response (Content-Length, chunked or close delimited),
+		// leaving the connection positioned at the start of the next one
+		strHeaders.clear();
+		strBody.clear();
+		std::string strLine;
+		if(!ReadLine(strLine, error))
+		{
+			Close();
+			return false;
+		}
+		std::istringstream status_stream(strLine);
+		std::string http_version;
+		status_stream >> http_version >> nStatus;
+		if (!status_stream || http_version.substr(0, 5) != "HTTP/")
+		{
+			error=boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+			Close();
+			return false;
+		}
+		bool bKeepAlive=(http_version!="HTTP/1.0"), bChunked=false, bLength=false;
+		size_t nLength=0;
+		while(ReadLine(strLine, error)&&strLine!="")
+		{
+			strHeaders+=strLine+"\n";
+			std::string strValue;
+			if(HeaderIs(strLine, "Content-Length", strValue))
+			{
+				nLength=strtoul(strValue.c_str(), 0, 10);
+				bLength=true;
+			}
+			else if(HeaderIs(strLine, "Transfer-Encoding", strValue))
+				bChunked=(strValue.find("chunked")!=std::string::npos);
+			else if(HeaderIs(strLine, "Connection", strValue))
+				bKeepAlive=(strValue.find("close")==std::string::npos);
+		}
+		if(error)
+		{
+			Close();
+			return false;
+		}
+		if(bChunked)
+		{
+			for(;;)
+			{
+				if(!ReadLine(strLine, error))break;
+				size_t nChunk=strtoul(strLine.c_str(), 0, 16);
+				if(nChunk==0)
+				{
+					// Skip any trailers up to the terminating blank line
+					while(ReadLine(strLine, error)&&strLine!="");
+					break;
+				}
+				if(!FillTo(nChunk+2, error))break;
+				strBody+=TakeBytes(nChunk);
+				m_response.consume(2); // CRLF
+			}
+		}
+		else if(bLength)
+		{
+			if(FillTo(nLength, error))strBody=TakeBytes(nLength);
+		}
+		else
+		{
+			// No length given, body runs to end of stream
+			boost::asio::read(m_socket, m_response, boost::asio::transfer_all(), error);
+			if(error==boost::asio::error::eof)error=boost::system::error_code();
+			strBody=TakeBytes(m_response.size());
+			bKeepAlive=false;
+		}
+		if(error||!bKeepAlive)Close();
+		return !error;
+	}
+};
+
+class CRetryPolicy {
+	// When to send a failed request again: after exponential backoff with full jitter, each wait
+	// drawn from [0, min(max, base*2^attempt)], so that senders failing together do not all come
+	// back together. A Retry-After from the server is waited for at least, up to the same maximum.
+private:
+	unsigned int m_nRetries;
+	unsigned long m_nBaseMs;
+	unsigned long m_nMaxMs;
+	std::mt19937 m_random;
+	std::mutex m_mutex;
+public:
+	CRetryPolicy(unsigned int nRetries=0, unsigned long nBaseMs=500, unsigned long nMaxMs=30000):
+		m_nRetries(nRetries),m_nBaseMs(nBaseMs?nBaseMs:1),m_nMaxMs(std::max(nMaxMs,m_nBaseMs)),
+		m_random((unsigned long)std::chrono::steady_clock::now().time_since_epoch().count()) {}
+	unsigned int Retries() const { return m_nRetries; }
+	static bool IsRetryable(unsigned int nStatus)
+	{
+		// Overloaded or failing, rather than refusing the batch itself
+		return nStatus==429||nStatus>=500;
+	}
+	unsigned long DelayMs(unsigned int nAttempt, const std::string& strHeaders="")
+	{
+		unsigned long nCap=m_nMaxMs;
+		if(nAttempt<31&&m_nBaseMs<=(m_nMaxMs>>nAttempt))nCap=m_nBaseMs<<nAttempt;
+		unsigned long nDelay;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			nDelay=std::uniform_int_distribution<unsigned long>(0, nCap)(m_random);
+		}
+		// Headers as read, one per line; only a delay in seconds is understood, not an HTTP date
+		std::string strLower("\n"+strHeaders);
+		std::transform(strLower.begin(), strLower.end(), strLower.begin(), tolower);
+		size_t pos=strLower.find("\nretry-after:");
+		if(pos!=std::string::npos)
+		{
+			unsigned long nAfterMs=strtoul(strLower.c_str()+pos+13, 0, 10)*1000;
+			nDelay=std::max(nDelay, std::min(nAfterMs, m_nMaxMs));
+		}
+		return nDelay;
+	}
+};
+
+class CSolrConnectionPool {
+private:
+	struct CNode {
+		std::string strHost;
+		std::string strPort;
+		std::vector<boost::asio::ip::tcp::endpoint> endpoints; // Resolved once per run
+	};
+	boost::asio::io_service m_io_service;
+	std::vector<CNode> m_nodes;
+	std::atomic<unsigned int> m_nNext; // Node for the next new connection
+	std::vector<CHttpConnection*> m_idle;
+	std::mutex m_mutex;
+	size_t m_nMaxIdle;
+
+	CSolrConnectionPool(const CSolrConnectionPool&);
+	CSolrConnectionPool& operator=(const CSolrConnectionPool&);
+public:
+	CSolrConnectionPool(const std::string& host, const std::string& port, size_t nMaxIdle=4):
+		m_nNext(0), m_nMaxIdle(nMaxIdle)
+		{
+			AddNode(host, port);
+		}
+	~CSolrConnectionPool()
+	{
+		for(size_t i=0;i<m_idle.size();++i)delete m_idle[i];
+	}
+	void AddNode(const std::string& host, const std::string& port)
+	{
+		// Before Resolve
+		CNode node;
+		node.strHost=host;
+		node.strPort=port;
+		m_nodes.push_back(node);
+	}
+	size_t Nodes() const { return m_nodes.size(); }
+	bool Resolve(boost::system::error_code& error)
+	{
+		using boost::asio::ip::tcp;
+		tcp::resolver resolver(m_io_service);
+		for(size_t i=0;i<m_nodes.size();++i)
+		{
+			tcp::resolver::query query(m_nodes[i].strHost, m_nodes[i].strPort);
+			tcp::resolver::iterator endpoint_iterator = resolver.resolve(query, error);
+			tcp::resolver::iterator end;
+			if(error)return false;
+			m_nodes[i].endpoints.assign(endpoint_iterator, end);
+		}
+		return true;
+	}
+	bool Connect(CHttpConnection& conn, boost::system::error_code& error)
+	{
+		// To the next node in turn, or failing that the one after, and so on
+		unsigned int nFirst=m_nNext++;
+		for(size_t i=0;i<m_nodes.size();++i)
+		{
+			const CNode& node=m_nodes[(nFirst+i)%m_nodes.size()];
+			if(conn.Connect(node.endpoints, node.strHost+":"+node.strPort, error))return true;
+		}
+		return false;
+	}
+	CHttpConnection* Acquire()
+	{
+		// Hands out an idle connection where one exists; a new one is left unconnected
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(m_idle.empty())return new CHttpConnection(m_io_service);
+		CHttpConnection* pConn=m_idle.back();
+		m_idle.pop_back();
+		return pConn;
+	}
+	void Release(CHttpConnection* pConn)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if(pConn->IsOpen()&&m_idle.size()<m_nMaxIdle)
+			{
+				m_idle.push_back(pConn);
+				return;
+			}
+		}
+		delete pConn;
+	}
+};
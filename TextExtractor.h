@@ -0,0 +1,430 @@
+#pragma once
+
+// Extracts searchable text from attachment content, for the attachmenttext field. Extractors are
+// chosen by file extension: plain text, HTML (tags, scripts and styles dropped, entities decoded)
+// and RTF, including compressed RTF (LZFu, as in PR_RTF_COMPRESSED). Each item is limited in the
+// bytes read and the time spent on it; an item that runs out of time keeps what it had so far.
+// Extraction runs on a pool of threads, so the attachments of a message are extracted in parallel
+// while the parser reads the next one.
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "BoundedQueue.h"
+
+class CExtractLimits {
+	// Output and time allowed for one item
+private:
+	std::chrono::steady_clock::time_point m_tDeadline;
+	size_t m_nMaxOut;
+public:
+	CExtractLimits(unsigned long nMaxMs, size_t nMaxOut):m_tDeadline(std::chrono::steady_clock::now()+std::chrono::milliseconds(nMaxMs)),m_nMaxOut(nMaxOut) {}
+	bool Expired() const { return std::chrono::steady_clock::now()>m_tDeadline; }
+	bool Full(const std::string& out) const { return out.size()>=m_nMaxOut; }
+};
+
+class CTextExtractor {
+public:
+	virtual ~CTextExtractor() {}
+	virtual const char* Name() const=0;
+	virtual bool Accepts(const std::string& strExtn) const=0; // Lower case, without the dot
+	virtual void Extract(const char* in, size_t n, std::string& out, const CExtractLimits& limits) const=0;
+protected:
+	static const size_t m_nCheckEvery=64*1024; // Bytes of input between checks of the limits
+	static void AppendSpace(std::string& out)
+	{
+		// Runs of white space collapse to one
+		if(!out.empty()&&out[out.size()-1]!=' '&&out[out.size()-1]!='\n')out+=' ';
+	}
+};
+
+class CPlainTextExtractor : public CTextExtractor {
+public:
+	const char* Name() const { return "text"; }
+	bool Accepts(const std::string& strExtn) const
+	{
+		return strExtn=="txt"||strExtn=="text"||strExtn=="csv"||strExtn=="log"||strExtn=="md";
+	}
+	void Extract(const char* in, size_t n, std::string& out, const CExtractLimits& limits) const
+	{
+		// UTF-16 (with a byte order mark, as Windows writes it) keeps its ASCII characters
+		size_t nStart=0, nStep=1;
+		if(n>=2&&(unsigned char)in[0]==0xFF&&(unsigned char)in[1]==0xFE)
+		{
+			nStart=2;
+			nStep=2;
+		}
+		for(size_t i=nStart;i<n;i+=m_nCheckEvery)
+		{
+			if(limits.Expired()||limits.Full(out))return;
+			size_t nEnd=std::min(n,i+m_nCheckEvery);
+			if(nStep==1)
+			{
+				out.append(in+i,nEnd-i);
+				continue;
+			}
+			for(size_t j=i;j+1<nEnd;j+=2)out+=(in[j+1]==0?in[j]:' ');
+		}
+	}
+};
+
+class CHtmlExtractor : public CTextExtractor {
+private:
+	static bool StartsWith(const char* in, size_t n, size_t i, const char* sz)
+	{
+		for(size_t k=0;sz[k];++k)if(i+k>=n||tolower((unsigned char)in[i+k])!=sz[k])return false;
+		return true;
+	}
+	static size_t Entity(const char* in, size_t n, size_t i, std::string& out)
+	{
+		// Decodes the entity at in[i]=='&', returning the bytes used, or 0 to copy the '&' as is
+		static const struct { const char* sz; char c; } entities[]={{"&amp;",'&'},{"&lt;",'<'},{"&gt;",'>'},{"&quot;",'"'},{"&apos;",'\''},{"&nbsp;",' '}};
+		for(size_t k=0;k<sizeof(entities)/sizeof(entities[0]);++k)
+		{
+			if(StartsWith(in,n,i,entities[k].sz))
+			{
+				out+=entities[k].c;
+				return strlen(entities[k].sz);
+			}
+		}
+		if(i+2<n&&in[i+1]=='#')
+		{
+			size_t j=i+2;
+			bool bHex=(in[j]=='x'||in[j]=='X');
+			if(bHex)j++;
+			unsigned long nChar=0;
+			size_t nDigits=0;
+			for(;j<n&&nDigits<8&&(bHex?isxdigit((unsigned char)in[j]):isdigit((unsigned char)in[j]));++j,++nDigits)
+				nChar=nChar*(bHex?16:10)+(isdigit((unsigned char)in[j])?in[j]-'0':(tolower((unsigned char)in[j])-'a'+10));
+			if(nDigits==0||j>=n||in[j]!=';')return 0;
+			out+=(nChar<128?(char)nChar:' ');
+			return j+1-i;
+		}
+		return 0;
+	}
+public:
+	const char* Name() const { return "html"; }
+	bool Accepts(const std::string& strExtn) const
+	{
+		return strExtn=="htm"||strExtn=="html"||strExtn=="xhtml";
+	}
+	void Extract(const char* in, size_t n, std::string& out, const CExtractLimits& limits) const
+	{
+		size_t nCheck=m_nCheckEvery;
+		for(size_t i=0;i<n;)
+		{
+			if(i>=nCheck)
+			{
+				if(limits.Expired()||limits.Full(out))return;
+				nCheck=i+m_nCheckEvery;
+			}
+			char c=in[i];
+			if(c=='<')
+			{
+				// Scripts, styles and comments are dropped along with their content
+				const char* szEnd=">";
+				if(StartsWith(in,n,i,"<!--"))szEnd="-->";
+				else if(StartsWith(in,n,i,"<script"))szEnd="</script>";
+				else if(StartsWith(in,n,i,"<style"))szEnd="</style>";
+				size_t nEnd=i+1;
+				while(nEnd<n&&!StartsWith(in,n,nEnd,szEnd))nEnd++;
+				i=std::min(n,nEnd+strlen(szEnd));
+				AppendSpace(out);
+				continue;
+			}
+			if(c=='&')
+			{
+				size_t nUsed=Entity(in,n,i,out);
+				if(nUsed)
+				{
+					i+=nUsed;
+					continue;
+				}
+			}
+			if(c==' '||c=='\t'||c=='\r'||c=='\n')AppendSpace(out);
+			else out+=c;
+			i++;
+		}
+	}
+};
+
+class CRtfExtractor : public CTextExtractor {
+private:
+	static unsigned long Read32(const unsigned char* p)
+	{
+		return (unsigned long)p[0]|((unsigned long)p[1]<<8)|((unsigned long)p[2]<<16)|((unsigned long)p[3]<<24);
+	}
+public:
+	static bool IsCompressed(const char* in, size_t n)
+	{
+		// Compressed RTF header: compressed size, raw size, then 'LZFu' (compressed) or 'MELA' (not)
+		if(n<16)return false;
+		unsigned long nMagic=Read32((const unsigned char*)in+8);
+		return nMagic==0x75465a4c||nMagic==0x414c454d;
+	}
+	static bool Decompress(const char* in, size_t n, std::string& out, size_t nMaxOut)
+	{
+		// Compressed RTF (MS-OXRTFCP): LZ77 against a 4KB ring buffer primed with common RTF
+		static const char szPrebuf[]=
+			"{\\rtf1\\ansi\\mac\\deff0\\deftab720{\\fonttbl;}"
+			"{\\f0\\fnil \\froman \\fswiss \\fmodern \\fscript "
+			"\\fdecor MS Sans SerifSymbolArialTimes New RomanCourier"
+			"{\\colortbl\\red0\\green0\\blue0\r\n\\par "
+			"\\pard\\plain\\f0\\fs20\\b\\i\\u\\tab\\tx";
+		if(!IsCompressed(in,n))return false;
+		const unsigned char* p=(const unsigned char*)in;
+		unsigned long nCompressed=Read32(p), nRaw=Read32(p+4);
+		size_t nEnd=std::min(n,(size_t)nCompressed+4);
+		if(nEnd<16)return false;
+		out.reserve(std::min((size_t)nRaw,nMaxOut));
+		if(Read32(p+8)==0x414c454d)
+		{
+			out.assign(in+16,std::min(nEnd-16,std::min((size_t)nRaw,nMaxOut)));
+			return true;
+		}
+		unsigned char dict[4096];
+		const size_t nPrebuf=sizeof(szPrebuf)-1;
+		memcpy(dict,szPrebuf,nPrebuf);
+		memset(dict+nPrebuf,0,sizeof(dict)-nPrebuf);
+		size_t nWrite=nPrebuf;
+		size_t i=16;
+		while(i<nEnd&&out.size()<nMaxOut)
+		{
+			unsigned char nControl=p[i++];
+			for(int bit=0;bit<8&&i<nEnd;++bit)
+			{
+				if(!(nControl&(1<<bit)))
+				{
+					out+=(char)p[i];
+					dict[nWrite]=p[i++];
+					nWrite=(nWrite+1)&4095;
+					continue;
+				}
+				if(i+1>=nEnd)return false;
+				unsigned int nRef=(p[i]<<8)|p[i+1];
+				i+=2;
+				size_t nOffset=nRef>>4, nLength=(nRef&15)+2;
+				if(nOffset==nWrite)return true; // End marker
+				for(size_t k=0;k<nLength;++k)
+				{
+					unsigned char b=dict[(nOffset+k)&4095];
+					out+=(char)b;
+					dict[nWrite]=b;
+					nWrite=(nWrite+1)&4095;
+				}
+			}
+		}
+		return true;
+	}
+	static void ToText(const char* in, size_t n, std::string& out, const CExtractLimits& limits)
+	{
+		// Text of an RTF document: control words are dropped, except for breaks and escaped
+		// characters, as are groups that hold no document text (font tables, pictures and so on)
+		static const char* szSkip[]={"fonttbl","colortbl","stylesheet","info","pict","object","header","footer",
+			"headerl","headerr","footerl","footerr","listtable","listoverridetable","revtbl","rsidtbl","generator","xmlnstbl","themedata","datastore"};
+		std::vector<int> skipDepth; // Depths of groups being skipped
+		int nDepth=0;
+		int nUnicodeSkip=1; // Characters following \uN, from \ucN
+		size_t nCheck=m_nCheckEvery;
+		for(size_t i=0;i<n;)
+		{
+			if(i>=nCheck)
+			{
+				if(limits.Expired()||limits.Full(out))return;
+				nCheck=i+m_nCheckEvery;
+			}
+			bool bSkipping=!skipDepth.empty();
+			char c=in[i];
+			if(c=='{')
+			{
+				nDepth++;
+				i++;
+				if(i+1<n&&in[i]=='\\'&&in[i+1]=='*')skipDepth.push_back(nDepth); // Optional destination
+				continue;
+			}
+			if(c=='}')
+			{
+				if(!skipDepth.empty()&&skipDepth.back()==nDepth)skipDepth.pop_back();
+				nDepth--;
+				i++;
+				continue;
+			}
+			if(c=='\r'||c=='\n')
+			{
+				i++;
+				continue;
+			}
+			if(c!='\\')
+			{
+				if(!bSkipping)out+=c;
+				i++;
+				continue;
+			}
+			// Control symbol or word
+			if(++i>=n)break;
+			c=in[i];
+			if(c=='\\'||c=='{'||c=='}')
+			{
+				if(!bSkipping)out+=c;
+				i++;
+				continue;
+			}
+			if(c=='\'')
+			{
+				// 8 bit character as two hex digits
+				if(i+2<n&&!bSkipping)
+				{
+					char szHex[3]={in[i+1],in[i+2],0};
+					unsigned long nChar=strtoul(szHex,0,16);
+					out+=(nChar<128?(char)nChar:' ');
+				}
+				i+=3;
+				continue;
+			}
+			if(!isalpha((unsigned char)c))
+			{
+				if(c=='~'&&!bSkipping)out+=' ';
+				i++;
+				continue;
+			}
+			size_t nWord=i;
+			while(i<n&&isalpha((unsigned char)in[i]))i++;
+			std::string strWord(in+nWord,i-nWord);
+			bool bParam=false;
+			long nParam=0;
+			size_t nParamStart=i;
+			if(i<n&&(in[i]=='-'||isdigit((unsigned char)in[i])))
+			{
+				i++;
+				while(i<n&&isdigit((unsigned char)in[i]))i++;
+				nParam=strtol(std::string(in+nParamStart,i-nParamStart).c_str(),0,10);
+				bParam=true;
+			}
+			if(i<n&&in[i]==' ')i++; // The delimiting space belongs to the control word
+			if(bSkipping)continue;
+			for(size_t k=0;k<sizeof(szSkip)/sizeof(szSkip[0]);++k)
+			{
+				if(strWord==szSkip[k])
+				{
+					skipDepth.push_back(nDepth);
+					break;
+				}
+			}
+			if(!skipDepth.empty())continue;
+			if(strWord=="par"||strWord=="line"||strWord=="sect"||strWord=="page"||strWord=="row")out+='\n';
+			else if(strWord=="tab"||strWord=="cell")out+='\t';
+			else if(strWord=="uc"&&bParam)nUnicodeSkip=(int)nParam;
+			else if(strWord=="u"&&bParam)
+			{
+				// Unicode character, followed by its ANSI fallback, which is skipped
+				if(nParam<0)nParam+=65536;
+				out+=(nParam<128?(char)nParam:' ');
+				for(int k=0;k<nUnicodeSkip&&i<n;++k)
+				{
+					if(in[i]=='\\'&&i+1<n&&in[i+1]=='\'')i+=4;
+					else if(in[i]=='{'||in[i]=='}'||in[i]=='\\')break;
+					else i++;
+				}
+			}
+		}
+	}
+	const char* Name() const { return "rtf"; }
+	bool Accepts(const std::string& strExtn) const { return strExtn=="rtf"; }
+	void Extract(const char* in, size_t n, std::string& out, const CExtractLimits& limits) const
+	{
+		if(!IsCompressed(in,n))
+		{
+			ToText(in,n,out,limits);
+			return;
+		}
+		std::string strRtf;
+		if(Decompress(in,n,strRtf,16*1024*1024))ToText(strRtf.data(),strRtf.size(),out,limits);
+	}
+};
+
+class CExtractorPool {
+private:
+	std::vector<std::unique_ptr<CTextExtractor> > m_extractors;
+	CBoundedQueue<std::function<void()> > m_queue;
+	std::vector<std::thread> m_threads;
+	size_t m_nMaxBytes; // Read from each attachment
+	unsigned long m_nMaxMs; // Spent on each attachment
+
+	CExtractorPool(const CExtractorPool&);
+	CExtractorPool& operator=(const CExtractorPool&);
+
+	void Loop()
+	{
+		std::function<void()> job;
+		while(m_queue.Pop(job))job();
+	}
+public:
+	CExtractorPool(unsigned int nThreads, size_t nMaxBytes, unsigned long nMaxMs):
+		m_queue(4*nThreads+4, std::max((size_t)64*1024*1024, 4*nMaxBytes)), m_nMaxBytes(nMaxBytes), m_nMaxMs(nMaxMs)
+		{
+			m_extractors.push_back(std::unique_ptr<CTextExtractor>(new CPlainTextExtractor));
+			m_extractors.push_back(std::unique_ptr<CTextExtractor>(new CHtmlExtractor));
+			m_extractors.push_back(std::unique_ptr<CTextExtractor>(new CRtfExtractor));
+			if(nThreads<1)nThreads=1;
+			for(unsigned int i=0;i<nThreads;++i)m_threads.push_back(std::thread(&CExtractorPool::Loop, this));
+		}
+	~CExtractorPool()
+	{
+		m_queue.Close();
+		for(size_t i=0;i<m_threads.size();++i)m_threads[i].join();
+	}
+	size_t MaxBytes() const { return m_nMaxBytes; }
+	const CTextExtractor* Find(const std::string& strFileName) const
+	{
+		// By extension; null where no extractor handles it
+		size_t pos=strFileName.rfind('.');
+		if(pos==std::string::npos)return 0;
+		std::string strExtn=strFileName.substr(pos+1);
+		std::transform(strExtn.begin(), strExtn.end(), strExtn.begin(), tolower);
+		for(size_t i=0;i<m_extractors.size();++i)
+			if(m_extractors[i]->Accepts(strExtn))return m_extractors[i].get();
+		return 0;
+	}
+	std::future<std::string> Submit(const CTextExtractor* pExtractor, std::string&& strContent)
+	{
+		// The content is owned by the job, so an abandoned result costs nothing but the work
+		std::shared_ptr<std::promise<std::string> > pResult(new std::promise<std::string>());
+		std::shared_ptr<std::string> pContent(new std::string());
+		pContent->swap(strContent);
+		std::future<std::string> result=pResult->get_future();
+		size_t nBytes=pContent->size();
+		const size_t nMaxOut=m_nMaxBytes;
+		const unsigned long nMaxMs=m_nMaxMs;
+		if(!m_queue.Push([pExtractor,pResult,pContent,nMaxOut,nMaxMs]()
+			{
+				std::string strText;
+				try {
+					pExtractor->Extract(pContent->data(),pContent->size(),strText,CExtractLimits(nMaxMs,nMaxOut));
+				}
+				catch(...)
+				{
+				}
+				pResult->set_value(strText);
+			}, nBytes))
+		{
+			pResult->set_value(std::string());
+		}
+		return result;
+	}
+	std::string ExtractRtf(const std::vector<unsigned char>& vCompressed) const
+	{
+		// Compressed RTF of a message body, extracted on the calling thread
+		std::string strText;
+		if(!vCompressed.empty())
+			CRtfExtractor().Extract((const char*)&vCompressed[0],vCompressed.size(),strText,CExtractLimits(m_nMaxMs,m_nMaxBytes));
+		return strText;
+	}
+};
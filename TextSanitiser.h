@@ -0,0 +1,239 @@
+#pragma once
+
+// Filters text for a CDATA section exactly as CleanString does: keeps tab, line feed, carriage
+// return and 0x20-0x7F, drops every other byte, and turns ]]> into ]]&gt;. Most body text is
+// plain printable ASCII, so the SSE2 and AVX2 versions check 16 or 32 bytes at a time and copy
+// them straight through, only stepping byte by byte around a dropped byte or a ']'.
+// The widest version the processor supports is chosen at run time.
+//
+// Every version writes at most 2*n bytes to out and returns the number written.
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(_M_X64)||defined(_M_IX86)||defined(__x86_64__)||defined(__i386__)
+#define PSTREADER_SANITISER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(PSTREADER_SANITISER_X86)&&!defined(_MSC_VER)
+#define PSTREADER_TARGET(x) __attribute__((target(x)))
+#else
+#define PSTREADER_TARGET(x)
+#endif
+
+typedef size_t (*SanitiseFn)(const char* in, size_t n, char* out);
+
+static inline void SanitiseStep(const char* in, size_t n, size_t& i, char*& out)
+{
+	// One byte of the reference filter, consuming three on ]]>
+	char wcIn=in[i];
+	if(wcIn==']'&&i+2<n&&in[i+1]==']'&&in[i+2]=='>')
+	{
+		memcpy(out, "]]&gt;", 6);
+		out+=6;
+		i+=3;
+		return;
+	}
+	unsigned char u=(unsigned char)wcIn;
+	if((u>8&&u<14&&u!=11&&u!=12)||(u>31&&u<128))
+		*out++=wcIn;
+	++i;
+}
+
+static size_t SanitiseScalar(const char* in, size_t n, char* out)
+{
+	char* const outStart=out;
+	size_t i=0;
+	while(i<n)SanitiseStep(in, n, i, out);
+	return out-outStart;
+}
+
+#ifdef PSTREADER_SANITISER_X86
+
+static inline unsigned int SanitiseFirstBit(unsigned int nMask)
+{
+#ifdef _MSC_VER
+	unsigned long nIndex;
+	_BitScanForward(&nIndex, nMask);
+	return nIndex;
+#else
+	return __builtin_ctz(nMask);
+#endif
+}
+
+PSTREADER_TARGET("sse2")
+static size_t SanitiseSSE2(const char* in, size_t n, char* out)
+{
+	char* const outStart=out;
+	const __m128i vSpace=_mm_set1_epi8(0x1F), vTab=_mm_set1_epi8(9), vLF=_mm_set1_epi8(10), vCR=_mm_set1_epi8(13), vBracket=_mm_set1_epi8(']');
+	size_t i=0;
+	while(i+16<=n)
+	{
+		__m128i v=_mm_loadu_si128((const __m128i*)(in+i));
+		// Plain bytes: above 0x1F (signed, so 8 bit bytes fail) or one of the kept controls, and not ']'
+		__m128i vKeep=_mm_or_si128(_mm_cmpgt_epi8(v, vSpace),
+			_mm_or_si128(_mm_cmpeq_epi8(v, vTab), _mm_or_si128(_mm_cmpeq_epi8(v, vLF), _mm_cmpeq_epi8(v, vCR))));
+		__m128i vPlain=_mm_andnot_si128(_mm_cmpeq_epi8(v, vBracket), vKeep);
+		unsigned int nMask=(unsigned int)_mm_movemask_epi8(vPlain);
+		// The whole block is stored either way; only the plain prefix of it is kept
+		_mm_storeu_si128((__m128i*)out, v);
+		if(nMask==0xFFFF)
+		{
+			out+=16;
+			i+=16;
+			continue;
+		}
+		unsigned int nPlain=SanitiseFirstBit(~nMask);
+		out+=nPlain;
+		i+=nPlain;
+		SanitiseStep(in, n, i, out);
+	}
+	while(i<n)SanitiseStep(in, n, i, out);
+	return out-outStart;
+}
+
+PSTREADER_TARGET("avx2")
+static size_t SanitiseAVX2(const char* in, size_t n, char* out)
+{
+	char* const outStart=out;
+	const __m256i vSpace=_mm256_set1_epi8(0x1F), vTab=_mm256_set1_epi8(9), vLF=_mm256_set1_epi8(10), vCR=_mm256_set1_epi8(13), vBracket=_mm256_set1_epi8(']');
+	size_t i=0;
+	while(i+32<=n)
+	{
+		__m256i v=_mm256_loadu_si256((const __m256i*)(in+i));
+		__m256i vKeep=_mm256_or_si256(_mm256_cmpgt_epi8(v, vSpace),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, vTab), _mm256_or_si256(_mm256_cmpeq_epi8(v, vLF), _mm256_cmpeq_epi8(v, vCR))));
+		__m256i vPlain=_mm256_andnot_si256(_mm256_cmpeq_epi8(v, vBracket), vKeep);
+		unsigned int nMask=(unsigned int)_mm256_movemask_epi8(vPlain);
+		_mm256_storeu_si256((__m256i*)out, v);
+		if(nMask==0xFFFFFFFF)
+		{
+			out+=32;
+			i+=32;
+			continue;
+		}
+		unsigned int nPlain=SanitiseFirstBit(~nMask);
+		out+=nPlain;
+		i+=nPlain;
+		SanitiseStep(in, n, i, out);
+	}
+	// Finish off with the narrower version rather than byte by byte
+	return (out-outStart)+SanitiseSSE2(in+i, n-i, out);
+}
+
+static bool SanitiserHasAVX2()
+{
+	// AVX2 needs both the instructions and the OS saving the ymm registers
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0]<7)return false;
+	__cpuid(info, 1);
+	bool bOSXSave=(info[2]&(1<<27))!=0, bAVX=(info[2]&(1<<28))!=0;
+	if(!bOSXSave||!bAVX)return false;
+	if((_xgetbv(0)&6)!=6)return false;
+	__cpuidex(info, 7, 0);
+	return (info[1]&(1<<5))!=0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2")!=0;
+#endif
+}
+
+static bool SanitiserHasSSE2()
+{
+#if defined(_M_X64)||defined(__x86_64__)
+	return true; // Part of x64
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3]&(1<<26))!=0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2")!=0;
+#endif
+}
+
+#endif // PSTREADER_SANITISER_X86
+
+static const char* SanitiserName(SanitiseFn fn)
+{
+#ifdef PSTREADER_SANITISER_X86
+	if(fn==SanitiseAVX2)return "AVX2";
+	if(fn==SanitiseSSE2)return "SSE2";
+#endif
+	return "scalar";
+}
+
+static SanitiseFn SelectSanitiser()
+{
+#ifdef PSTREADER_SANITISER_X86
+	if(SanitiserHasAVX2())return SanitiseAVX2;
+	if(SanitiserHasSSE2())return SanitiseSSE2;
+#endif
+	return SanitiseScalar;
+}
+
+static size_t SanitiseText(const char* in, size_t n, char* out)
+{
+	static const SanitiseFn fn=SelectSanitiser();
+	return fn(in, n, out);
+}
+
+// JSON string content, filtered the same way: kept control characters and '"' and '\'
+// are written as escapes. Runs of plain bytes are found 16 at a time where SSE2 is part
+// of the instruction set (x64), otherwise byte by byte.
+static size_t EscapeJsonText(const char* in, size_t n, char* out)
+{
+	char* const outStart=out;
+	size_t i=0;
+	while(i<n)
+	{
+		size_t nRun=i;
+#if defined(_M_X64)||defined(__x86_64__)
+		const __m128i vSpace=_mm_set1_epi8(0x1F), vQuote=_mm_set1_epi8('"'), vBackslash=_mm_set1_epi8('\\');
+		while(nRun+16<=n)
+		{
+			__m128i v=_mm_loadu_si128((const __m128i*)(in+nRun));
+			__m128i vPlain=_mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vQuote), _mm_cmpeq_epi8(v, vBackslash)), _mm_cmpgt_epi8(v, vSpace));
+			unsigned int nMask=(unsigned int)_mm_movemask_epi8(vPlain);
+			_mm_storeu_si128((__m128i*)(out+(nRun-i)), v);
+			if(nMask!=0xFFFF)
+			{
+				nRun+=SanitiseFirstBit(~nMask);
+				break;
+			}
+			nRun+=16;
+		}
+		out+=nRun-i;
+		i=nRun;
+#endif
+		// Byte by byte up to and including the next byte needing attention
+		while(i<n)
+		{
+			char c=in[i++];
+			unsigned char u=(unsigned char)c;
+			if(u>31&&u<128&&c!='"'&&c!='\\')
+			{
+				*out++=c;
+				continue;
+			}
+			if(c=='"'||c=='\\')
+			{
+				*out++='\\';
+				*out++=c;
+			}
+			else if(c=='\t'||c=='\n'||c=='\r')
+			{
+				*out++='\\';
+				*out++=(c=='\t'?'t':(c=='\n'?'n':'r'));
+			}
+			break; // Anything else is dropped
+		}
+	}
+	return out-outStart;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+// Work-stealing task scheduler. Every worker has its own deque: it pushes and pops new work
+// at the back (depth first, so a single worker visits tasks in the order they would have
+// been visited recursively), and when it runs dry steals the oldest task from the front
+// of another worker's deque. Running tasks may push further tasks; Run() returns once
+// every task has completed. A worker with nothing to do calls the idle function, if given,
+// every few milliseconds until more work arrives.
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <chrono>
+
+template<typename Task>
+class CWorkStealingPool {
+private:
+	struct CWorkerQueue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+	std::vector<std::unique_ptr<CWorkerQueue> > m_queues;
+	std::atomic<size_t> m_nOutstanding; // Pushed but not yet completed
+	std::atomic<bool> m_bAbort;
+	std::mutex m_mutexIdle;
+	std::condition_variable m_cvIdle;
+	std::exception_ptr m_exception; // First exception thrown by a task, rethrown by Run()
+
+	CWorkStealingPool(const CWorkStealingPool&);
+	CWorkStealingPool& operator=(const CWorkStealingPool&);
+
+	bool PopLocal(unsigned int nWorker, Task& task)
+	{
+		CWorkerQueue& q=*m_queues[nWorker];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if(q.tasks.empty())return false;
+		task=std::move(q.tasks.back());
+		q.tasks.pop_back();
+		return true;
+	}
+	bool Steal(unsigned int nWorker, Task& task)
+	{
+		for(size_t i=1;i<m_queues.size();++i)
+		{
+			CWorkerQueue& q=*m_queues[(nWorker+i)%m_queues.size()];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if(q.tasks.empty())continue;
+			task=std::move(q.tasks.front());
+			q.tasks.pop_front();
+			return true;
+		}
+		return false;
+	}
+	template<typename F, typename I>
+	void WorkerLoop(unsigned int nWorker, F& fn, I& idle)
+	{
+		for(;;)
+		{
+			Task task;
+			if(PopLocal(nWorker, task)||Steal(nWorker, task))
+			{
+				if(!m_bAbort)
+				{
+					try {
+						fn(nWorker, task);
+					}
+					catch(...)
+					{
+						std::lock_guard<std::mutex> lock(m_mutexIdle);
+						if(!m_exception)m_exception=std::current_exception();
+						m_bAbort=true;
+					}
+				}
+				if(--m_nOutstanding==0)
+				{
+					std::lock_guard<std::mutex> lock(m_mutexIdle);
+					m_cvIdle.notify_all();
+				}
+				continue;
+			}
+			if(!m_bAbort)
+			{
+				try {
+					idle(nWorker);
+				}
+				catch(...)
+				{
+					std::lock_guard<std::mutex> lock(m_mutexIdle);
+					if(!m_exception)m_exception=std::current_exception();
+					m_bAbort=true;
+				}
+			}
+			std::unique_lock<std::mutex> lock(m_mutexIdle);
+			if(m_nOutstanding==0)return;
+			// Pushes notify, but a short timeout keeps a missed wake-up from costing more than a moment
+			m_cvIdle.wait_for(lock, std::chrono::milliseconds(5));
+		}
+	}
+public:
+	CWorkStealingPool(unsigned int nWorkers):m_nOutstanding(0),m_bAbort(false)
+	{
+		if(nWorkers<1)nWorkers=1;
+		for(unsigned int i=0;i<nWorkers;++i)m_queues.push_back(std::unique_ptr<CWorkerQueue>(new CWorkerQueue));
+	}
+	unsigned int Workers() const { return (unsigned int)m_queues.size(); }
+	void Push(unsigned int nWorker, Task&& task)
+	{
+		m_nOutstanding++;
+		{
+			CWorkerQueue& q=*m_queues[nWorker%m_queues.size()];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.tasks.push_back(std::move(task));
+		}
+		std::lock_guard<std::mutex> lock(m_mutexIdle);
+		m_cvIdle.notify_one();
+	}
+	template<typename F>
+	void Run(F fn)
+	{
+		Run(fn, [](unsigned int) {});
+	}
+	template<typename F, typename I>
+	void Run(F fn, I idle)
+	{
+		// fn(nWorker, task) and idle(nWorker) are called on worker nWorker; worker 0 is the calling thread
+		std::vector<std::thread> threads;
+		for(unsigned int i=1;i<m_queues.size();++i)
+			threads.push_back(std::thread([this, i, &fn, &idle]() { WorkerLoop(i, fn, idle); }));
+		WorkerLoop(0, fn, idle);
+		for(size_t i=0;i<threads.size();++i)threads[i].join();
+		if(m_exception)std::rethrow_exception(m_exception);
+	}
+};